@@ -0,0 +1,264 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "../share/crypto.h"
+#include "../version.h"
+
+enum BenchPattern { PATTERN_FLAT = 0, PATTERN_CHAINS, PATTERN_SPLIT };
+
+const char *bench_pattern_names[] = {"flat", "chains", "split"};
+const int bench_pattern_count =
+    sizeof(bench_pattern_names) / sizeof(bench_pattern_names[0]);
+
+const size_t bench_sizes[] = {64,        256,        1024,       4096,
+                              16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+const int bench_size_count = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+
+#define BENCH_CHAIN_SIZE 4096
+#define BENCH_BATCH_BYTES (8 * 1024 * 1024)
+#define BENCH_BATCH_MAX 256
+
+struct BenchResult {
+  size_t ops = 0;
+  size_t bytes = 0;
+  size_t allocs = 0;
+  double ns = 0;
+};
+
+static size_t alloc_count = 0;
+
+static void *CountMalloc(size_t size) {
+  ++alloc_count;
+  return malloc(size);
+}
+
+static void *CountRealloc(void *ptr, size_t size) {
+  ++alloc_count;
+  return realloc(ptr, size);
+}
+
+static void CountFree(void *ptr) { free(ptr); }
+
+static inline double ElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Builds an evbuffer holding `data`, either as one chain or as a list of
+// BENCH_CHAIN_SIZE chains like a socket read produces.
+static evbuffer *NewPayload(const unsigned char *data, size_t size,
+                            int pattern) {
+  evbuffer *buf = evbuffer_new();
+  if (pattern != PATTERN_CHAINS) {
+    evbuffer_add(buf, data, size);
+    return buf;
+  }
+
+  for (size_t pos = 0; pos < size; pos += BENCH_CHAIN_SIZE) {
+    size_t len = size - pos < BENCH_CHAIN_SIZE ? size - pos : BENCH_CHAIN_SIZE;
+    evbuffer *chain = evbuffer_new();
+    evbuffer_add(chain, data + pos, len);
+    evbuffer_add_buffer(buf, chain);
+    evbuffer_free(chain);
+  }
+  return buf;
+}
+
+static void PrintResult(const char *algorithm, const char *op, int pattern,
+                        size_t size, const BenchResult &result) {
+  printf(
+      "{\"cipher\":\"%s\",\"op\":\"%s\",\"pattern\":\"%s\",\"size\":%zu,"
+      "\"ops\":%zu,\"ns_per_op\":%.1f,\"gb_per_s\":%.3f,"
+      "\"allocs_per_op\":%.2f}\n",
+      algorithm, op, bench_pattern_names[pattern], size, result.ops,
+      result.ns / result.ops, result.bytes / result.ns,
+      (double)result.allocs / result.ops);
+  fflush(stdout);
+}
+
+// Encrypts batches of `size` bytes with one session and decrypts them with
+// another, timing both sides separately and checking the round trip. The
+// parts arrive in one input buffer the way a socket fills it, and what is
+// incomplete stays there for the next one.
+static bool BenchCase(CryptoCreator *creator, const char *algorithm,
+                      const unsigned char *payload, size_t size, int pattern,
+                      double duration_ns) {
+  Crypto encoder(creator), decoder(creator);
+  BenchResult encrypt, decrypt;
+
+  size_t i, batch = BENCH_BATCH_BYTES / size;
+  if (batch < 1) batch = 1;
+  if (batch > BENCH_BATCH_MAX) batch = BENCH_BATCH_MAX;
+
+  std::vector<evbuffer *> inputs(batch), outputs(batch), parts;
+  evbuffer *pending = evbuffer_new(), *decoded = evbuffer_new();
+  bool ok = true;
+
+  while (ok && encrypt.ns + decrypt.ns < duration_ns) {
+    for (i = 0; i < batch; ++i) {
+      inputs[i] = NewPayload(payload, size, pattern);
+      outputs[i] = evbuffer_new();
+    }
+
+    alloc_count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < batch && ok; ++i) {
+      ok = encoder.Encrypt(inputs[i], size, outputs[i]) == CRYPTO_OK;
+    }
+    encrypt.ns += ElapsedNs(start);
+    encrypt.allocs += alloc_count;
+    encrypt.ops += batch;
+    encrypt.bytes += batch * size;
+    for (i = 0; i < batch; ++i) {
+      evbuffer_free(inputs[i]);
+    }
+    if (!ok) {
+      for (i = 0; i < batch; ++i) {
+        evbuffer_free(outputs[i]);
+      }
+      break;
+    }
+
+    parts.clear();
+    for (i = 0; i < batch; ++i) {
+      size_t len = evbuffer_get_length(outputs[i]);
+      unsigned char *data = evbuffer_pullup(outputs[i], len);
+      if (pattern == PATTERN_SPLIT) {
+        size_t half = len / 2 + 7 < len ? len / 2 + 7 : len / 2;
+        parts.push_back(NewPayload(data, half, pattern));
+        parts.push_back(NewPayload(data + half, len - half, pattern));
+      } else {
+        parts.push_back(NewPayload(data, len, pattern));
+      }
+      evbuffer_free(outputs[i]);
+    }
+
+    alloc_count = 0;
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < parts.size() && ok; ++i) {
+      evbuffer_add_buffer(pending, parts[i]);
+      ok = decoder.Decrypt(pending, decoded) != CRYPTO_ERROR;
+    }
+    decrypt.ns += ElapsedNs(start);
+    decrypt.allocs += alloc_count;
+    decrypt.ops += batch;
+    decrypt.bytes += batch * size;
+
+    for (i = 0; i < parts.size(); ++i) {
+      evbuffer_free(parts[i]);
+    }
+    while (ok && evbuffer_get_length(decoded) >= size) {
+      ok = memcmp(evbuffer_pullup(decoded, size), payload, size) == 0;
+      evbuffer_drain(decoded, size);
+    }
+  }
+
+  ok = ok && evbuffer_get_length(decoded) == 0 &&
+       evbuffer_get_length(pending) == 0;
+  evbuffer_free(pending);
+  evbuffer_free(decoded);
+
+  if (!ok) {
+    fprintf(stderr,
+            "{\"cipher\":\"%s\",\"pattern\":\"%s\",\"size\":%zu,"
+            "\"error\":\"round trip mismatch\"}\n",
+            algorithm, bench_pattern_names[pattern], size);
+    return false;
+  }
+
+  PrintResult(algorithm, "encrypt", pattern, size, encrypt);
+  PrintResult(algorithm, "decrypt", pattern, size, decrypt);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *short_options = "m:d:S:vh";
+  struct option long_options[] = {{"algorithm", required_argument, NULL, 'm'},
+                                  {"duration", required_argument, NULL, 'd'},
+                                  {"size", required_argument, NULL, 'S'},
+                                  {"version", no_argument, NULL, 'v'},
+                                  {"help", no_argument, NULL, 'h'},
+                                  {0, 0, 0, 0}};
+
+  int duration = 200, size = 0;
+  std::string algorithm;
+  while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'm':
+        algorithm = optarg;
+        break;
+
+      case 'd':
+        duration = atoi(optarg);
+        break;
+
+      case 'S':
+        size = atoi(optarg);
+        break;
+
+      case 'v':
+        quit("weaknet-bench-crypto version " PROJECT_VERSION);
+        break;
+
+      default:
+        usage(argv[0],
+              "Usage: %s [options]\n"
+              "Options:\n"
+              " -m or --algorithm <algorithm>, default all\n"
+              " -d or --duration <ms>, time per case, default 200\n"
+              " -S or --size <bytes>, default 64 to 1048576\n"
+              " -v or --version\n"
+              " -h or --help\n"
+              "\n");
+        break;
+    }
+  }
+
+  if (duration < 1) {
+    quit("invalid option: duration");
+  }
+
+  if (size < 0 || size > 16 * 1024 * 1024) {
+    quit("invalid option: size");
+  }
+
+  event_set_mem_functions(CountMalloc, CountRealloc, CountFree);
+
+  std::string error;
+
+  if (!CryptoCreator::Init(error)) {
+    quit(error.c_str());
+  }
+
+  std::vector<size_t> sizes;
+  if (size > 0) {
+    sizes.push_back(size);
+  } else {
+    sizes.assign(bench_sizes, bench_sizes + bench_size_count);
+  }
+
+  std::vector<unsigned char> payload(sizes.back());
+  randombytes_buf(payload.data(), payload.size());
+
+  bool ok = true;
+  for (const std::string &name : CryptoCreator::Algorithms()) {
+    if (!algorithm.empty() && algorithm != name) continue;
+
+    CryptoCreator *creator =
+        CryptoCreator::NewInstance(name.c_str(), "weaknet-bench");
+    for (size_t bytes : sizes) {
+      for (int pattern = 0; pattern < bench_pattern_count; ++pattern) {
+        ok &= BenchCase(creator, name.c_str(), payload.data(), bytes, pattern,
+                        duration * 1e6);
+      }
+    }
+  }
+
+  return ok ? 0 : 1;
+}
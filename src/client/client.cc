@@ -2,9 +2,73 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <thread>
+
 #include "local.h"
 #include "../version.h"
 
+enum {
+  OPT_MEM_PREFAULT = 256,
+  OPT_MEM_HUGEPAGE,
+  OPT_MEM_BUDGET,
+  OPT_COALESCE_DELAY,
+  OPT_CRYPTO_THREADS,
+  OPT_THREADS,
+  OPT_FAST_OPEN,
+  OPT_IO_URING,
+  OPT_READ_SIZE,
+  OPT_IDLE_TRIM,
+  OPT_WINDOW_UP,
+  OPT_WINDOW_DOWN,
+  OPT_WINDOW_ADAPTIVE,
+  OPT_HANDSHAKE_TIMEOUT,
+  OPT_CONNECT_TIMEOUT,
+  OPT_IDLE_TIMEOUT,
+  OPT_WARM_POOL,
+  OPT_WARM_AGE,
+  OPT_REMOTE_RACE,
+  OPT_UDP_RELAY,
+  OPT_UDP_TIMEOUT,
+  OPT_MUX,
+};
+
+#ifndef SYS_WINDOWS
+static void OnDumpSignal(evutil_socket_t sig, short what, void *ctx) {
+  mempool_dump(stderr);
+  size_t sessions = LocalClient::Count();
+  fprintf(stderr, "sessions: %zu, %zu bytes in use each\n", sessions,
+          sessions ? mempool_used() / sessions : 0);
+  budget_dump(stderr);
+  warm_pool_dump(stderr);
+  remote_dump(stderr);
+  udp_relay_dump(stderr);
+  mux_dump(stderr);
+}
+#endif
+
+// One reactor: its own event_base, resolver and listener, sharing the
+// CryptoCreator and options with the others.
+static event_base *NewReactor(CryptoCreator *creator, unsigned short port,
+                              const SessionOptions *options) {
+  event_base *base = event_base_new();
+  if (!base) {
+    quit("incredible: event_base_new error");
+  }
+
+  evdns_base *dnsbase = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+  if (!dnsbase) {
+    quit("incredible: evdns_base_new error");
+  }
+
+  std::string error;
+  LocalServer *server =
+      new LocalServer(base, dnsbase, creator, port, options);
+  if (!server->Startup(error)) {
+    quit(error.c_str());
+  }
+  return base;
+}
+
 int main(int argc, char *argv[]) {
   int opt;
   const char *short_options = "p:m:s:R:vh";
@@ -12,6 +76,49 @@ int main(int argc, char *argv[]) {
                                   {"algorithm", required_argument, NULL, 'm'},
                                   {"password", required_argument, NULL, 's'},
                                   {"remote-addr", required_argument, NULL, 'R'},
+                                  {"mem-prefault", required_argument, NULL,
+                                   OPT_MEM_PREFAULT},
+                                  {"mem-hugepage", no_argument, NULL,
+                                   OPT_MEM_HUGEPAGE},
+                                  {"mem-budget", required_argument, NULL,
+                                   OPT_MEM_BUDGET},
+                                  {"coalesce-delay", required_argument, NULL,
+                                   OPT_COALESCE_DELAY},
+                                  {"crypto-threads", required_argument, NULL,
+                                   OPT_CRYPTO_THREADS},
+                                  {"threads", required_argument, NULL,
+                                   OPT_THREADS},
+                                  {"fast-open", no_argument, NULL,
+                                   OPT_FAST_OPEN},
+                                  {"io-uring", no_argument, NULL,
+                                   OPT_IO_URING},
+                                  {"read-size", required_argument, NULL,
+                                   OPT_READ_SIZE},
+                                  {"idle-trim", required_argument, NULL,
+                                   OPT_IDLE_TRIM},
+                                  {"window-up", required_argument, NULL,
+                                   OPT_WINDOW_UP},
+                                  {"window-down", required_argument, NULL,
+                                   OPT_WINDOW_DOWN},
+                                  {"window-adaptive", no_argument, NULL,
+                                   OPT_WINDOW_ADAPTIVE},
+                                  {"handshake-timeout", required_argument,
+                                   NULL, OPT_HANDSHAKE_TIMEOUT},
+                                  {"connect-timeout", required_argument, NULL,
+                                   OPT_CONNECT_TIMEOUT},
+                                  {"idle-timeout", required_argument, NULL,
+                                   OPT_IDLE_TIMEOUT},
+                                  {"warm-pool", required_argument, NULL,
+                                   OPT_WARM_POOL},
+                                  {"warm-age", required_argument, NULL,
+                                   OPT_WARM_AGE},
+                                  {"remote-race", required_argument, NULL,
+                                   OPT_REMOTE_RACE},
+                                  {"udp-relay", no_argument, NULL,
+                                   OPT_UDP_RELAY},
+                                  {"udp-timeout", required_argument, NULL,
+                                   OPT_UDP_TIMEOUT},
+                                  {"mux", required_argument, NULL, OPT_MUX},
                                   {"version", no_argument, NULL, 'v'},
                                   {"help", no_argument, NULL, 'h'},
                                   {0, 0, 0, 0}};
@@ -20,7 +127,10 @@ int main(int argc, char *argv[]) {
   char **parsed_argv = NULL;
   parse_cmdline(argc, argv, &parsed_argc, &parsed_argv);
 
-  int port = 1080, remote_port = 51080;
+  int port = 1080, remote_port = 51080, mem_prefault = 0, mem_budget = 0,
+      crypto_threads = 0, window_up = 512, window_down = 512;
+  bool mem_hugepage = false, io_uring = false;
+  SessionOptions options;
   std::string algorithm, password, remote_addr;
   while ((opt = getopt_long(parsed_argc, parsed_argv, short_options,
                             long_options, NULL)) != -1) {
@@ -38,7 +148,98 @@ int main(int argc, char *argv[]) {
         break;
 
       case 'R':
-        remote_addr = optarg;
+        if (!remote_addr.empty()) {
+          remote_addr += ",";
+        }
+        remote_addr += optarg;
+        break;
+
+      case OPT_MEM_PREFAULT:
+        mem_prefault = atoi(optarg);
+        break;
+
+      case OPT_MEM_HUGEPAGE:
+        mem_hugepage = true;
+        break;
+
+      case OPT_MEM_BUDGET:
+        mem_budget = atoi(optarg);
+        break;
+
+      case OPT_COALESCE_DELAY:
+        options.coalesce_delay = atoi(optarg);
+        break;
+
+      case OPT_CRYPTO_THREADS:
+        crypto_threads = atoi(optarg);
+        break;
+
+      case OPT_THREADS:
+        options.threads = atoi(optarg);
+        break;
+
+      case OPT_FAST_OPEN:
+        options.fast_open = true;
+        break;
+
+      case OPT_IO_URING:
+        io_uring = true;
+        break;
+
+      case OPT_READ_SIZE:
+        options.read_size = atoi(optarg);
+        break;
+
+      case OPT_IDLE_TRIM:
+        options.idle_trim = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_UP:
+        window_up = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_DOWN:
+        window_down = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_ADAPTIVE:
+        options.adaptive_window = true;
+        break;
+
+      case OPT_HANDSHAKE_TIMEOUT:
+        options.handshake_timeout = atoi(optarg);
+        break;
+
+      case OPT_CONNECT_TIMEOUT:
+        options.connect_timeout = atoi(optarg);
+        break;
+
+      case OPT_IDLE_TIMEOUT:
+        options.idle_timeout = atoi(optarg);
+        break;
+
+      case OPT_WARM_POOL:
+        options.warm_pool = atoi(optarg);
+        break;
+
+      case OPT_WARM_AGE:
+        options.warm_age = atoi(optarg);
+        break;
+
+      case OPT_REMOTE_RACE:
+        options.remote_race = atoi(optarg);
+        break;
+
+      case OPT_UDP_RELAY:
+        options.udp_relay = true;
+        break;
+
+      case OPT_UDP_TIMEOUT:
+        options.udp_timeout = atoi(optarg);
+        break;
+
+      case OPT_MUX:
+        options.mux = atoi(optarg);
         break;
 
       case 'v':
@@ -53,9 +254,50 @@ int main(int argc, char *argv[]) {
               " -m or --algorithm <algorithm>, support list:\n"
               "    chacha20, chacha20-ietf,\n"
               "    chacha20-ietf-poly1305,\n"
-              "    xchacha20-ietf-poly1305\n"
+              "    xchacha20-ietf-poly1305,\n"
+              "    aes-128-gcm, aes-192-gcm, aes-256-gcm\n"
               " -s or --password <password>\n"
-              " -R or --remote-addr <ip:port>\n"
+              " -R or --remote-addr <ip:port>[,<ip:port>...], may\n"
+              "    repeat, sessions go to the remote connecting fastest\n"
+              " --mem-prefault <MB>, pool memory mapped at startup\n"
+              " --mem-hugepage, back the pool with huge pages\n"
+              " --mem-budget <MB>, pause accepts and shed sessions\n"
+              "    near that much memory, default 0 (unbounded)\n"
+              " --coalesce-delay <us>, hold partial chunks of bulk\n"
+              "    transfers, default 1000, 0 to disable\n"
+              " --crypto-threads <count>, workers for large AEAD\n"
+              "    buffers, default 0 (inline)\n"
+              " --threads <count>, reactor threads sharing the port,\n"
+              "    default 1\n"
+              " --fast-open, TCP Fast Open on the listener and on\n"
+              "    outbound connects\n"
+              " --io-uring, drive sockets through io_uring\n"
+              " --read-size <bytes>, most read from a socket per\n"
+              "    event, default 16384\n"
+              " --idle-trim <s>, free spare memory of sessions idle\n"
+              "    that long, default 0 (never)\n"
+              " --window-up <KB>, upload data queued before reading\n"
+              "    pauses, default 512\n"
+              " --window-down <KB>, same for downloads, default 512\n"
+              " --window-adaptive, size the windows from the drain\n"
+              "    rate and round trips of each connection\n"
+              " --handshake-timeout <s>, close sessions without a\n"
+              "    complete request by then, default 15, 0 never\n"
+              " --connect-timeout <s>, close sessions whose target\n"
+              "    has not connected by then, default 15, 0 never\n"
+              " --idle-timeout <s>, close sessions that read nothing\n"
+              "    for that long, default 0 (never)\n"
+              " --warm-pool <count>, connections to the remote opened\n"
+              "    ahead of requests per thread, default 0\n"
+              " --warm-age <s>, replace warm connections that old,\n"
+              "    default 10, below the server's handshake timeout\n"
+              " --remote-race <ms>, also connect to the next best\n"
+              "    remote after that long, default 0 (never)\n"
+              " --udp-relay, relay SOCKS5 UDP on the same port\n"
+              " --udp-timeout <s>, forget UDP peers silent that long,\n"
+              "    default 60\n"
+              " --mux <count>, carry sessions as streams over that\n"
+              "    many tunnels per thread, default 0 (off)\n"
               " -v or --version\n"
               " -h or --help\n"
               "\n");
@@ -69,6 +311,78 @@ int main(int argc, char *argv[]) {
     quit("invalid option: port");
   }
 
+  if (mem_prefault < 0) {
+    quit("invalid option: mem-prefault");
+  }
+
+  if (mem_budget < 0) {
+    quit("invalid option: mem-budget");
+  }
+  options.mem_budget = (size_t)mem_budget << 20;
+
+  if (options.coalesce_delay > 1000000) {
+    quit("invalid option: coalesce-delay");
+  }
+
+  if (options.read_size &&
+      (options.read_size < 4096 || options.read_size > 4194304)) {
+    quit("invalid option: read-size");
+  }
+
+  if (options.idle_trim > 86400) {
+    quit("invalid option: idle-trim");
+  }
+
+  if (options.handshake_timeout > 86400) {
+    quit("invalid option: handshake-timeout");
+  }
+
+  if (options.connect_timeout > 86400) {
+    quit("invalid option: connect-timeout");
+  }
+
+  if (options.idle_timeout > 86400) {
+    quit("invalid option: idle-timeout");
+  }
+
+  if (options.warm_pool > 1024) {
+    quit("invalid option: warm-pool");
+  }
+
+  if (options.warm_age < 1 || options.warm_age > 86400) {
+    quit("invalid option: warm-age");
+  }
+
+  if (options.remote_race > 10000) {
+    quit("invalid option: remote-race");
+  }
+
+  if (options.udp_timeout < 1 || options.udp_timeout > 86400) {
+    quit("invalid option: udp-timeout");
+  }
+
+  if (options.mux > 64) {
+    quit("invalid option: mux");
+  }
+
+  if (window_up < 16 || window_up > 65536) {
+    quit("invalid option: window-up");
+  }
+  options.up_window = window_up * 1024;
+
+  if (window_down < 16 || window_down > 65536) {
+    quit("invalid option: window-down");
+  }
+  options.down_window = window_down * 1024;
+
+  if (options.threads < 1 || options.threads > 256) {
+    quit("invalid option: threads");
+  }
+
+  if (crypto_threads < 0 || crypto_threads > 256) {
+    quit("invalid option: crypto-threads");
+  }
+
   if (algorithm.empty()) {
     quit("invalid option: algorithm");
   }
@@ -82,58 +396,60 @@ int main(int argc, char *argv[]) {
   }
 
   network_init();
+  mempool_init(mem_prefault, mem_hugepage);
 
-  sockaddr_storage target_addr;
-  int addr_len = sizeof(target_addr);
+  std::string error;
 
-  if (evutil_parse_sockaddr_port(remote_addr.c_str(), (sockaddr *)&target_addr,
-                                 &addr_len)) {
-    quit("invalid option: remote addr");
-  }
-  if (target_addr.ss_family == AF_INET) {
-    sockaddr_in *addr4 = (sockaddr_in *)&target_addr;
-    if (!addr4->sin_port) {
-      addr4->sin_port = htons(remote_port);
+  size_t start = 0;
+  while (start <= remote_addr.size()) {
+    size_t end = remote_addr.find(',', start);
+    if (end == std::string::npos) {
+      end = remote_addr.size();
     }
-  } else {
-    sockaddr_in6 *addr6 = (sockaddr_in6 *)&target_addr;
-    if (!addr6->sin6_port) {
-      addr6->sin6_port = htons(remote_port);
+    if (!remote_add(remote_addr.substr(start, end - start).c_str(),
+                    remote_port, error)) {
+      quit(error.c_str());
     }
+    start = end + 1;
   }
 
-  std::string error;
-
   if (!CryptoCreator::Init(error)) {
     quit(error.c_str());
   }
 
+  if (!crypto_workers_init(crypto_threads, error)) {
+    quit(error.c_str());
+  }
+
+  if (!io_stream_init(io_uring, error)) {
+    quit(error.c_str());
+  }
+
   CryptoCreator *creator =
       CryptoCreator::NewInstance(algorithm.c_str(), password.c_str());
   if (!creator) {
     quit("invalid option: algorithm, not supported");
   }
 
-  event_base *base = event_base_new();
-  if (!base) {
-    quit("incredible: event_base_new error");
+  std::vector<event_base *> bases;
+  for (unsigned int i = 0; i < options.threads; ++i) {
+    bases.push_back(NewReactor(creator, port, &options));
   }
 
-  evdns_base *dnsbase = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
-  if (!dnsbase) {
-    quit("incredible: evdns_base_new error");
+#ifndef SYS_WINDOWS
+  event *dump_event = evsignal_new(bases[0], SIGUSR1, OnDumpSignal, NULL);
+  if (dump_event) {
+    event_add(dump_event, NULL);
   }
+#endif
 
-  LocalServer *server =
-      new LocalServer(base, dnsbase, creator, port, &target_addr);
-  if (!server->Startup(error)) {
-    quit(error.c_str());
-  }
-
-  printf("listen on %d, algorithm: %s, remote: %s ...\n", port,
-         algorithm.c_str(), remote_addr.c_str());
+  printf("listen on %d, algorithm: %s, remote: %s, threads: %u ...\n", port,
+         algorithm.c_str(), remote_addr.c_str(), options.threads);
 
-  event_base_dispatch(base);
+  for (size_t i = 1; i < bases.size(); ++i) {
+    std::thread(event_base_dispatch, bases[i]).detach();
+  }
+  event_base_dispatch(bases[0]);
 
   return 0;
 }
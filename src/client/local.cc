@@ -2,16 +2,16 @@
 
 LocalServer::LocalServer(event_base *base, evdns_base *dnsbase,
                          CryptoCreator *creator, unsigned short port,
-                         const sockaddr_storage *remote_addr)
+                         const SessionOptions *options)
     : base_(base),
       dnsbase_(dnsbase),
       creator_(creator),
       port_(port),
-      remote_addr_(remote_addr) {}
+      options_(options) {}
 
 LocalServer::~LocalServer() {
   if (listener_) {
-    evconnlistener_free(listener_);
+    io_listener_free(listener_);
   }
 }
 
@@ -21,13 +21,65 @@ bool LocalServer::Startup(std::string &error) {
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = INADDR_ANY;
   sin.sin_port = htons(port_);
-  listener_ = evconnlistener_new_bind(base_, OnConnected, this,
-                                      LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
-                                      128, (sockaddr *)&sin, sizeof(sin));
+  unsigned int flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE;
+  if (options_->threads > 1) {
+    flags |= LEV_OPT_REUSEABLE_PORT;
+  }
+  listener_ = io_listener_new_bind(base_, OnConnected, this, flags, 128,
+                                   (sockaddr *)&sin, sizeof(sin));
   if (!listener_) {
     error = "bad listen on port: " + std::to_string(port_);
+    return false;
+  }
+
+  if (options_->fast_open) {
+    fast_open_listen(listener_);
+  }
+
+  if (options_->mem_budget) {
+    budget_watch(base_, listener_, options_->mem_budget,
+                 LocalClient::OnBudgetHeld, LocalClient::OnBudgetShed);
+  }
+
+  if (options_->udp_relay &&
+      !udp_relay_client(base_, port_, creator_, options_, error)) {
+    return false;
+  }
+
+  // Reactors are set up on the main thread, what keeps per thread state
+  // starts once the loop runs on its own.
+  event_base_once(base_, -1, EV_TIMEOUT, OnStarted, this, NULL);
+  return true;
+}
+
+void LocalServer::OnStarted(evutil_socket_t sock, short what, void *ctx) {
+  ((LocalServer *)ctx)->HandleStarted();
+}
+
+void LocalServer::HandleStarted() {
+  if (options_->handshake_timeout || options_->connect_timeout ||
+      options_->idle_timeout) {
+    timer_wheel_start(base_, LocalClient::OnTimerExpired);
+  }
+
+  if (options_->warm_pool) {
+    for (size_t id = 0; id < remote_count(); ++id) {
+      warm_pool_start(base_, remote_addr(id), options_->warm_pool,
+                      options_->warm_age);
+    }
   }
-  return !!listener_;
+
+  if (options_->mux) {
+    mux_client_start(base_, options_, OnMuxTunnel, this);
+  }
+}
+
+void LocalServer::OnMuxTunnel(void *ctx, bufferevent *end) {
+  ((LocalServer *)ctx)->HandleMuxTunnel(end);
+}
+
+void LocalServer::HandleMuxTunnel(bufferevent *end) {
+  (new LocalClient(base_, creator_, end, options_))->StartupTunnel();
 }
 
 void LocalServer::OnConnected(evconnlistener *listen, evutil_socket_t sock,
@@ -36,40 +88,110 @@ void LocalServer::OnConnected(evconnlistener *listen, evutil_socket_t sock,
 }
 
 void LocalServer::HandleConnected(evutil_socket_t sock) {
-  bufferevent *event =
-      bufferevent_socket_new(base_, sock, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent *event = io_stream_new(base_, sock);
   if (!event) {
     evutil_closesocket(sock);
     return;
   }
 
-  (new LocalClient(base_, dnsbase_, creator_->NewCrypto(), event, remote_addr_))
-      ->Startup();
+  (new LocalClient(base_, creator_, event, options_))->Startup();
 }
 
-LocalClient::LocalClient(event_base *base, evdns_base *dnsbase, Crypto *crypto,
-                         bufferevent *client,
-                         const sockaddr_storage *remote_addr)
-    : base_(base),
-      dnsbase_(dnsbase),
-      crypto_(crypto),
-      client_(client),
-      remote_addr_(remote_addr) {}
+std::atomic<size_t> LocalClient::count_{0};
+
+LocalClient::LocalClient(event_base *base, CryptoCreator *creator,
+                         bufferevent *client, const SessionOptions *options)
+    : client_(client),
+      crypto_(creator),
+      encoder_(&crypto_, base, OnClientEncoded, this),
+      decoder_(&crypto_, base, OnTargetDecoded, this),
+      coalescer_(base, options->coalesce_delay, OnCoalesceDeadline, this),
+      options_(options) {
+  count_ += 1;
+}
 
 LocalClient::~LocalClient() {
-  bufferevent_free(client_);
+  count_ -= 1;
+  budget_unlink(this);
+  timer_cancel(this);
+  if (target_pending_) {
+    connect_race_cancel(this);
+  }
+  SettleConnect(REMOTE_NONE, false);
+  if (client_) {
+    io_stream_free(client_);
+  }
   if (target_) {
-    bufferevent_free(target_);
+    io_stream_free(target_);
   }
   if (target_cached_) {
     evbuffer_free(target_cached_);
   }
-  crypto_->Release();
 }
 
 void LocalClient::Startup() {
   bufferevent_setcb(client_, OnClientRead, OnClientWrite, OnClientEvent, this);
+  bufferevent_set_window(client_, options_->down_window);
+  if (options_->read_size) {
+    bufferevent_set_max_single_read(client_, options_->read_size);
+  }
+  if (options_->idle_trim) {
+    bufferevent_set_idle(client_, options_->idle_trim);
+  }
   bufferevent_enable(client_, EV_READ | EV_WRITE);
+  encoder_.SetSource(client_);
+  if (options_->mem_budget) {
+    budget_link(this);
+  }
+  SetDeadline(options_->handshake_timeout);
+}
+
+// The tunnel's request is already in `client_`, it connects right away.
+void LocalClient::StartupTunnel() {
+  Startup();
+  target_cached_ = evbuffer_new();
+  ConnectTarget();
+}
+
+size_t LocalClient::OnBudgetHeld(BudgetLink *link) {
+  LocalClient *self = static_cast<LocalClient *>(link);
+  size_t held = io_stream_buffered(self->client_);
+  if (self->target_) {
+    held += io_stream_buffered(self->target_);
+  }
+  if (self->target_cached_) {
+    held += evbuffer_get_length(self->target_cached_);
+  }
+  return held;
+}
+
+void LocalClient::OnBudgetShed(BudgetLink *link) {
+  LocalClient *self = static_cast<LocalClient *>(link);
+  io_stream_reset(self->client_);
+  if (self->target_) {
+    io_stream_reset(self->target_);
+  }
+  self->Cleanup("shed: memory budget");
+}
+
+void LocalClient::OnTimerExpired(TimerNode *node) {
+  LocalClient *self = static_cast<LocalClient *>(node);
+  if (self->step_ < STEP_CONNECT) {
+    self->Cleanup("timeout: handshake");
+  } else if (self->step_ == STEP_CONNECT) {
+    self->SettleConnect(REMOTE_NONE, true);
+    self->Cleanup("timeout: connect");
+  } else {
+    self->Cleanup("timeout: idle");
+  }
+}
+
+void LocalClient::SetDeadline(unsigned int seconds) {
+  if (seconds) {
+    timer_set(this, seconds * 1000);
+  } else {
+    timer_cancel(this);
+  }
 }
 
 void LocalClient::Cleanup(const char *reason) {
@@ -78,7 +200,8 @@ void LocalClient::Cleanup(const char *reason) {
   dump(
       "cleanup: client: %d, target: %d, step: %d, %s\n"
       " - I/O bytes: client: %d/%d, target: %d/%d\n",
-      bufferevent_getfd(client_), target_ ? bufferevent_getfd(target_) : 0,
+      client_ ? bufferevent_getfd(client_) : 0,
+      target_ ? bufferevent_getfd(target_) : 0,
       step_, reason, client_read_bytes_, client_write_bytes_,
       target_read_bytes_, target_write_bytes_);
 
@@ -86,30 +209,93 @@ void LocalClient::Cleanup(const char *reason) {
   delete this;
 }
 
+// A socket from the warm pool is already connected, the salt and header go
+// out right away. Otherwise the best remote is connected, or raced against
+// the next best one. With mux tunnels the application's connection becomes
+// a stream of one of them instead, and the session ends here.
 void LocalClient::ConnectTarget() {
-  target_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (options_->mux && protocol_ != PROTOCOL_NONE) {
+    WriteReply();
+    mux_open(client_, target_cached_);
+    client_ = nullptr;
+    target_cached_ = nullptr;
+    Cleanup("carried by a tunnel");
+    return;
+  }
+
+  remote_ = remote_pick();
+  const sockaddr_storage *addr = remote_addr(remote_);
+  evutil_socket_t sock = options_->warm_pool ? warm_pool_take(addr) : -1;
+  target_ = io_stream_new(bufferevent_get_base(client_), sock);
   if (!target_) {
-    Cleanup("incredible: bufferevent_socket_new");
+    if (sock >= 0) {
+      evutil_closesocket(sock);
+    }
+    Cleanup("incredible: io_stream_new");
     return;
   }
 
   step_ = STEP_CONNECT;
+  SetDeadline(options_->connect_timeout);
   bufferevent_setcb(target_, OnTargetRead, OnTargetWrite, OnTargetEvent, this);
+  bufferevent_set_window(target_, options_->up_window);
+  if (options_->read_size) {
+    bufferevent_set_max_single_read(target_, options_->read_size);
+  }
+  if (options_->idle_trim) {
+    bufferevent_set_idle(target_, options_->idle_trim);
+  }
   bufferevent_enable(target_, EV_READ | EV_WRITE);
-  bufferevent_socket_connect(target_, (sockaddr *)remote_addr_,
-                             sizeof(*remote_addr_));
+  decoder_.SetSource(target_);
+  if (sock >= 0) {
+    HandleTargetReady();
+    return;
+  }
+
+  connect_started_ = connect_clock();
+  if (options_->remote_race) {
+    rival_ = remote_rival(remote_);
+  }
+  if (rival_ != REMOTE_NONE) {
+    std::vector<sockaddr_storage> addrs = {*addr, *remote_addr(rival_)};
+    target_pending_ = true;
+    connect_race(bufferevent_get_base(client_), addrs, options_->remote_race,
+                 OnTargetRaced, this);
+    return;
+  }
+  io_stream_connect(target_, (sockaddr *)addr, sizeof(*addr),
+                    options_->fast_open, target_fast_open_);
+}
+
+// For the remote statistics: `winner` connected, or with REMOTE_NONE the
+// remotes tried failed, or were given up on unless `failed`.
+void LocalClient::SettleConnect(uint8_t winner, bool failed) {
+  for (uint8_t id : {remote_, rival_}) {
+    if (id == REMOTE_NONE) continue;
+    if (id == winner) {
+      remote_connected(id, connect_started_);
+    } else if (failed) {
+      remote_failed(id);
+    } else {
+      remote_abandoned(id);
+    }
+  }
+  remote_ = REMOTE_NONE;
+  rival_ = REMOTE_NONE;
 }
 
 void LocalClient::OnClientRead(bufferevent *bev, void *ctx) {
   LocalClient *self = (LocalClient *)ctx;
-  evbuffer *buf = evbuffer_new();
-  int ret = bufferevent_read_buffer(bev, buf);
-  if (ret == 0) {
-    self->HandleClientRead(buf);
-  } else {
-    evbuffer_free(buf);
-    self->Cleanup("error: client read");
+  if (self->client_idle_) {
+    self->client_idle_ = false;
+    bufferevent_set_idle(bev, self->options_->idle_trim);
+  }
+
+  if (self->step_ == STEP_TRANSPORT && self->options_->idle_timeout) {
+    timer_extend(self, self->options_->idle_timeout * 1000);
   }
+
+  self->HandleClientRead();
 }
 
 void LocalClient::OnClientWrite(bufferevent *bev, void *ctx) {
@@ -118,21 +304,29 @@ void LocalClient::OnClientWrite(bufferevent *bev, void *ctx) {
 
 void LocalClient::OnClientEvent(bufferevent *bev, short what, void *ctx) {
   LocalClient *self = (LocalClient *)ctx;
-  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+  if (what & BEV_EVENT_TIMEOUT) {
+    self->HandleClientIdle();
+  } else if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
     self->HandleClientClose();
   }
 }
 
 void LocalClient::OnTargetRead(bufferevent *bev, void *ctx) {
   LocalClient *self = (LocalClient *)ctx;
-  evbuffer *buf = evbuffer_new();
-  int ret = bufferevent_read_buffer(bev, buf);
-  if (ret == 0)
-    self->HandleTargetRead(buf);
-  else {
-    evbuffer_free(buf);
-    self->Cleanup("error: target read");
+  if (self->target_idle_) {
+    self->target_idle_ = false;
+    bufferevent_set_idle(bev, self->options_->idle_trim);
+  }
+  if (self->step_ == STEP_TRANSPORT && self->options_->idle_timeout) {
+    timer_extend(self, self->options_->idle_timeout * 1000);
   }
+
+  if (self->target_fast_open_) {
+    fast_open_result(self->target_fast_open_, true);
+    self->target_fast_open_ = 0;
+  }
+
+  self->HandleTargetRead();
 }
 
 void LocalClient::OnTargetWrite(bufferevent *bev, void *ctx) {
@@ -143,16 +337,97 @@ void LocalClient::OnTargetEvent(bufferevent *bev, short what, void *ctx) {
   LocalClient *self = (LocalClient *)ctx;
   if (what & BEV_EVENT_CONNECTED) {
     self->HandleTargetReady();
+  } else if (what & BEV_EVENT_TIMEOUT) {
+    self->HandleTargetIdle();
   } else if (what & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    if (self->step_ == STEP_CONNECT) {
+      self->SettleConnect(REMOTE_NONE, true);
+    }
+    if ((what & BEV_EVENT_ERROR) && self->target_fast_open_) {
+      fast_open_result(self->target_fast_open_, false);
+      self->target_fast_open_ = 0;
+    }
     self->HandleTargetClose();
   }
 }
 
-void LocalClient::HandleClientRead(evbuffer *buf) {
+// `index` is 1 when the rival connected first, the remote picked first then
+// counts as slower than it.
+void LocalClient::OnTargetRaced(void *ctx, evutil_socket_t sock,
+                                size_t index) {
+  LocalClient *self = (LocalClient *)ctx;
+  self->target_pending_ = false;
+  if (sock < 0) {
+    self->SettleConnect(REMOTE_NONE, true);
+    self->Cleanup("error: connect, every remote failed");
+    return;
+  }
+
+  // The rival started the race delay later, at most.
+  if (index > 0) {
+    remote_outrun(self->remote_, self->connect_started_);
+    self->remote_ = self->rival_;
+    self->rival_ = REMOTE_NONE;
+    self->connect_started_ += std::min(connect_clock() - self->connect_started_,
+                                       self->options_->remote_race);
+  }
+  io_stream_attach(self->target_, sock);
+  self->HandleTargetReady();
+}
+
+void LocalClient::OnCoalesceDeadline(evutil_socket_t sock, short what,
+                                     void *ctx) {
+  ((LocalClient *)ctx)->HandleCoalesceDeadline();
+}
+
+// Output of a pool job, then whatever arrived while it ran.
+void LocalClient::OnClientEncoded(void *ctx, int result, evbuffer *out) {
+  LocalClient *self = (LocalClient *)ctx;
+  if (self->HandleClientEncoded(result, out)) {
+    self->HandleClientRead();
+  }
+}
+
+void LocalClient::OnTargetDecoded(void *ctx, int result, evbuffer *out) {
+  LocalClient *self = (LocalClient *)ctx;
+  if (!self->HandleTargetDecoded(result, out)) {
+    return;
+  }
+
+  if (self->target_closed_) {
+    self->HandleTargetClose();
+  } else {
+    self->HandleTargetRead();
+  }
+}
+
+// Once connected the client's input is encrypted in place into the target's
+// output; what the coalescer holds back, or what arrives while a pool job
+// runs, stays in the input until the next call.
+void LocalClient::HandleClientRead() {
+  evbuffer *input = bufferevent_get_input(client_);
+  if (step_ == STEP_INIT || step_ == STEP_WAITHDR) {
 #if USE_DEBUG
-  client_read_bytes_ += evbuffer_get_length(buf);
+    client_read_bytes_ += evbuffer_get_length(input);
 #endif
+    // The handshake gets a buffer of its own, the session may be gone
+    // before it is parsed.
+    evbuffer *buf = evbuffer_new();
+    evbuffer_add_buffer(buf, input);
+    ProcessHandshake(buf);
+  } else if (step_ == STEP_CONNECT) {
+    evbuffer_add_buffer(target_cached_, input);
+  } else if (step_ == STEP_ASSOCIATE) {
+    evbuffer_drain(input, evbuffer_get_length(input));
+  } else if (step_ == STEP_TRANSPORT && !encoder_.busy()) {
+    size_t ready = coalescer_.Push(input);
+    if (ready) {
+      WriteTarget(input, ready);
+    }
+  }
+}
 
+void LocalClient::ProcessHandshake(evbuffer *buf) {
   int data_len = evbuffer_get_length(buf);
   unsigned char *data = evbuffer_pullup(buf, data_len);
 
@@ -183,24 +458,8 @@ void LocalClient::HandleClientRead(evbuffer *buf) {
     } else {
       Cleanup("error: protocol block");
     }
-  } else if (step_ == STEP_WAITHDR) {
-    ProcessProtocolSOCKS5(data, data_len);
-  } else if (step_ == STEP_CONNECT) {
-    evbuffer_add_buffer(target_cached_, buf);
   } else {
-    buf_clear.release();
-
-    evbuffer *encoded = nullptr;
-    if (crypto_->Encrypt(buf, encoded) != CRYPTO_OK) {
-      Cleanup("error: client encrypt");
-      return;
-    }
-
-#if USE_DEBUG
-    target_write_bytes_ += evbuffer_get_length(encoded);
-#endif
-    bufferevent_write_buffer(target_, encoded);
-    evbuffer_free(encoded);
+    ProcessProtocolSOCKS5(data, data_len);
   }
 }
 
@@ -209,30 +468,46 @@ void LocalClient::HandleClientEmpty() {
     Cleanup("target closed");
   } else if (step_ == STEP_TRANSPORT && client_busy_) {
     client_busy_ = false;
+    if (options_->adaptive_window) {
+      bufferevent_adapt_window(client_, io_stream_fd(client_),
+                               io_stream_fd(target_));
+    }
     bufferevent_enable(target_, EV_READ);
   }
 }
 
 void LocalClient::HandleClientClose() { Cleanup("client closed"); }
 
+// Nothing read for the idle period, the read timeout stopped reading. Gives
+// back what this direction holds between reads and reads on without a
+// timeout until data comes in again.
+void LocalClient::HandleClientIdle() {
+  dump("idle: client: %d\n", bufferevent_getfd(client_));
+  bufferevent_trim(client_);
+  crypto_.Trim(true);
+  coalescer_.Trim();
+  client_idle_ = true;
+  bufferevent_set_idle(client_, 0);
+  bufferevent_enable(client_, EV_READ);
+}
+
 void LocalClient::HandleTargetReady() {
+  SettleConnect(remote_, false);
   step_ = STEP_TRANSPORT;
+  SetDeadline(options_->idle_timeout);
   dump("ready: client: %d, target: %d\n", bufferevent_getfd(client_),
        bufferevent_getfd(target_));
 
-  evbuffer *encoded = nullptr, *buf = target_cached_;
+  evbuffer *buf = target_cached_;
   target_cached_ = nullptr;
-  if (crypto_->Encrypt(buf, encoded) != CRYPTO_OK) {
-    Cleanup("error: client encrypt");
-    return;
+  bool written = WriteTarget(buf, evbuffer_get_length(buf));
+  evbuffer_free(buf);
+  if (written) {
+    WriteReply();
   }
+}
 
-#if USE_DEBUG
-  target_write_bytes_ += evbuffer_get_length(encoded);
-#endif
-  bufferevent_write_buffer(target_, encoded);
-  evbuffer_free(encoded);
-
+void LocalClient::WriteReply() {
   if (protocol_ == PROTOCOL_SOCKS4) {
     const static char socks4_resp[] = {0x00, 0x5A, 0x00, 0x00,
                                        0x00, 0x00, 0x10, 0x10};
@@ -251,50 +526,132 @@ void LocalClient::HandleTargetReady() {
   }
 }
 
-void LocalClient::HandleTargetRead(evbuffer *buf) {
+bool LocalClient::HandleTargetRead() {
+  evbuffer *input = bufferevent_get_input(target_);
+  evbuffer *output = bufferevent_get_output(client_);
 #if USE_DEBUG
-  target_read_bytes_ += evbuffer_get_length(buf);
+  size_t input_len = evbuffer_get_length(input);
+  size_t output_len = evbuffer_get_length(output);
 #endif
 
-  evbuffer *decoded = nullptr;
-  int cret = crypto_->Decrypt(buf, decoded);
-  if (cret == CRYPTO_NEED_NORE) {
-    return;
-  }
-  if (cret != CRYPTO_OK) {
+  int cret = decoder_.Decrypt(input, output);
+
+#if USE_DEBUG
+  target_read_bytes_ += input_len - evbuffer_get_length(input);
+  client_write_bytes_ += evbuffer_get_length(output) - output_len;
+#endif
+  return HandleTargetDecoded(cret, nullptr);
+}
+
+// `decoded` is only set for the output of a pool job, inline output is
+// already in the client's output.
+bool LocalClient::HandleTargetDecoded(int cret, evbuffer *decoded) {
+  if (cret == CRYPTO_ERROR) {
     Cleanup("error: target decrypt");
-    return;
+    return false;
   }
 
+  if (decoded) {
 #if USE_DEBUG
-  client_write_bytes_ += evbuffer_get_length(decoded);
+    client_write_bytes_ += evbuffer_get_length(decoded);
 #endif
-  bufferevent_write_buffer(client_, decoded);
-  evbuffer_free(decoded);
+    bufferevent_write_buffer(client_, decoded);
+    evbuffer_free(decoded);
+  }
 
-  if (bufferevent_output_busy(client_)) {
+  if (bufferevent_output_busy(client_) || decoder_.full()) {
     client_busy_ = true;
     bufferevent_disable(target_, EV_READ);
   }
+  return true;
 }
 
 void LocalClient::HandleTargetEmpty() {
   if (step_ == STEP_TRANSPORT && target_busy_) {
     target_busy_ = false;
+    if (options_->adaptive_window) {
+      bufferevent_adapt_window(target_, io_stream_fd(target_),
+                               io_stream_fd(client_));
+    }
     bufferevent_enable(client_, EV_READ);
   }
 }
 
 void LocalClient::HandleTargetClose() {
+  if (!decoder_.busy() && !HandleTargetRead()) {
+    return;
+  }
+
+  if (decoder_.busy()) {
+    target_closed_ = true;
+    return;
+  }
+
   if (evbuffer_get_length(bufferevent_get_output(client_)) == 0) {
     Cleanup("target closed");
   } else {
     step_ = STEP_FLUSHING;
+    // Done once all of it is written, not at the window's low mark.
+    bufferevent_setwatermark(client_, EV_WRITE, 0, 0);
     bufferevent_setcb(client_, NULL, OnClientWrite, OnClientEvent, this);
     bufferevent_disable(client_, EV_READ);
   }
 }
 
+void LocalClient::HandleTargetIdle() {
+  dump("idle: target: %d\n", bufferevent_getfd(target_));
+  bufferevent_trim(target_);
+  crypto_.Trim(false);
+  target_idle_ = true;
+  bufferevent_set_idle(target_, 0);
+  bufferevent_enable(target_, EV_READ);
+}
+
+void LocalClient::HandleCoalesceDeadline() {
+  evbuffer *input = bufferevent_get_input(client_);
+  size_t rest = coalescer_.Flush(input);
+  if (rest) {
+    WriteTarget(input, rest);
+  }
+}
+
+bool LocalClient::WriteTarget(evbuffer *buf, size_t len) {
+  evbuffer *output = bufferevent_get_output(target_);
+#if USE_DEBUG
+  size_t input_len = evbuffer_get_length(buf);
+  size_t output_len = evbuffer_get_length(output);
+#endif
+
+  int cret = encoder_.Encrypt(buf, len, output);
+
+#if USE_DEBUG
+  client_read_bytes_ += input_len - evbuffer_get_length(buf);
+  target_write_bytes_ += evbuffer_get_length(output) - output_len;
+#endif
+  return HandleClientEncoded(cret, nullptr);
+}
+
+bool LocalClient::HandleClientEncoded(int cret, evbuffer *encoded) {
+  if (cret == CRYPTO_ERROR) {
+    Cleanup("error: client encrypt");
+    return false;
+  }
+
+  if (encoded) {
+#if USE_DEBUG
+    target_write_bytes_ += evbuffer_get_length(encoded);
+#endif
+    bufferevent_write_buffer(target_, encoded);
+    evbuffer_free(encoded);
+  }
+
+  if (encoder_.full()) {
+    target_busy_ = true;
+    bufferevent_disable(client_, EV_READ);
+  }
+  return true;
+}
+
 void LocalClient::ProcessProtocolSOCKS4(unsigned char *data, int data_len) {
   if (data_len < 9 || data[data_len - 1] != 0x00) {
     Cleanup("error: socks4 header, size");
@@ -351,6 +708,10 @@ void LocalClient::ProcessProtocolSOCKS5(unsigned char *data, int data_len) {
     return;
   }
 
+  if (data[1] == 0x03 && options_->udp_relay) {
+    ProcessUdpAssociate();
+    return;
+  }
   if (data[1] != 0x01) {
     Cleanup("error: socks5 command");
     return;
@@ -382,6 +743,29 @@ void LocalClient::ProcessProtocolSOCKS5(unsigned char *data, int data_len) {
   ConnectTarget();
 }
 
+// The association holds while this connection stays open, without a
+// deadline. Its datagrams go to the UDP relay on the port the client
+// connected to, whatever address the request names.
+void LocalClient::ProcessUdpAssociate() {
+  sockaddr_storage local;
+  ev_socklen_t local_len = sizeof(local);
+  if (getsockname(io_stream_fd(client_), (sockaddr *)&local, &local_len) ||
+      local.ss_family != AF_INET) {
+    Cleanup("error: socks5 udp associate");
+    return;
+  }
+
+  const sockaddr_in *sin = (const sockaddr_in *)&local;
+  unsigned char resp[10] = {0x05, 0x00, 0x00, 0x01};
+  memcpy(resp + 4, &sin->sin_addr, 4);
+  memcpy(resp + 8, &sin->sin_port, 2);
+  evbuffer_add(bufferevent_get_output(client_), resp, sizeof(resp));
+
+  protocol_ = PROTOCOL_SOCKS5;
+  step_ = STEP_ASSOCIATE;
+  SetDeadline(0);
+}
+
 void LocalClient::ProcessProtocolCONNECT(unsigned char *data, int data_len) {
   const int address_start = 8;
   unsigned char *ptr = (unsigned char *)memchr(data + address_start, ' ',
@@ -1,12 +1,27 @@
 #pragma once
 
+#include <atomic>
+
+#include "../share/budget.h"
+#include "../share/coalesce.h"
+#include "../share/connect_race.h"
 #include "../share/crypto.h"
+#include "../share/crypto_worker.h"
+#include "../share/fast_open.h"
+#include "../share/io_stream.h"
+#include "../share/mempool.h"
+#include "../share/mux.h"
+#include "../share/options.h"
 #include "../share/protocol.h"
+#include "../share/remote_set.h"
+#include "../share/timer_wheel.h"
+#include "../share/udp_relay.h"
+#include "../share/warm_pool.h"
 
 class LocalServer {
  public:
   LocalServer(event_base *base, evdns_base *dnsbase, CryptoCreator *creator,
-              unsigned short port, const sockaddr_storage *remote_addr);
+              unsigned short port, const SessionOptions *options);
   ~LocalServer();
 
   bool Startup(std::string &error);
@@ -14,29 +29,50 @@ class LocalServer {
  private:
   static void OnConnected(evconnlistener *listen, evutil_socket_t sock,
                           sockaddr *addr, int len, void *ctx);
+  static void OnStarted(evutil_socket_t sock, short what, void *ctx);
+  static void OnMuxTunnel(void *ctx, bufferevent *end);
 
   void HandleConnected(evutil_socket_t sock);
+  void HandleStarted();
+  void HandleMuxTunnel(bufferevent *end);
 
   event_base *base_;
   evdns_base *dnsbase_;
   CryptoCreator *creator_;
   unsigned short port_;
   evconnlistener *listener_ = nullptr;
-  const sockaddr_storage *remote_addr_ = nullptr;
+  const SessionOptions *options_;
 };
 
-class LocalClient {
+class LocalClient : public BudgetLink, public TimerNode {
  public:
-  LocalClient(event_base *base, evdns_base *dnsbase, Crypto *crypto,
-              bufferevent *client, const sockaddr_storage *remote_addr);
+  LocalClient(event_base *base, CryptoCreator *creator, bufferevent *client,
+              const SessionOptions *options);
 
   void Startup();
+  // Carries the frames of a mux tunnel, `client` being its end of the pair,
+  // instead of an application's connection.
+  void StartupTunnel();
+
+  // Sessions alive in the process, all reactors together.
+  static size_t Count() { return count_; }
+
+  // For the memory budget: what a session buffers in both directions, and
+  // closing it.
+  static size_t OnBudgetHeld(BudgetLink *link);
+  static void OnBudgetShed(BudgetLink *link);
+  // Handshake, connect or idle deadline passed.
+  static void OnTimerExpired(TimerNode *node);
+
+  static void *operator new(size_t size) { return mempool_alloc(size); }
+  static void operator delete(void *ptr) { mempool_free(ptr); }
 
  private:
   ~LocalClient();
   void Cleanup(const char *reason);
 
   void ConnectTarget();
+  void SettleConnect(uint8_t winner, bool failed);
 
   static void OnClientRead(bufferevent *bev, void *ctx);
   static void OnClientWrite(bufferevent *bev, void *ctx);
@@ -44,31 +80,61 @@ class LocalClient {
   static void OnTargetRead(bufferevent *bev, void *ctx);
   static void OnTargetWrite(bufferevent *bev, void *ctx);
   static void OnTargetEvent(bufferevent *bev, short what, void *ctx);
+  static void OnTargetRaced(void *ctx, evutil_socket_t sock, size_t index);
+  static void OnCoalesceDeadline(evutil_socket_t sock, short what, void *ctx);
+  static void OnClientEncoded(void *ctx, int result, evbuffer *out);
+  static void OnTargetDecoded(void *ctx, int result, evbuffer *out);
 
-  void HandleClientRead(evbuffer *buf);
+  void HandleClientRead();
+  bool HandleClientEncoded(int cret, evbuffer *encoded);
   void HandleClientEmpty();
   void HandleClientClose();
+  void HandleClientIdle();
   void HandleTargetReady();
-  void HandleTargetRead(evbuffer *buf);
+  bool HandleTargetRead();
+  bool HandleTargetDecoded(int cret, evbuffer *decoded);
   void HandleTargetEmpty();
   void HandleTargetClose();
+  void HandleTargetIdle();
+  void HandleCoalesceDeadline();
+  void SetDeadline(unsigned int seconds);
+  void WriteReply();
+  bool WriteTarget(evbuffer *buf, size_t len);
 
+  void ProcessHandshake(evbuffer *buf);
   void ProcessProtocolSOCKS4(unsigned char *data, int data_len);
   void ProcessProtocolSOCKS5(unsigned char *data, int data_len);
+  void ProcessUdpAssociate();
   void ProcessProtocolCONNECT(unsigned char *data, int data_len);
   void ProcessProtocolPROXY(unsigned char *data, int data_len);
 
-  event_base *base_;
-  evdns_base *dnsbase_;
-  Crypto *crypto_;
+  // Kept small enough for the 512 byte pool class, what every read touches
+  // first and what only setup and teardown need after it.
   bufferevent *client_;
-  const sockaddr_storage *remote_addr_ = nullptr;
+  bufferevent *target_ = nullptr;
   mutable RuningStep step_ = STEP_INIT;
   RuningProtocol protocol_ = PROTOCOL_NONE;
-  bufferevent *target_ = nullptr;
-  evbuffer *target_cached_ = nullptr;
   bool client_busy_ = false;
   bool target_busy_ = false;
+  bool target_closed_ = false;
+  bool client_idle_ = false;
+  bool target_idle_ = false;
+  // A connect race will call back.
+  bool target_pending_ = false;
+  // Picked for the connect and raced against it, REMOTE_NONE once settled.
+  uint8_t remote_ = REMOTE_NONE;
+  uint8_t rival_ = REMOTE_NONE;
+  uint32_t connect_started_ = 0;
+  Crypto crypto_;
+  CryptoLane encoder_;
+  CryptoLane decoder_;
+  WriteCoalescer coalescer_;
+
+  const SessionOptions *options_;
+  evbuffer *target_cached_ = nullptr;
+  uint64_t target_fast_open_ = 0;
+
+  static std::atomic<size_t> count_;
 
 #if USE_DEBUG
   size_t client_read_bytes_ = 0;
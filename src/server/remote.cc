@@ -3,12 +3,17 @@
 #include <event2/bufferevent.h>
 
 RemoteServer::RemoteServer(event_base *base, evdns_base *dnsbase,
-                           CryptoCreator *creator, unsigned short port)
-    : base_(base), dnsbase_(dnsbase), creator_(creator), port_(port) {}
+                           CryptoCreator *creator, unsigned short port,
+                           const SessionOptions *options)
+    : base_(base),
+      dnsbase_(dnsbase),
+      creator_(creator),
+      port_(port),
+      options_(options) {}
 
 RemoteServer::~RemoteServer() {
   if (listener_) {
-    evconnlistener_free(listener_);
+    io_listener_free(listener_);
   }
 }
 
@@ -18,49 +23,152 @@ bool RemoteServer::Startup(std::string &error) {
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = INADDR_ANY;
   sin.sin_port = htons(port_);
-  listener_ = evconnlistener_new_bind(base_, OnConnected, this,
-                                      LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
-                                      128, (sockaddr *)&sin, sizeof(sin));
+  unsigned int flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE;
+  if (options_->threads > 1) {
+    flags |= LEV_OPT_REUSEABLE_PORT;
+  }
+  listener_ = io_listener_new_bind(base_, OnConnected, this, flags, 128,
+                                   (sockaddr *)&sin, sizeof(sin));
   if (!listener_) {
     error = "bad listen on port: " + std::to_string(port_);
+    return false;
+  }
+
+  if (options_->fast_open) {
+    fast_open_listen(listener_);
+  }
+
+  if (options_->mem_budget) {
+    budget_watch(base_, listener_, options_->mem_budget,
+                 RemoteClient::OnBudgetHeld, RemoteClient::OnBudgetShed);
+  }
+
+  if (options_->udp_relay && !udp_relay_server(base_, dnsbase_, port_,
+                                               creator_, options_, error)) {
+    return false;
+  }
+
+  // Reactors are set up on the main thread, what keeps per thread state
+  // starts once the loop runs on its own.
+  event_base_once(base_, -1, EV_TIMEOUT, OnStarted, this, NULL);
+  return true;
+}
+
+void RemoteServer::OnStarted(evutil_socket_t sock, short what, void *ctx) {
+  ((RemoteServer *)ctx)->HandleStarted();
+}
+
+void RemoteServer::HandleStarted() {
+  if (options_->handshake_timeout || options_->connect_timeout ||
+      options_->idle_timeout) {
+    timer_wheel_start(base_, RemoteClient::OnTimerExpired);
   }
-  return !!listener_;
 }
 
 void RemoteServer::OnConnected(evconnlistener *listen, evutil_socket_t sock,
                                sockaddr *addr, int len, void *ctx) {
-  ((RemoteServer *)ctx)->HandleConnected(sock);
+  ((RemoteServer *)ctx)->HandleConnected(sock, addr);
 }
 
-void RemoteServer::HandleConnected(evutil_socket_t sock) {
-  bufferevent *event =
-      bufferevent_socket_new(base_, sock, BEV_OPT_CLOSE_ON_FREE);
+void RemoteServer::HandleConnected(evutil_socket_t sock, sockaddr *addr) {
+  bufferevent *event = io_stream_new(base_, sock);
   if (!event) {
     evutil_closesocket(sock);
     return;
   }
 
-  (new RemoteClient(base_, dnsbase_, creator_->NewCrypto(), event))->Startup();
+  (new RemoteClient(base_, dnsbase_, creator_, event, addr, options_))
+      ->Startup();
 }
 
+std::atomic<size_t> RemoteClient::count_{0};
+
 RemoteClient::RemoteClient(event_base *base, evdns_base *dnsbase,
-                           Crypto *crypto, bufferevent *client)
-    : base_(base), dnsbase_(dnsbase), crypto_(crypto), client_(client) {}
+                           CryptoCreator *creator, bufferevent *client,
+                           const sockaddr *peer,
+                           const SessionOptions *options)
+    : client_(client),
+      crypto_(creator, peer),
+      encoder_(&crypto_, base, OnTargetEncoded, this),
+      decoder_(&crypto_, base, OnClientDecoded, this),
+      coalescer_(base, options->coalesce_delay, OnCoalesceDeadline, this),
+      dnsbase_(dnsbase),
+      options_(options) {
+  count_ += 1;
+}
 
 RemoteClient::~RemoteClient() {
-  bufferevent_free(client_);
+  count_ -= 1;
+  budget_unlink(this);
+  timer_cancel(this);
+  if (target_pending_) {
+    dns_cancel(this);
+    connect_race_cancel(this);
+  }
+  io_stream_free(client_);
   if (target_) {
-    bufferevent_free(target_);
+    io_stream_free(target_);
   }
   if (target_cached_) {
     evbuffer_free(target_cached_);
   }
-  crypto_->Release();
 }
 
 void RemoteClient::Startup() {
   bufferevent_setcb(client_, OnClientRead, OnClientWrite, OnClientEvent, this);
+  bufferevent_set_window(client_, options_->down_window);
+  if (options_->read_size) {
+    bufferevent_set_max_single_read(client_, options_->read_size);
+  }
+  if (options_->idle_trim) {
+    bufferevent_set_idle(client_, options_->idle_trim);
+  }
   bufferevent_enable(client_, EV_READ | EV_WRITE);
+  decoder_.SetSource(client_);
+  if (options_->mem_budget) {
+    budget_link(this);
+  }
+  SetDeadline(options_->handshake_timeout);
+}
+
+size_t RemoteClient::OnBudgetHeld(BudgetLink *link) {
+  RemoteClient *self = static_cast<RemoteClient *>(link);
+  size_t held = io_stream_buffered(self->client_);
+  if (self->target_) {
+    held += io_stream_buffered(self->target_);
+  }
+  if (self->target_cached_) {
+    held += evbuffer_get_length(self->target_cached_);
+  }
+  return held;
+}
+
+void RemoteClient::OnBudgetShed(BudgetLink *link) {
+  RemoteClient *self = static_cast<RemoteClient *>(link);
+  io_stream_reset(self->client_);
+  if (self->target_) {
+    io_stream_reset(self->target_);
+  }
+  self->Cleanup("shed: memory budget");
+}
+
+void RemoteClient::OnTimerExpired(TimerNode *node) {
+  RemoteClient *self = static_cast<RemoteClient *>(node);
+  if (self->step_ < STEP_CONNECT) {
+    self->Cleanup("timeout: handshake");
+  } else if (self->step_ == STEP_CONNECT) {
+    self->Cleanup("timeout: connect");
+  } else {
+    self->Cleanup("timeout: idle");
+  }
+}
+
+void RemoteClient::SetDeadline(unsigned int seconds) {
+  if (seconds) {
+    timer_set(this, seconds * 1000);
+  } else {
+    timer_cancel(this);
+  }
 }
 
 void RemoteClient::Cleanup(const char *reason) {
@@ -79,14 +187,16 @@ void RemoteClient::Cleanup(const char *reason) {
 
 void RemoteClient::OnClientRead(bufferevent *bev, void *ctx) {
   RemoteClient *self = (RemoteClient *)ctx;
-  evbuffer *buf = evbuffer_new();
-  int ret = bufferevent_read_buffer(bev, buf);
-  if (ret == 0) {
-    self->HandleClientRead(buf);
-  } else {
-    evbuffer_free(buf);
-    self->Cleanup("error: client read");
+  if (self->client_idle_) {
+    self->client_idle_ = false;
+    bufferevent_set_idle(bev, self->options_->idle_trim);
   }
+
+  if (self->step_ == STEP_TRANSPORT && self->options_->idle_timeout) {
+    timer_extend(self, self->options_->idle_timeout * 1000);
+  }
+
+  self->HandleClientRead();
 }
 
 void RemoteClient::OnClientWrite(bufferevent *bev, void *ctx) {
@@ -95,21 +205,29 @@ void RemoteClient::OnClientWrite(bufferevent *bev, void *ctx) {
 
 void RemoteClient::OnClientEvent(bufferevent *bev, short what, void *ctx) {
   RemoteClient *self = (RemoteClient *)ctx;
-  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+  if (what & BEV_EVENT_TIMEOUT) {
+    self->HandleClientIdle();
+  } else if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
     self->HandleClientClose();
   }
 }
 
 void RemoteClient::OnTargetRead(bufferevent *bev, void *ctx) {
   RemoteClient *self = (RemoteClient *)ctx;
-  evbuffer *buf = evbuffer_new();
-  int ret = bufferevent_read_buffer(bev, buf);
-  if (ret == 0)
-    self->HandleTargetRead(buf);
-  else {
-    evbuffer_free(buf);
-    self->Cleanup("error: target read");
+  if (self->target_idle_) {
+    self->target_idle_ = false;
+    bufferevent_set_idle(bev, self->options_->idle_trim);
   }
+  if (self->step_ == STEP_TRANSPORT && self->options_->idle_timeout) {
+    timer_extend(self, self->options_->idle_timeout * 1000);
+  }
+
+  if (self->target_fast_open_) {
+    fast_open_result(self->target_fast_open_, true);
+    self->target_fast_open_ = 0;
+  }
+
+  self->HandleTargetRead();
 }
 
 void RemoteClient::OnTargetWrite(bufferevent *bev, void *ctx) {
@@ -120,125 +238,213 @@ void RemoteClient::OnTargetEvent(bufferevent *bev, short what, void *ctx) {
   RemoteClient *self = (RemoteClient *)ctx;
   if (what & BEV_EVENT_CONNECTED) {
     self->HandleTargetReady();
+  } else if (what & BEV_EVENT_TIMEOUT) {
+    self->HandleTargetIdle();
   } else if (what & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    if ((what & BEV_EVENT_ERROR) && self->target_fast_open_) {
+      fast_open_result(self->target_fast_open_, false);
+      self->target_fast_open_ = 0;
+    }
     self->HandleTargetClose();
   }
 }
 
-void RemoteClient::HandleClientRead(evbuffer *buf) {
+void RemoteClient::OnCoalesceDeadline(evutil_socket_t sock, short what,
+                                      void *ctx) {
+  ((RemoteClient *)ctx)->HandleCoalesceDeadline();
+}
+
+// Output of a pool job, then whatever arrived while it ran.
+void RemoteClient::OnClientDecoded(void *ctx, int result, evbuffer *out) {
+  RemoteClient *self = (RemoteClient *)ctx;
+  if (out) {
 #if USE_DEBUG
-  client_read_bytes_ += evbuffer_get_length(buf);
+    if (self->step_ >= STEP_TRANSPORT) {
+      self->target_write_bytes_ += evbuffer_get_length(out);
+    }
 #endif
+    evbuffer_add_buffer(self->DecodeTarget(), out);
+    evbuffer_free(out);
+  }
 
-  evbuffer *decoded = nullptr;
-  int cret = crypto_->Decrypt(buf, decoded);
-  if (cret == CRYPTO_NEED_NORE) {
-    return;
+  if (self->HandleClientDecoded(result)) {
+    self->HandleClientRead();
   }
+}
 
-  if (cret != CRYPTO_OK) {
-    Cleanup("error: client decrypt");
+void RemoteClient::OnTargetEncoded(void *ctx, int result, evbuffer *out) {
+  RemoteClient *self = (RemoteClient *)ctx;
+  if (!self->HandleTargetEncoded(result, out)) {
     return;
   }
 
-  std::unique_ptr<evbuffer, decltype(&evbuffer_free)> decoded_clear(
-      decoded, &evbuffer_free);
+  if (self->target_closed_) {
+    self->HandleTargetClose();
+  } else {
+    self->HandleTargetRead();
+  }
+}
+
+bool RemoteClient::HandleClientRead() {
+  evbuffer *input = bufferevent_get_input(client_);
+  evbuffer *output = DecodeTarget();
+#if USE_DEBUG
+  size_t input_len = evbuffer_get_length(input);
+  size_t output_len = evbuffer_get_length(output);
+#endif
+
+  int cret = decoder_.Decrypt(input, output);
+
+#if USE_DEBUG
+  client_read_bytes_ += input_len - evbuffer_get_length(input);
+  if (step_ >= STEP_TRANSPORT) {
+    target_write_bytes_ += evbuffer_get_length(output) - output_len;
+  }
+#endif
+  return HandleClientDecoded(cret);
+}
+
+bool RemoteClient::HandleClientDecoded(int cret) {
+  if (cret == CRYPTO_ERROR) {
+    Cleanup("error: client decrypt");
+    return false;
+  }
 
   if (step_ == STEP_INIT) {
-    int data_len = evbuffer_get_length(decoded);
-    if (data_len < 4) {
-      Cleanup("error: proxy header, size");
-      return;
-    }
+    return cret != CRYPTO_OK || ProcessProxyHeader();
+  }
 
-    unsigned char *data = evbuffer_pullup(decoded, data_len);
-    int type = data[0], addr_pos = 1, addr_len = 0;
-    switch (type) {
-      case 1:  // IPV4
-        addr_len = 4;
-        break;
-      case 3:  // Domain
-        addr_pos = 2;
-        addr_len = data[1];
-        break;
-      case 4:  // IPV6
-        addr_len = 16;
-        break;
-      default:
-        Cleanup("error: proxy header, type");
-        return;
-    }
+  if (step_ == STEP_TRANSPORT &&
+      (bufferevent_output_busy(target_) || decoder_.full())) {
+    target_busy_ = true;
+    bufferevent_disable(client_, EV_READ);
+  }
+  return true;
+}
 
-    int drain_len = addr_pos + addr_len + 2;
-    if (drain_len > data_len) {
-      Cleanup("error: proxy header, addr");
-      return;
-    }
+// Decrypted data goes straight to the target once it is connected, until
+// then it is kept in `target_cached_`.
+evbuffer *RemoteClient::DecodeTarget() {
+  if (step_ >= STEP_TRANSPORT) {
+    return bufferevent_get_output(target_);
+  }
 
-    unsigned short port =
-        ntohs(*(unsigned short *)(data + addr_pos + addr_len));
-    if (!port) {
-      Cleanup("error: proxy header, port");
-      return;
-    }
+  if (!target_cached_) {
+    target_cached_ = evbuffer_new();
+  }
+  return target_cached_;
+}
 
-    target_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
-    if (!target_) {
-      Cleanup("incredible: bufferevent_socket_new");
-      return;
-    }
+bool RemoteClient::ProcessProxyHeader() {
+  int data_len = evbuffer_get_length(target_cached_);
+  if (data_len < 4) {
+    Cleanup("error: proxy header, size");
+    return false;
+  }
 
-    step_ = STEP_CONNECT;
-    bufferevent_setcb(target_, OnTargetRead, OnTargetWrite, OnTargetEvent,
-                      this);
-    bufferevent_enable(target_, EV_READ | EV_WRITE);
-
-    char *addr = (char *)data + addr_pos;
-    if (type == 3) {
-      addr[addr_len] = '\0';
-      bufferevent_socket_connect_hostname(target_, dnsbase_, AF_UNSPEC, addr,
-                                          port);
-    } else {
-      sockaddr_storage sa;
-
-      memset(&sa, 0, sizeof(sa));
-      if (type == 1) {
-        sockaddr_in *sin = (sockaddr_in *)&sa;
-        sin->sin_family = AF_INET;
-        memcpy(&sin->sin_addr.s_addr, addr, addr_len);
-        sin->sin_port = htons(port);
-      } else {
-        sockaddr_in6 *sin6 = (sockaddr_in6 *)&sa;
-        sin6->sin6_family = AF_INET6;
-        memcpy(sin6->sin6_addr.s6_addr, addr, addr_len);
-        sin6->sin6_port = htons(port);
-      }
-      bufferevent_socket_connect(target_, (sockaddr *)&sa, sizeof(sa));
-    }
+  unsigned char *data = evbuffer_pullup(target_cached_, data_len);
+  if (data[0] == MUX_ATYP) {
+    return AcceptTunnel(data[1]);
+  }
 
-    if (drain_len < data_len) {
-      evbuffer_drain(decoded, drain_len);
-      target_cached_ = decoded;
-      decoded_clear.release();
-    }
-  } else if (step_ == STEP_CONNECT) {
-    if (!target_cached_) {
-      target_cached_ = decoded;
-      decoded_clear.release();
-    } else {
-      evbuffer_add_buffer(target_cached_, decoded);
-    }
+  TargetAddr target;
+  const char *error = nullptr;
+  size_t drain_len = target_parse(data, data_len, target, error);
+  if (!drain_len) {
+    Cleanup(error);
+    return false;
+  }
+
+  target_ = io_stream_new(bufferevent_get_base(client_), -1);
+  if (!target_) {
+    Cleanup("incredible: io_stream_new");
+    return false;
+  }
+
+  step_ = STEP_CONNECT;
+  connect_started_ = connect_clock();
+  SetDeadline(options_->connect_timeout);
+  SetupTarget();
+
+  target_port_ = target.port;
+  TargetState state = target_connect(
+      target_, dnsbase_, target, options_, options_->fast_open,
+      target_fast_open_, OnTargetResolved, OnTargetRaced, this);
+
+  if (drain_len < (size_t)data_len) {
+    evbuffer_drain(target_cached_, drain_len);
   } else {
-#if USE_DEBUG
-    target_write_bytes_ += evbuffer_get_length(decoded);
-#endif
-    bufferevent_write_buffer(target_, decoded);
+    evbuffer_free(target_cached_);
+    target_cached_ = nullptr;
+  }
+  return ConnectStarted(state);
+}
 
-    if (bufferevent_output_busy(target_)) {
-      target_busy_ = true;
-      bufferevent_disable(client_, EV_READ);
-    }
+// A mux tunnel: its frames stand in for the target, ready at once.
+bool RemoteClient::AcceptTunnel(int version) {
+  if (version != MUX_VERSION) {
+    Cleanup("error: mux version");
+    return false;
   }
+
+  target_ = mux_accept(bufferevent_get_base(client_), dnsbase_, options_);
+  SetupTarget();
+  if (evbuffer_get_length(target_cached_) > MUX_HEADER_SIZE) {
+    evbuffer_drain(target_cached_, MUX_HEADER_SIZE);
+  } else {
+    evbuffer_free(target_cached_);
+    target_cached_ = nullptr;
+  }
+  HandleTargetReady();
+  return true;
+}
+
+void RemoteClient::SetupTarget() {
+  bufferevent_setcb(target_, OnTargetRead, OnTargetWrite, OnTargetEvent, this);
+  bufferevent_set_window(target_, options_->up_window);
+  if (options_->read_size) {
+    bufferevent_set_max_single_read(target_, options_->read_size);
+  }
+  if (options_->idle_trim) {
+    bufferevent_set_idle(target_, options_->idle_trim);
+  }
+  bufferevent_enable(target_, EV_READ | EV_WRITE);
+  encoder_.SetSource(target_);
+}
+
+// False once the session is gone.
+bool RemoteClient::ConnectStarted(TargetState state) {
+  target_pending_ = state == TARGET_PENDING;
+  if (state == TARGET_NO_SUCH_NAME) {
+    Cleanup("error: resolve, no such name");
+    return false;
+  }
+  if (state == TARGET_UNRESOLVED) {
+    Cleanup("error: resolve");
+    return false;
+  }
+  return true;
+}
+
+void RemoteClient::OnTargetResolved(void *ctx, const DnsAnswer &answer) {
+  RemoteClient *self = (RemoteClient *)ctx;
+  self->ConnectStarted(target_connect_answer(
+      self->target_, answer, self->target_port_, self->options_,
+      self->options_->fast_open, self->target_fast_open_, OnTargetRaced,
+      self));
+}
+
+void RemoteClient::OnTargetRaced(void *ctx, evutil_socket_t sock,
+                                 size_t index) {
+  RemoteClient *self = (RemoteClient *)ctx;
+  self->target_pending_ = false;
+  if (sock < 0) {
+    self->Cleanup("error: connect, every address failed");
+    return;
+  }
+
+  io_stream_attach(self->target_, sock);
+  self->HandleTargetReady();
 }
 
 void RemoteClient::HandleClientEmpty() {
@@ -246,14 +452,34 @@ void RemoteClient::HandleClientEmpty() {
     Cleanup("target closed");
   } else if (step_ == STEP_TRANSPORT && client_busy_) {
     client_busy_ = false;
+    if (options_->adaptive_window) {
+      bufferevent_adapt_window(client_, io_stream_fd(client_),
+                               io_stream_fd(target_));
+    }
     bufferevent_enable(target_, EV_READ);
   }
 }
 
 void RemoteClient::HandleClientClose() { Cleanup("client closed"); }
 
+// Nothing read for the idle period, the read timeout stopped reading. Gives
+// back what this direction holds between reads and reads on without a
+// timeout until data comes in again.
+void RemoteClient::HandleClientIdle() {
+  dump("idle: client: %d\n", bufferevent_getfd(client_));
+  bufferevent_trim(client_);
+  crypto_.Trim(false);
+  client_idle_ = true;
+  bufferevent_set_idle(client_, 0);
+  bufferevent_enable(client_, EV_READ);
+}
+
 void RemoteClient::HandleTargetReady() {
+  if (connect_started_) {
+    connect_latency(connect_started_);
+  }
   step_ = STEP_TRANSPORT;
+  SetDeadline(options_->idle_timeout);
   dump("ready: client: %d, target: %d\n", bufferevent_getfd(client_),
        bufferevent_getfd(target_));
 
@@ -267,43 +493,105 @@ void RemoteClient::HandleTargetReady() {
   }
 }
 
-void RemoteClient::HandleTargetRead(evbuffer *buf) {
-#if USE_DEBUG
-  target_read_bytes_ += evbuffer_get_length(buf);
-#endif
-
-  evbuffer *encoded = nullptr;
-  int cret = crypto_->Encrypt(buf, encoded);
-  if (cret != CRYPTO_OK) {
-    Cleanup("error: target encrypt");
-    return;
-  }
+// What the coalescer holds back stays in the target's input, and so does
+// everything read while a pool job runs, until OnTargetEncoded.
+void RemoteClient::HandleTargetRead() {
+  if (encoder_.busy()) return;
 
-#if USE_DEBUG
-  client_write_bytes_ += evbuffer_get_length(encoded);
-#endif
-  bufferevent_write_buffer(client_, encoded);
-  evbuffer_free(encoded);
-
-  if (bufferevent_output_busy(client_)) {
-    client_busy_ = true;
-    bufferevent_disable(target_, EV_READ);
+  size_t ready = coalescer_.Push(bufferevent_get_input(target_));
+  if (ready) {
+    WriteClient(ready);
   }
 }
 
 void RemoteClient::HandleTargetEmpty() {
   if (step_ == STEP_TRANSPORT && target_busy_) {
     target_busy_ = false;
+    if (options_->adaptive_window) {
+      bufferevent_adapt_window(target_, io_stream_fd(target_),
+                               io_stream_fd(client_));
+    }
     bufferevent_enable(client_, EV_READ);
   }
 }
 
 void RemoteClient::HandleTargetClose() {
+  if (!encoder_.busy()) {
+    size_t rest = coalescer_.Flush(bufferevent_get_input(target_));
+    if (rest && !WriteClient(rest)) {
+      return;
+    }
+  }
+
+  if (encoder_.busy()) {
+    target_closed_ = true;
+    return;
+  }
+
   if (evbuffer_get_length(bufferevent_get_output(client_)) == 0) {
     Cleanup("target closed");
   } else {
     step_ = STEP_FLUSHING;
+    // Done once all of it is written, not at the window's low mark.
+    bufferevent_setwatermark(client_, EV_WRITE, 0, 0);
     bufferevent_setcb(client_, NULL, OnClientWrite, OnClientEvent, this);
     bufferevent_disable(client_, EV_READ);
   }
 }
+
+void RemoteClient::HandleTargetIdle() {
+  dump("idle: target: %d\n", bufferevent_getfd(target_));
+  bufferevent_trim(target_);
+  crypto_.Trim(true);
+  coalescer_.Trim();
+  target_idle_ = true;
+  bufferevent_set_idle(target_, 0);
+  bufferevent_enable(target_, EV_READ);
+}
+
+void RemoteClient::HandleCoalesceDeadline() {
+  size_t rest = coalescer_.Flush(bufferevent_get_input(target_));
+  if (rest) {
+    WriteClient(rest);
+  }
+}
+
+bool RemoteClient::WriteClient(size_t len) {
+  evbuffer *input = bufferevent_get_input(target_);
+  evbuffer *output = bufferevent_get_output(client_);
+#if USE_DEBUG
+  size_t input_len = evbuffer_get_length(input);
+  size_t output_len = evbuffer_get_length(output);
+#endif
+
+  int cret = encoder_.Encrypt(input, len, output);
+
+#if USE_DEBUG
+  target_read_bytes_ += input_len - evbuffer_get_length(input);
+  client_write_bytes_ += evbuffer_get_length(output) - output_len;
+#endif
+  return HandleTargetEncoded(cret, nullptr);
+}
+
+// `encoded` is only set for the output of a pool job, inline output is
+// already in the client's output.
+bool RemoteClient::HandleTargetEncoded(int cret, evbuffer *encoded) {
+  if (cret == CRYPTO_ERROR) {
+    Cleanup("error: target encrypt");
+    return false;
+  }
+
+  if (encoded) {
+#if USE_DEBUG
+    client_write_bytes_ += evbuffer_get_length(encoded);
+#endif
+    bufferevent_write_buffer(client_, encoded);
+    evbuffer_free(encoded);
+  }
+
+  if (bufferevent_output_busy(client_) || encoder_.full()) {
+    client_busy_ = true;
+    bufferevent_disable(target_, EV_READ);
+  }
+  return true;
+}
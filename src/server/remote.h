@@ -1,12 +1,27 @@
 #pragma once
 
+#include <atomic>
+
+#include "../share/budget.h"
+#include "../share/coalesce.h"
+#include "../share/connect_race.h"
 #include "../share/crypto.h"
+#include "../share/crypto_worker.h"
+#include "../share/dns_cache.h"
+#include "../share/fast_open.h"
+#include "../share/io_stream.h"
+#include "../share/mempool.h"
+#include "../share/mux.h"
+#include "../share/options.h"
 #include "../share/protocol.h"
+#include "../share/target.h"
+#include "../share/timer_wheel.h"
+#include "../share/udp_relay.h"
 
 class RemoteServer {
  public:
   RemoteServer(event_base *base, evdns_base *dnsbase, CryptoCreator *creator,
-               unsigned short port);
+               unsigned short port, const SessionOptions *options);
   ~RemoteServer();
 
   bool Startup(std::string &error);
@@ -14,23 +29,40 @@ class RemoteServer {
  private:
   static void OnConnected(evconnlistener *listen, evutil_socket_t sock,
                           sockaddr *addr, int len, void *ctx);
+  static void OnStarted(evutil_socket_t sock, short what, void *ctx);
 
-  void HandleConnected(evutil_socket_t sock);
+  void HandleConnected(evutil_socket_t sock, sockaddr *addr);
+  void HandleStarted();
 
   event_base *base_;
   evdns_base *dnsbase_;
   CryptoCreator *creator_;
   unsigned short port_;
+  const SessionOptions *options_;
   evconnlistener *listener_ = nullptr;
 };
 
-class RemoteClient {
+class RemoteClient : public BudgetLink, public TimerNode {
  public:
-  RemoteClient(event_base *base, evdns_base *dnsbase, Crypto *crypto,
-               bufferevent *client);
+  RemoteClient(event_base *base, evdns_base *dnsbase, CryptoCreator *creator,
+               bufferevent *client, const sockaddr *peer,
+               const SessionOptions *options);
 
   void Startup();
 
+  // Sessions alive in the process, all reactors together.
+  static size_t Count() { return count_; }
+
+  // For the memory budget: what a session buffers in both directions, and
+  // closing it.
+  static size_t OnBudgetHeld(BudgetLink *link);
+  static void OnBudgetShed(BudgetLink *link);
+  // Handshake, connect or idle deadline passed.
+  static void OnTimerExpired(TimerNode *node);
+
+  static void *operator new(size_t size) { return mempool_alloc(size); }
+  static void operator delete(void *ptr) { mempool_free(ptr); }
+
  private:
   ~RemoteClient();
   void Cleanup(const char *reason);
@@ -41,24 +73,57 @@ class RemoteClient {
   static void OnTargetRead(bufferevent *bev, void *ctx);
   static void OnTargetWrite(bufferevent *bev, void *ctx);
   static void OnTargetEvent(bufferevent *bev, short what, void *ctx);
+  static void OnCoalesceDeadline(evutil_socket_t sock, short what, void *ctx);
+  static void OnClientDecoded(void *ctx, int result, evbuffer *out);
+  static void OnTargetEncoded(void *ctx, int result, evbuffer *out);
+  static void OnTargetResolved(void *ctx, const DnsAnswer &answer);
+  static void OnTargetRaced(void *ctx, evutil_socket_t sock, size_t index);
 
-  void HandleClientRead(evbuffer *buf);
+  bool HandleClientRead();
+  bool HandleClientDecoded(int cret);
   void HandleClientEmpty();
   void HandleClientClose();
+  void HandleClientIdle();
   void HandleTargetReady();
-  void HandleTargetRead(evbuffer *buf);
+  void HandleTargetRead();
+  bool HandleTargetEncoded(int cret, evbuffer *encoded);
   void HandleTargetEmpty();
   void HandleTargetClose();
+  void HandleTargetIdle();
+  void HandleCoalesceDeadline();
+  void SetDeadline(unsigned int seconds);
+  bool ProcessProxyHeader();
+  bool AcceptTunnel(int version);
+  void SetupTarget();
+  bool ConnectStarted(TargetState state);
+  evbuffer *DecodeTarget();
+  bool WriteClient(size_t len);
 
-  event_base *base_;
-  evdns_base *dnsbase_;
-  Crypto *crypto_;
+  // Kept small enough for the 512 byte pool class, what every read touches
+  // first and what only setup and teardown need after it.
   bufferevent *client_;
-  RuningStep step_ = STEP_INIT;
   bufferevent *target_ = nullptr;
-  evbuffer *target_cached_ = nullptr;
+  RuningStep step_ = STEP_INIT;
   bool client_busy_ = false;
   bool target_busy_ = false;
+  bool target_closed_ = false;
+  bool client_idle_ = false;
+  bool target_idle_ = false;
+  // A lookup or connect race will call back.
+  bool target_pending_ = false;
+  unsigned short target_port_ = 0;
+  uint32_t connect_started_ = 0;
+  Crypto crypto_;
+  CryptoLane encoder_;
+  CryptoLane decoder_;
+  WriteCoalescer coalescer_;
+
+  evdns_base *dnsbase_;
+  const SessionOptions *options_;
+  evbuffer *target_cached_ = nullptr;
+  uint64_t target_fast_open_ = 0;
+
+  static std::atomic<size_t> count_;
 
 #if USE_DEBUG
   size_t client_read_bytes_ = 0;
@@ -2,16 +2,135 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <thread>
 
 #include "remote.h"
 #include "../version.h"
 
+enum {
+  OPT_MEM_PREFAULT = 256,
+  OPT_MEM_HUGEPAGE,
+  OPT_MEM_BUDGET,
+  OPT_REPLAY_FILTER,
+  OPT_DNS_CACHE,
+  OPT_HAPPY_EYEBALLS,
+  OPT_COALESCE_DELAY,
+  OPT_CRYPTO_THREADS,
+  OPT_THREADS,
+  OPT_USERS,
+  OPT_FAST_OPEN,
+  OPT_IO_URING,
+  OPT_READ_SIZE,
+  OPT_IDLE_TRIM,
+  OPT_WINDOW_UP,
+  OPT_WINDOW_DOWN,
+  OPT_WINDOW_ADAPTIVE,
+  OPT_HANDSHAKE_TIMEOUT,
+  OPT_CONNECT_TIMEOUT,
+  OPT_IDLE_TIMEOUT,
+  OPT_UDP_RELAY,
+  OPT_UDP_TIMEOUT,
+};
+
+#ifndef SYS_WINDOWS
+struct DumpTargets {
+  ReplayFilter *filter;
+  UserTable *users;
+};
+
+static void OnDumpSignal(evutil_socket_t sig, short what, void *ctx) {
+  DumpTargets *targets = (DumpTargets *)ctx;
+  mempool_dump(stderr);
+  size_t sessions = RemoteClient::Count();
+  fprintf(stderr, "sessions: %zu, %zu bytes in use each\n", sessions,
+          sessions ? mempool_used() / sessions : 0);
+  budget_dump(stderr);
+  dns_dump(stderr);
+  connect_dump(stderr);
+  udp_relay_dump(stderr);
+  mux_dump(stderr);
+  if (targets->filter) {
+    targets->filter->Dump(stderr);
+  }
+  if (targets->users) {
+    targets->users->Dump(stderr);
+  }
+}
+#endif
+
+// One reactor: its own event_base, resolver and listener, sharing the
+// CryptoCreator and options with the others.
+static event_base *NewReactor(CryptoCreator *creator, unsigned short port,
+                              const SessionOptions *options) {
+  event_base *base = event_base_new();
+  if (!base) {
+    quit("incredible: event_base_new error");
+  }
+
+  evdns_base *dnsbase = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+  if (!dnsbase) {
+    quit("incredible: evdns_base_new error");
+  }
+
+  std::string error;
+  RemoteServer *server =
+      new RemoteServer(base, dnsbase, creator, port, options);
+  if (!server->Startup(error)) {
+    quit(error.c_str());
+  }
+  return base;
+}
+
 int main(int argc, char *argv[]) {
   int opt;
   const char *short_options = "p:m:s:vh";
   struct option long_options[] = {{"port", required_argument, NULL, 'p'},
                                   {"algorithm", required_argument, NULL, 'm'},
                                   {"password", required_argument, NULL, 's'},
+                                  {"mem-prefault", required_argument, NULL,
+                                   OPT_MEM_PREFAULT},
+                                  {"mem-hugepage", no_argument, NULL,
+                                   OPT_MEM_HUGEPAGE},
+                                  {"mem-budget", required_argument, NULL,
+                                   OPT_MEM_BUDGET},
+                                  {"replay-filter", required_argument, NULL,
+                                   OPT_REPLAY_FILTER},
+                                  {"dns-cache", required_argument, NULL,
+                                   OPT_DNS_CACHE},
+                                  {"happy-eyeballs", required_argument, NULL,
+                                   OPT_HAPPY_EYEBALLS},
+                                  {"coalesce-delay", required_argument, NULL,
+                                   OPT_COALESCE_DELAY},
+                                  {"crypto-threads", required_argument, NULL,
+                                   OPT_CRYPTO_THREADS},
+                                  {"threads", required_argument, NULL,
+                                   OPT_THREADS},
+                                  {"users", required_argument, NULL,
+                                   OPT_USERS},
+                                  {"fast-open", no_argument, NULL,
+                                   OPT_FAST_OPEN},
+                                  {"io-uring", no_argument, NULL,
+                                   OPT_IO_URING},
+                                  {"read-size", required_argument, NULL,
+                                   OPT_READ_SIZE},
+                                  {"idle-trim", required_argument, NULL,
+                                   OPT_IDLE_TRIM},
+                                  {"window-up", required_argument, NULL,
+                                   OPT_WINDOW_UP},
+                                  {"window-down", required_argument, NULL,
+                                   OPT_WINDOW_DOWN},
+                                  {"window-adaptive", no_argument, NULL,
+                                   OPT_WINDOW_ADAPTIVE},
+                                  {"handshake-timeout", required_argument,
+                                   NULL, OPT_HANDSHAKE_TIMEOUT},
+                                  {"connect-timeout", required_argument, NULL,
+                                   OPT_CONNECT_TIMEOUT},
+                                  {"idle-timeout", required_argument, NULL,
+                                   OPT_IDLE_TIMEOUT},
+                                  {"udp-relay", no_argument, NULL,
+                                   OPT_UDP_RELAY},
+                                  {"udp-timeout", required_argument, NULL,
+                                   OPT_UDP_TIMEOUT},
                                   {"version", no_argument, NULL, 'v'},
                                   {"help", no_argument, NULL, 'h'},
                                   {0, 0, 0, 0}};
@@ -20,8 +139,12 @@ int main(int argc, char *argv[]) {
   char **parsed_argv = NULL;
   parse_cmdline(argc, argv, &parsed_argc, &parsed_argv);
 
-  int port = 51080;
-  std::string algorithm, password;
+  int port = 51080, mem_prefault = 0, mem_budget = 0,
+      crypto_threads = 0, replay_filter = 1000000, dns_cache = 4096,
+      window_up = 512, window_down = 512;
+  bool mem_hugepage = false, io_uring = false;
+  SessionOptions options;
+  std::string algorithm, password, users_file;
   while ((opt = getopt_long(parsed_argc, parsed_argv, short_options,
                             long_options, NULL)) != -1) {
     switch (opt) {
@@ -37,6 +160,94 @@ int main(int argc, char *argv[]) {
         password = optarg;
         break;
 
+      case OPT_MEM_PREFAULT:
+        mem_prefault = atoi(optarg);
+        break;
+
+      case OPT_MEM_HUGEPAGE:
+        mem_hugepage = true;
+        break;
+
+      case OPT_MEM_BUDGET:
+        mem_budget = atoi(optarg);
+        break;
+
+      case OPT_REPLAY_FILTER:
+        replay_filter = atoi(optarg);
+        break;
+
+      case OPT_DNS_CACHE:
+        dns_cache = atoi(optarg);
+        break;
+
+      case OPT_HAPPY_EYEBALLS:
+        options.race_delay = atoi(optarg);
+        break;
+
+      case OPT_COALESCE_DELAY:
+        options.coalesce_delay = atoi(optarg);
+        break;
+
+      case OPT_CRYPTO_THREADS:
+        crypto_threads = atoi(optarg);
+        break;
+
+      case OPT_THREADS:
+        options.threads = atoi(optarg);
+        break;
+
+      case OPT_USERS:
+        users_file = optarg;
+        break;
+
+      case OPT_FAST_OPEN:
+        options.fast_open = true;
+        break;
+
+      case OPT_IO_URING:
+        io_uring = true;
+        break;
+
+      case OPT_READ_SIZE:
+        options.read_size = atoi(optarg);
+        break;
+
+      case OPT_IDLE_TRIM:
+        options.idle_trim = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_UP:
+        window_up = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_DOWN:
+        window_down = atoi(optarg);
+        break;
+
+      case OPT_WINDOW_ADAPTIVE:
+        options.adaptive_window = true;
+        break;
+
+      case OPT_HANDSHAKE_TIMEOUT:
+        options.handshake_timeout = atoi(optarg);
+        break;
+
+      case OPT_CONNECT_TIMEOUT:
+        options.connect_timeout = atoi(optarg);
+        break;
+
+      case OPT_IDLE_TIMEOUT:
+        options.idle_timeout = atoi(optarg);
+        break;
+
+      case OPT_UDP_RELAY:
+        options.udp_relay = true;
+        break;
+
+      case OPT_UDP_TIMEOUT:
+        options.udp_timeout = atoi(optarg);
+        break;
+
       case 'v':
         quit("weaknet-server version " PROJECT_VERSION);
         break;
@@ -49,8 +260,47 @@ int main(int argc, char *argv[]) {
               " -m or --algorithm <algorithm>, support list:\n"
               "    chacha20, chacha20-ietf,\n"
               "    chacha20-ietf-poly1305,\n"
-              "    xchacha20-ietf-poly1305\n"
+              "    xchacha20-ietf-poly1305,\n"
+              "    aes-128-gcm, aes-192-gcm, aes-256-gcm\n"
               " -s or --password <password>\n"
+              " --mem-prefault <MB>, pool memory mapped at startup\n"
+              " --mem-hugepage, back the pool with huge pages\n"
+              " --mem-budget <MB>, pause accepts and shed sessions\n"
+              "    near that much memory, default 0 (unbounded)\n"
+              " --replay-filter <count>, salts remembered, 0 to disable\n"
+              " --dns-cache <count>, target hostnames the resolver\n"
+              "    keeps, default 4096, 0 to disable\n"
+              " --happy-eyeballs <ms>, delay between connects to the\n"
+              "    addresses of a target, default 250, 0 first only\n"
+              " --coalesce-delay <us>, hold partial chunks of bulk\n"
+              "    transfers, default 1000, 0 to disable\n"
+              " --crypto-threads <count>, workers for large AEAD\n"
+              "    buffers, default 0 (inline)\n"
+              " --threads <count>, reactor threads sharing the port,\n"
+              "    default 1\n"
+              " --users <file>, name:password per line, all served\n"
+              "    on the port, AEAD algorithms only\n"
+              " --fast-open, TCP Fast Open on the listener and on\n"
+              "    outbound connects\n"
+              " --io-uring, drive sockets through io_uring\n"
+              " --read-size <bytes>, most read from a socket per\n"
+              "    event, default 16384\n"
+              " --idle-trim <s>, free spare memory of sessions idle\n"
+              "    that long, default 0 (never)\n"
+              " --window-up <KB>, upload data queued before reading\n"
+              "    pauses, default 512\n"
+              " --window-down <KB>, same for downloads, default 512\n"
+              " --window-adaptive, size the windows from the drain\n"
+              "    rate and round trips of each connection\n"
+              " --handshake-timeout <s>, close sessions without a\n"
+              "    complete request by then, default 15, 0 never\n"
+              " --connect-timeout <s>, close sessions whose target\n"
+              "    has not connected by then, default 15, 0 never\n"
+              " --idle-timeout <s>, close sessions that read nothing\n"
+              "    for that long, default 0 (never)\n"
+              " --udp-relay, relay shadowsocks UDP on the same port\n"
+              " --udp-timeout <s>, forget UDP peers silent that long,\n"
+              "    default 60\n"
               " -v or --version\n"
               " -h or --help\n"
               "\n");
@@ -64,15 +314,84 @@ int main(int argc, char *argv[]) {
     quit("invalid option: port");
   }
 
+  if (mem_prefault < 0) {
+    quit("invalid option: mem-prefault");
+  }
+
+  if (mem_budget < 0) {
+    quit("invalid option: mem-budget");
+  }
+  options.mem_budget = (size_t)mem_budget << 20;
+
+  if (replay_filter < 0) {
+    quit("invalid option: replay-filter");
+  }
+
+  if (dns_cache < 0 || dns_cache > 16777216) {
+    quit("invalid option: dns-cache");
+  }
+
+  if (options.race_delay > 10000) {
+    quit("invalid option: happy-eyeballs");
+  }
+
+  if (options.coalesce_delay > 1000000) {
+    quit("invalid option: coalesce-delay");
+  }
+
+  if (options.read_size &&
+      (options.read_size < 4096 || options.read_size > 4194304)) {
+    quit("invalid option: read-size");
+  }
+
+  if (options.idle_trim > 86400) {
+    quit("invalid option: idle-trim");
+  }
+
+  if (options.handshake_timeout > 86400) {
+    quit("invalid option: handshake-timeout");
+  }
+
+  if (options.connect_timeout > 86400) {
+    quit("invalid option: connect-timeout");
+  }
+
+  if (options.idle_timeout > 86400) {
+    quit("invalid option: idle-timeout");
+  }
+
+  if (options.udp_timeout < 1 || options.udp_timeout > 86400) {
+    quit("invalid option: udp-timeout");
+  }
+
+  if (window_up < 16 || window_up > 65536) {
+    quit("invalid option: window-up");
+  }
+  options.up_window = window_up * 1024;
+
+  if (window_down < 16 || window_down > 65536) {
+    quit("invalid option: window-down");
+  }
+  options.down_window = window_down * 1024;
+
+  if (options.threads < 1 || options.threads > 256) {
+    quit("invalid option: threads");
+  }
+
+  if (crypto_threads < 0 || crypto_threads > 256) {
+    quit("invalid option: crypto-threads");
+  }
+
   if (algorithm.empty()) {
     quit("invalid option: algorithm");
   }
 
-  if (password.empty()) {
+  if (password.empty() && users_file.empty()) {
     quit("invalid option: password");
   }
 
   network_init();
+  mempool_init(mem_prefault, mem_hugepage);
 
   std::string error;
 
@@ -80,30 +399,67 @@ int main(int argc, char *argv[]) {
     quit(error.c_str());
   }
 
+  if (!crypto_workers_init(crypto_threads, error)) {
+    quit(error.c_str());
+  }
+
+  if (!io_stream_init(io_uring, error)) {
+    quit(error.c_str());
+  }
+
   CryptoCreator *creator =
       CryptoCreator::NewInstance(algorithm.c_str(), password.c_str());
   if (!creator) {
     quit("invalid option: algorithm, not supported");
   }
 
-  event_base *base = event_base_new();
-  if (!base) {
-    quit("incredible: event_base_new error");
+  ReplayFilter *filter = nullptr;
+  if (replay_filter > 0) {
+    filter = new ReplayFilter(replay_filter);
+    creator->SetReplayFilter(filter);
   }
 
-  evdns_base *dnsbase = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
-  if (!dnsbase) {
-    quit("incredible: evdns_base_new error");
+  // The password, when also given, is one more user.
+  UserTable *users = nullptr;
+  if (!users_file.empty()) {
+    users = new UserTable();
+    if (!users->Load(users_file.c_str(), error)) {
+      quit(error.c_str());
+    }
+    if (!password.empty()) {
+      users->Add("default", password);
+    }
+    if (!creator->SetUsers(users, error)) {
+      quit(error.c_str());
+    }
   }
 
-  RemoteServer *server = new RemoteServer(base, dnsbase, creator, port);
-  if (!server->Startup(error)) {
-    quit(error.c_str());
+  if (dns_cache > 0) {
+    dns_cache_init(dns_cache);
+    options.dns_cache = true;
   }
 
-  printf("listen on %d, algorithm: %s ...\n", port, algorithm.c_str());
+  std::vector<event_base *> bases;
+  for (unsigned int i = 0; i < options.threads; ++i) {
+    bases.push_back(NewReactor(creator, port, &options));
+  }
 
-  event_base_dispatch(base);
+#ifndef SYS_WINDOWS
+  DumpTargets dump_targets = {filter, users};
+  event *dump_event =
+      evsignal_new(bases[0], SIGUSR1, OnDumpSignal, &dump_targets);
+  if (dump_event) {
+    event_add(dump_event, NULL);
+  }
+#endif
+
+  printf("listen on %d, algorithm: %s, threads: %u, users: %zu ...\n", port,
+         algorithm.c_str(), options.threads, users ? users->size() : 1);
+
+  for (size_t i = 1; i < bases.size(); ++i) {
+    std::thread(event_base_dispatch, bases[i]).detach();
+  }
+  event_base_dispatch(bases[0]);
 
   return 0;
 }
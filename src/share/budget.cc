@@ -0,0 +1,135 @@
+#include "budget.h"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "debug.h"
+#include "io_stream.h"
+#include "mempool.h"
+#include "util.h"
+
+#define BUDGET_CHECK_MS 100
+// Share of the budget in use where accepts pause and windows shrink, both
+// come back once usage falls below the lower one.
+#define BUDGET_PRESSURE_PERCENT 90
+#define BUDGET_RELIEF_PERCENT 75
+// Output a session queues toward one peer while under pressure.
+#define BUDGET_TIGHT_WINDOW (64 * 1024)
+
+typedef std::pair<size_t, BudgetLink *> BudgetHeld;
+
+struct BudgetWatch {
+  evconnlistener *listener;
+  BudgetHeldFn held;
+  BudgetShedFn shed;
+  bool paused = false;
+};
+
+static std::atomic<size_t> budget_limit{0};
+static std::atomic<size_t> budget_reactors{0};
+static std::atomic<size_t> budget_pauses{0};
+static std::atomic<size_t> budget_shed_count{0};
+static std::atomic<size_t> budget_shed_bytes{0};
+static thread_local BudgetLink *budget_head = nullptr;
+
+static bool held_more(const BudgetHeld &a, const BudgetHeld &b) {
+  return a.first > b.first;
+}
+
+// Closes the sessions of this reactor holding the most until they cover
+// its share of `excess`.
+static void budget_shed(BudgetWatch *watch, size_t excess) {
+  std::vector<BudgetHeld> sessions;
+  for (BudgetLink *link = budget_head; link; link = link->budget_next_) {
+    size_t held = watch->held(link);
+    if (held) sessions.push_back(BudgetHeld(held, link));
+  }
+  std::sort(sessions.begin(), sessions.end(), held_more);
+
+  size_t share = excess / budget_reactors + 1, freed = 0;
+  for (size_t i = 0; i < sessions.size() && freed < share; ++i) {
+    freed += sessions[i].first;
+    budget_shed_count += 1;
+    budget_shed_bytes += sessions[i].first;
+    watch->shed(sessions[i].second);
+  }
+}
+
+static void OnBudgetCheck(evutil_socket_t sock, short what, void *ctx) {
+  BudgetWatch *watch = (BudgetWatch *)ctx;
+  size_t limit = budget_limit, used = mempool_used();
+  size_t pressure = limit / 100 * BUDGET_PRESSURE_PERCENT;
+  size_t relief = limit / 100 * BUDGET_RELIEF_PERCENT;
+
+  if (used >= pressure && !watch->paused) {
+    dump("budget: %zu / %zu bytes, pausing accepts\n", used, limit);
+    watch->paused = true;
+    budget_pauses += 1;
+    io_listener_pause(watch->listener, true);
+    bufferevent_set_window_cap(BUDGET_TIGHT_WINDOW);
+  } else if (used < relief && watch->paused) {
+    dump("budget: %zu / %zu bytes, resuming accepts\n", used, limit);
+    watch->paused = false;
+    io_listener_pause(watch->listener, false);
+    bufferevent_set_window_cap(0);
+  }
+
+  if (used > limit) {
+    budget_shed(watch, used - relief);
+  }
+}
+
+void budget_watch(event_base *base, evconnlistener *listener, size_t limit,
+                  BudgetHeldFn held, BudgetShedFn shed) {
+  BudgetWatch *watch = new BudgetWatch();
+  watch->listener = listener;
+  watch->held = held;
+  watch->shed = shed;
+  budget_limit = limit;
+  budget_reactors += 1;
+
+  timeval period = {0, BUDGET_CHECK_MS * 1000};
+  event *timer = event_new(base, -1, EV_PERSIST, OnBudgetCheck, watch);
+  if (!timer) {
+    quit("incredible: event_new error");
+  }
+  event_add(timer, &period);
+}
+
+void budget_link(BudgetLink *link) {
+  link->budget_prev_ = nullptr;
+  link->budget_next_ = budget_head;
+  if (budget_head) {
+    budget_head->budget_prev_ = link;
+  }
+  budget_head = link;
+}
+
+void budget_unlink(BudgetLink *link) {
+  if (link->budget_prev_) {
+    link->budget_prev_->budget_next_ = link->budget_next_;
+  } else if (budget_head == link) {
+    budget_head = link->budget_next_;
+  } else {
+    return;
+  }
+  if (link->budget_next_) {
+    link->budget_next_->budget_prev_ = link->budget_prev_;
+  }
+  link->budget_prev_ = link->budget_next_ = nullptr;
+}
+
+void budget_dump(FILE *fp) {
+  size_t limit = budget_limit;
+  if (!limit) return;
+
+  size_t cap = bufferevent_window_cap();
+  fprintf(fp,
+          "budget: %zu / %zu bytes, window cap: %zu, pauses: %zu, shed: %zu "
+          "sessions, %zu bytes\n",
+          mempool_used(), limit, cap == SIZE_MAX ? 0 : cap,
+          (size_t)budget_pauses, (size_t)budget_shed_count,
+          (size_t)budget_shed_bytes);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "network.h"
+
+// Process-wide budget for the memory sessions hold, measured as the pool's
+// bytes in use, which is where libevent keeps every buffered byte. Each
+// reactor checks it on a timer. Close to the budget its listener stops
+// accepting and every session queues less toward a slow peer, over it the
+// sessions of the reactor buffering the most are closed until the excess is
+// covered.
+
+// Sessions of one reactor, linked so the budget finds the ones holding the
+// most without the reactor tracking them itself.
+struct BudgetLink {
+  BudgetLink *budget_prev_ = nullptr;
+  BudgetLink *budget_next_ = nullptr;
+};
+
+// Bytes a session has buffered, and closing it for good.
+typedef size_t (*BudgetHeldFn)(BudgetLink *link);
+typedef void (*BudgetShedFn)(BudgetLink *link);
+
+// Starts checking `limit` bytes on `base`, pausing `listener` under
+// pressure. Called once per reactor, all with the same limit.
+void budget_watch(event_base *base, evconnlistener *listener, size_t limit,
+                  BudgetHeldFn held, BudgetShedFn shed);
+
+// On the reactor thread the session runs on.
+void budget_link(BudgetLink *link);
+void budget_unlink(BudgetLink *link);
+
+void budget_dump(FILE *fp);
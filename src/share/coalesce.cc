@@ -0,0 +1,69 @@
+#include "coalesce.h"
+
+#include "crypto_cipher.h"
+
+// A read at least this large means the sender has more queued.
+#define COALESCE_BULK_SIZE 4096
+
+WriteCoalescer::WriteCoalescer(event_base *base, unsigned int delay_us,
+                               event_callback_fn deadline_cb, void *ctx)
+    : base_(base), deadline_cb_(deadline_cb), ctx_(ctx) {
+  delay_.tv_sec = delay_us / 1000000;
+  delay_.tv_usec = delay_us % 1000000;
+}
+
+WriteCoalescer::~WriteCoalescer() {
+  if (deadline_) {
+    event_free(deadline_);
+  }
+}
+
+size_t WriteCoalescer::Push(evbuffer *input) {
+  size_t input_len = evbuffer_get_length(input);
+  size_t read_len = input_len > held_ ? input_len - held_ : 0;
+  if (delay_.tv_sec == 0 && delay_.tv_usec == 0) {
+    return input_len;
+  }
+  if (read_len == 0) {
+    return 0;
+  }
+
+  if (!held_ && !bulk_) {
+    bulk_ = read_len >= COALESCE_BULK_SIZE;
+    return input_len;
+  }
+
+  if (read_len < COALESCE_BULK_SIZE) {
+    return Flush(input);
+  }
+
+  size_t ready_len = input_len - input_len % CHUNK_SIZE_SPLIT;
+  held_ = input_len - ready_len;
+  if (!held_) {
+    if (deadline_) evtimer_del(deadline_);
+  } else {
+    if (!deadline_) {
+      deadline_ = evtimer_new(base_, deadline_cb_, ctx_);
+    }
+    if (!evtimer_pending(deadline_, NULL)) {
+      evtimer_add(deadline_, &delay_);
+    }
+  }
+  return ready_len;
+}
+
+void WriteCoalescer::Trim() {
+  if (deadline_ && !evtimer_pending(deadline_, NULL)) {
+    event_free(deadline_);
+    deadline_ = nullptr;
+  }
+}
+
+size_t WriteCoalescer::Flush(evbuffer *input) {
+  held_ = 0;
+  bulk_ = false;
+  if (deadline_) {
+    evtimer_del(deadline_);
+  }
+  return evbuffer_get_length(input);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "network.h"
+
+// Groups reads of one direction into full AEAD chunks before encryption.
+// The first read after an idle period and small reads go out at once. While
+// a bulk transfer is running, whole chunks go out and the remainder waits
+// in the source's input for the next read or the deadline, whichever comes
+// first.
+class WriteCoalescer {
+ public:
+  WriteCoalescer(event_base *base, unsigned int delay_us,
+                 event_callback_fn deadline_cb, void *ctx);
+  ~WriteCoalescer();
+
+  // `input` holds what was held back plus what arrived since. Returns how
+  // many bytes from its front to send now, the caller takes exactly those.
+  size_t Push(evbuffer *input);
+  // Returns all of `input` and cancels the deadline.
+  size_t Flush(evbuffer *input);
+  // Frees the deadline event unless it is armed.
+  void Trim();
+
+ private:
+  event_base *base_;
+  timeval delay_;
+  event_callback_fn deadline_cb_;
+  void *ctx_;
+  event *deadline_ = nullptr;
+  size_t held_ = 0;
+  bool bulk_ = false;
+};
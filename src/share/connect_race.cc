@@ -0,0 +1,312 @@
+#include "connect_race.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "util.h"
+
+// Addresses tried for one target at most.
+#define RACE_MAX_ADDRS 8
+#define RACE_TABLE_MAX 4096
+
+// Upper ends of the latency buckets, the last one takes everything above.
+static const uint32_t connect_bounds[] = {10, 50, 100, 250, 500, 1000, 3000};
+#define CONNECT_BUCKETS (sizeof(connect_bounds) / sizeof(connect_bounds[0]) + 1)
+
+struct RaceAttempt {
+  evutil_socket_t sock;
+  event *ev;
+  size_t index;
+};
+
+struct ConnectRace {
+  RaceConnectedFn connected;
+  void *ctx;
+  std::string name;
+  bool mixed;
+  // Waiting for the rest of a partial answer.
+  bool following = false;
+  unsigned short port = 0;
+  std::vector<sockaddr_storage> addrs;
+  size_t next = 0;
+  std::vector<RaceAttempt> attempts;
+  event *stagger = nullptr;
+  timeval delay;
+};
+
+static thread_local std::vector<ConnectRace *> races;
+static std::mutex race_lock;
+static std::unordered_map<std::string, int> race_family;
+
+static std::atomic<size_t> connect_count{0};
+static std::atomic<size_t> connect_total_ms{0};
+static std::atomic<size_t> connect_histogram[CONNECT_BUCKETS];
+static std::atomic<size_t> race_count{0};
+static std::atomic<size_t> race_fallbacks{0};
+static std::atomic<size_t> race_failures{0};
+
+static void OnRaceAttempt(evutil_socket_t sock, short what, void *ctx);
+static void OnRaceStagger(evutil_socket_t sock, short what, void *ctx);
+
+static socklen_t race_addr_len(const sockaddr_storage &addr) {
+  return addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                    : sizeof(sockaddr_in);
+}
+
+static bool race_has(ConnectRace *race, const sockaddr_storage &addr) {
+  for (const sockaddr_storage &known : race->addrs) {
+    if (!memcmp(&known, &addr, race_addr_len(addr))) return true;
+  }
+  return false;
+}
+
+// Both families in turn, `first` leading, after the addresses already there.
+static void race_order(ConnectRace *race, const DnsAnswer &answer,
+                       unsigned short port, int first) {
+  size_t v4 = 0, v6 = 0;
+  bool six = first != AF_INET;
+  while (race->addrs.size() < RACE_MAX_ADDRS &&
+         (v4 < answer.ipv4.size() || v6 < answer.ipv6.size())) {
+    if (six && v6 == answer.ipv6.size()) six = false;
+    if (!six && v4 == answer.ipv4.size()) six = true;
+
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    if (six) {
+      sockaddr_in6 *sin6 = (sockaddr_in6 *)&addr;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_addr = answer.ipv6[v6++];
+      sin6->sin6_port = htons(port);
+    } else {
+      sockaddr_in *sin = (sockaddr_in *)&addr;
+      sin->sin_family = AF_INET;
+      sin->sin_addr = answer.ipv4[v4++];
+      sin->sin_port = htons(port);
+    }
+    if (!race_has(race, addr)) {
+      race->addrs.push_back(addr);
+    }
+    six = !six;
+  }
+}
+
+static void race_close(ConnectRace *race) {
+  for (RaceAttempt &attempt : race->attempts) {
+    event_free(attempt.ev);
+    evutil_closesocket(attempt.sock);
+  }
+  race->attempts.clear();
+  event_free(race->stagger);
+  if (race->following) {
+    dns_cancel(race);
+  }
+
+  for (size_t i = 0; i < races.size(); ++i) {
+    if (races[i] == race) {
+      races[i] = races.back();
+      races.pop_back();
+      break;
+    }
+  }
+}
+
+// The family of the winner leads next time, when the name has both.
+static void race_finish(ConnectRace *race, evutil_socket_t sock,
+                        size_t index) {
+  race_close(race);
+  if (sock >= 0) {
+    if (index > 0) {
+      race_fallbacks += 1;
+    }
+    if (race->mixed) {
+      std::lock_guard<std::mutex> guard(race_lock);
+      if (race_family.size() >= RACE_TABLE_MAX) {
+        race_family.clear();
+      }
+      race_family[race->name] = race->addrs[index].ss_family;
+    }
+  } else {
+    race_failures += 1;
+  }
+
+  RaceConnectedFn connected = race->connected;
+  void *ctx = race->ctx;
+  delete race;
+  connected(ctx, sock, index);
+}
+
+// False when the connect failed at once.
+static bool race_attempt(ConnectRace *race, size_t index) {
+  const sockaddr_storage &addr = race->addrs[index];
+  evutil_socket_t sock =
+      socket_connect_start((const sockaddr *)&addr, race_addr_len(addr));
+  if (sock < 0) return false;
+
+  event *ev = event_new(event_get_base(race->stagger), sock, EV_WRITE,
+                        OnRaceAttempt, race);
+  if (!ev) {
+    quit("incredible: event_new error");
+  }
+  event_add(ev, NULL);
+  race->attempts.push_back({sock, ev, index});
+  return true;
+}
+
+// Starts the next address that does not fail at once, and arms the delay
+// for the one after it.
+static void race_next(ConnectRace *race) {
+  while (race->next < race->addrs.size()) {
+    if (race_attempt(race, race->next++)) {
+      if (race->next < race->addrs.size()) {
+        evtimer_add(race->stagger, &race->delay);
+      }
+      return;
+    }
+  }
+  if (race->attempts.empty() && !race->following) {
+    race_finish(race, -1, 0);
+  }
+}
+
+static void OnRaceStagger(evutil_socket_t sock, short what, void *ctx) {
+  race_next((ConnectRace *)ctx);
+}
+
+// A failed attempt starts the next address without waiting for the delay.
+static void OnRaceAttempt(evutil_socket_t sock, short what, void *ctx) {
+  ConnectRace *race = (ConnectRace *)ctx;
+  size_t i = 0;
+  while (race->attempts[i].sock != sock) ++i;
+  RaceAttempt attempt = race->attempts[i];
+  race->attempts.erase(race->attempts.begin() + i);
+  event_free(attempt.ev);
+
+  if (socket_connect_done(sock)) {
+    race_finish(race, sock, attempt.index);
+    return;
+  }
+
+  evutil_closesocket(sock);
+  evtimer_del(race->stagger);
+  race_next(race);
+}
+
+// The rest of the answer joins the order. An idle race starts on it at
+// once, a running one after the delay.
+static void OnRaceLate(void *ctx, const DnsAnswer &answer) {
+  ConnectRace *race = (ConnectRace *)ctx;
+  race->following = false;
+  race->mixed = !answer.ipv4.empty() && !answer.ipv6.empty();
+  race_order(race, answer, race->port, AF_INET6);
+
+  if (evtimer_pending(race->stagger, NULL)) return;
+  if (race->attempts.empty()) {
+    race_next(race);
+  } else if (race->next < race->addrs.size()) {
+    evtimer_add(race->stagger, &race->delay);
+  }
+}
+
+// The first attempt also starts from the loop, `connected` never runs
+// before this returns.
+static void race_start(event_base *base, ConnectRace *race) {
+  race->stagger = evtimer_new(base, OnRaceStagger, race);
+  if (!race->stagger) {
+    quit("incredible: evtimer_new error");
+  }
+  timeval now = {0, 0};
+  evtimer_add(race->stagger, &now);
+  races.push_back(race);
+  race_count += 1;
+}
+
+static ConnectRace *race_new(unsigned int delay, RaceConnectedFn connected,
+                             void *ctx) {
+  ConnectRace *race = new ConnectRace();
+  race->connected = connected;
+  race->ctx = ctx;
+  race->mixed = false;
+  race->delay.tv_sec = delay / 1000;
+  race->delay.tv_usec = delay % 1000 * 1000;
+  return race;
+}
+
+void connect_race(event_base *base, const DnsAnswer &answer,
+                  unsigned short port, unsigned int delay,
+                  RaceConnectedFn connected, void *ctx) {
+  ConnectRace *race = race_new(delay, connected, ctx);
+  race->name = answer.name;
+  race->mixed = !answer.ipv4.empty() && !answer.ipv6.empty();
+
+  int first = AF_INET6;
+  if (race->mixed) {
+    std::lock_guard<std::mutex> guard(race_lock);
+    auto it = race_family.find(race->name);
+    if (it != race_family.end()) {
+      first = it->second;
+    }
+  }
+  race_order(race, answer, port, first);
+  race_start(base, race);
+  if (answer.partial) {
+    race->port = port;
+    race->following = dns_follow(answer, OnRaceLate, race);
+  }
+}
+
+void connect_race(event_base *base, const std::vector<sockaddr_storage> &addrs,
+                  unsigned int delay, RaceConnectedFn connected, void *ctx) {
+  ConnectRace *race = race_new(delay, connected, ctx);
+  race->addrs = addrs;
+  race_start(base, race);
+}
+
+void connect_race_cancel(void *ctx) {
+  for (ConnectRace *race : races) {
+    if (race->ctx == ctx) {
+      race_close(race);
+      delete race;
+      return;
+    }
+  }
+}
+
+uint32_t connect_clock() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void connect_latency(uint32_t started) {
+  uint32_t ms = connect_clock() - started;
+  size_t bucket = 0;
+  while (bucket + 1 < CONNECT_BUCKETS && ms >= connect_bounds[bucket]) {
+    ++bucket;
+  }
+  connect_count += 1;
+  connect_total_ms += ms;
+  connect_histogram[bucket] += 1;
+}
+
+void connect_dump(FILE *fp) {
+  size_t count = connect_count;
+  fprintf(fp, "connect: %zu targets, avg %zu ms, under", count,
+          count ? (size_t)connect_total_ms / count : 0);
+  for (size_t i = 0; i < CONNECT_BUCKETS; ++i) {
+    if (i + 1 < CONNECT_BUCKETS) {
+      fprintf(fp, " %u ms: %zu,", connect_bounds[i],
+              (size_t)connect_histogram[i]);
+    } else {
+      fprintf(fp, " more: %zu\n", (size_t)connect_histogram[i]);
+    }
+  }
+  fprintf(fp,
+          "connect race: %zu, won by a later address: %zu, all failed: %zu\n",
+          (size_t)race_count, (size_t)race_fallbacks, (size_t)race_failures);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "dns_cache.h"
+#include "network.h"
+
+// Happy Eyeballs (RFC 8305) for targets with several addresses. The
+// addresses are tried alternating between the families, starting with the
+// one that last won for the name, a new attempt every `delay` ms or as soon
+// as one fails. The first to connect wins, the rest are closed. A race on a
+// partial answer takes the addresses of the other family as they come in.
+// Connect latency of every target, raced or not, is kept for the statistics.
+
+// On the reactor thread. `connected` gets the winning socket and its place
+// in the order tried, or -1 once every address failed, unless `ctx` cancels
+// first.
+typedef void (*RaceConnectedFn)(void *ctx, evutil_socket_t sock,
+                                size_t index);
+
+void connect_race(event_base *base, const DnsAnswer &answer,
+                  unsigned short port, unsigned int delay,
+                  RaceConnectedFn connected, void *ctx);
+// Tries `addrs` in the order given, without a preferred family.
+void connect_race(event_base *base, const std::vector<sockaddr_storage> &addrs,
+                  unsigned int delay, RaceConnectedFn connected, void *ctx);
+void connect_race_cancel(void *ctx);
+
+// Milliseconds on a steady clock, to measure a connect from `started`.
+uint32_t connect_clock();
+void connect_latency(uint32_t started);
+
+void connect_dump(FILE *fp);
@@ -4,8 +4,8 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
-#include "crypto_aead.h"
-#include "crypto_stream.h"
+#include <new>
+#include <thread>
 
 struct CryptoCreatorInfo {
   const char *name;
@@ -16,17 +16,135 @@ struct CryptoCreatorInfo {
 };
 
 CryptoCreatorInfo supported_ciphers[] = {
-    {"chacha20", CHACHA20, 32, 8, 0},
-    {"chacha20-ietf", CHACHA20_IETF, 32, 12, 0},
-    {"chacha20-ietf-poly1305", CHACHA20_IETF_POLY1305, 32, 12, 16},
-    {"xchacha20-ietf-poly1305", XCHACHA20_IETF_POLY1305, 32, 24, 16}};
+    {"chacha20", CHACHA20, CipherChacha20::KEY_SIZE, CipherChacha20::IV_SIZE,
+     CipherChacha20::TAG_SIZE},
+    {"chacha20-ietf", CHACHA20_IETF, CipherChacha20Ietf::KEY_SIZE,
+     CipherChacha20Ietf::IV_SIZE, CipherChacha20Ietf::TAG_SIZE},
+    {"chacha20-ietf-poly1305", CHACHA20_IETF_POLY1305,
+     CipherChacha20IetfPoly1305::KEY_SIZE, CipherChacha20IetfPoly1305::IV_SIZE,
+     CipherChacha20IetfPoly1305::TAG_SIZE},
+    {"xchacha20-ietf-poly1305", XCHACHA20_IETF_POLY1305,
+     CipherXChacha20IetfPoly1305::KEY_SIZE,
+     CipherXChacha20IetfPoly1305::IV_SIZE,
+     CipherXChacha20IetfPoly1305::TAG_SIZE},
+    {"aes-128-gcm", AES_128_GCM, CipherAes128Gcm::KEY_SIZE,
+     CipherAes128Gcm::IV_SIZE, CipherAes128Gcm::TAG_SIZE},
+    {"aes-192-gcm", AES_192_GCM, CipherAes192Gcm::KEY_SIZE,
+     CipherAes192Gcm::IV_SIZE, CipherAes192Gcm::TAG_SIZE},
+    {"aes-256-gcm", AES_256_GCM, CipherAes256Gcm::KEY_SIZE,
+     CipherAes256Gcm::IV_SIZE, CipherAes256Gcm::TAG_SIZE}};
 const int supported_cipher_count =
     sizeof(supported_ciphers) / sizeof(supported_ciphers[0]);
 
-Crypto::Crypto() {}
-Crypto::~Crypto() {}
+static const unsigned char PACKET_SUBKEY_INFO[] = "ss-subkey";
 
-void Crypto::Release() { delete this; }
+// Cipher context of the AES ciphers, set up again for every datagram.
+static thread_local EVP_CIPHER_CTX *packet_ctx = nullptr;
+
+template <class Cipher>
+static int seal_packet(const unsigned char *key, const unsigned char *in,
+                       size_t len, unsigned char *out) {
+  unsigned char subkey[CIPHER_MAX_KEY_SIZE], nonce[CIPHER_MAX_IV_SIZE] = {};
+  unsigned long long out_len = len + Cipher::TAG_SIZE;
+  randombytes_buf(out, Cipher::KEY_SIZE);
+  Crypto::HKDF_SHA1(out, Cipher::KEY_SIZE, key, Cipher::KEY_SIZE,
+                    PACKET_SUBKEY_INFO, sizeof(PACKET_SUBKEY_INFO) - 1,
+                    subkey, Cipher::KEY_SIZE);
+  Cipher::Init(packet_ctx, subkey, true);
+  if (Cipher::Encrypt(packet_ctx, out + Cipher::KEY_SIZE, &out_len, in, len,
+                      nonce, subkey)) {
+    return -1;
+  }
+  return (int)(Cipher::KEY_SIZE + out_len);
+}
+
+template <class Cipher>
+static int open_packet(const unsigned char *key, const unsigned char *in,
+                       size_t len, unsigned char *out) {
+  if (len < Cipher::KEY_SIZE + Cipher::TAG_SIZE) return -1;
+
+  unsigned char subkey[CIPHER_MAX_KEY_SIZE], nonce[CIPHER_MAX_IV_SIZE] = {};
+  unsigned long long out_len = len - Cipher::KEY_SIZE - Cipher::TAG_SIZE;
+  Crypto::HKDF_SHA1(in, Cipher::KEY_SIZE, key, Cipher::KEY_SIZE,
+                    PACKET_SUBKEY_INFO, sizeof(PACKET_SUBKEY_INFO) - 1,
+                    subkey, Cipher::KEY_SIZE);
+  Cipher::Init(packet_ctx, subkey, false);
+  if (Cipher::Decrypt(packet_ctx, out, &out_len, in + Cipher::KEY_SIZE,
+                      len - Cipher::KEY_SIZE, nonce, subkey)) {
+    return -1;
+  }
+  return (int)out_len;
+}
+
+template <class Cipher>
+static int seal_stream_packet(const unsigned char *key,
+                              const unsigned char *in, size_t len,
+                              unsigned char *out) {
+  randombytes_buf(out, Cipher::IV_SIZE);
+  Cipher::Xor(out + Cipher::IV_SIZE, in, len, out, 0, key);
+  return (int)(Cipher::IV_SIZE + len);
+}
+
+template <class Cipher>
+static int open_stream_packet(const unsigned char *key,
+                              const unsigned char *in, size_t len,
+                              unsigned char *out) {
+  if (len < Cipher::IV_SIZE) return -1;
+
+  Cipher::Xor(out, in + Cipher::IV_SIZE, len - Cipher::IV_SIZE, in, 0, key);
+  return (int)(len - Cipher::IV_SIZE);
+}
+
+template <class Cipher>
+static int packet_crypt(bool seal, const unsigned char *key,
+                        const unsigned char *in, size_t len,
+                        unsigned char *out) {
+  return seal ? seal_packet<Cipher>(key, in, len, out)
+              : open_packet<Cipher>(key, in, len, out);
+}
+
+static int packet_crypt(unsigned int cipher, bool seal,
+                        const unsigned char *key, const unsigned char *in,
+                        size_t len, unsigned char *out) {
+  switch (cipher) {
+    case CHACHA20:
+      return seal ? seal_stream_packet<CipherChacha20>(key, in, len, out)
+                  : open_stream_packet<CipherChacha20>(key, in, len, out);
+    case CHACHA20_IETF:
+      return seal ? seal_stream_packet<CipherChacha20Ietf>(key, in, len, out)
+                  : open_stream_packet<CipherChacha20Ietf>(key, in, len, out);
+    case CHACHA20_IETF_POLY1305:
+      return packet_crypt<CipherChacha20IetfPoly1305>(seal, key, in, len, out);
+    case XCHACHA20_IETF_POLY1305:
+      return packet_crypt<CipherXChacha20IetfPoly1305>(seal, key, in, len,
+                                                       out);
+    case AES_128_GCM:
+      return packet_crypt<CipherAes128Gcm>(seal, key, in, len, out);
+    case AES_192_GCM:
+      return packet_crypt<CipherAes192Gcm>(seal, key, in, len, out);
+    case AES_256_GCM:
+      return packet_crypt<CipherAes256Gcm>(seal, key, in, len, out);
+    default:
+      return -1;
+  }
+}
+
+Crypto::Crypto(const CryptoCreator *creator, const sockaddr *peer)
+    : cipher_(creator->cipher_) {
+  if (Aead())
+    new (&aead_) AeadCrypto(&creator->cipher_key_, creator->replay_filter_,
+                            creator->users_,
+                            creator->users_ ? UserTable::PeerKey(peer) : 0);
+  else
+    new (&stream_) StreamCrypto(&creator->cipher_key_);
+}
+
+Crypto::~Crypto() {
+  if (Aead())
+    aead_.~AeadCrypto();
+  else
+    stream_.~StreamCrypto();
+}
 
 void Crypto::HKEY_MD5(const char *password, unsigned char *key,
                       unsigned int key_size) {
@@ -91,13 +209,6 @@ CryptoCreator::CryptoCreator() {}
 
 CryptoCreator::~CryptoCreator() {}
 
-Crypto *CryptoCreator::NewCrypto() {
-  if (cipher_key_.tag_size > 0)
-    return new AeadCrypto(cipher_, &cipher_key_);
-  else
-    return new StreamCrypto(cipher_, &cipher_key_);
-};
-
 bool CryptoCreator::Init(std::string &error) {
   if (sodium_init()) {
     error = "incredible: sodium_init error";
@@ -127,3 +238,99 @@ CryptoCreator *CryptoCreator::NewInstance(const char *algorithm,
   Crypto::HKEY_MD5(password, out->cipher_key_.key, info->key_size);
   return out;
 }
+
+void CryptoCreator::SetReplayFilter(ReplayFilter *replay_filter) {
+  replay_filter_ = replay_filter;
+}
+
+bool CryptoCreator::SetUsers(UserTable *users, std::string &error) {
+  if (cipher_key_.tag_size == 0) {
+    error = "invalid option: users, AEAD algorithm required";
+    return false;
+  }
+  if (users->size() == 0) {
+    error = "invalid option: users, no user";
+    return false;
+  }
+
+  users->DeriveKeys(cipher_key_.key_size, std::thread::hardware_concurrency());
+  users_ = users;
+  return true;
+}
+
+std::vector<std::string> CryptoCreator::Algorithms() {
+  std::vector<std::string> out;
+  for (size_t i = 0; i < supported_cipher_count; ++i) {
+    out.push_back(supported_ciphers[i].name);
+  }
+  return out;
+}
+
+int CryptoCreator::SealPacket(const unsigned char *in, size_t len,
+                              unsigned char *out, int user) const {
+  if (!users_ || user == UserTable::NONE) {
+    return packet_crypt(cipher_, true, cipher_key_.key, in, len, out);
+  }
+
+  users_->AddBytes(user, 0, len);
+  return packet_crypt(cipher_, true, users_->key(user), in, len, out);
+}
+
+int CryptoCreator::OpenPacket(const unsigned char *in, size_t len,
+                              unsigned char *out, uint64_t peer,
+                              int &user) const {
+  if (!users_) {
+    return packet_crypt(cipher_, false, cipher_key_.key, in, len, out);
+  }
+
+  int out_len = -1;
+  if (user != UserTable::NONE) {
+    out_len = packet_crypt(cipher_, false, users_->key(user), in, len, out);
+  }
+  if (out_len < 0) {
+    out_len = IdentifyPacket(in, len, out, peer, user);
+  }
+  if (out_len >= 0) {
+    users_->AddBytes(user, out_len, 0);
+  }
+  return out_len;
+}
+
+// The candidates of `peer` first, then everybody else when the table's
+// scan budget allows. `user` was tried already and is skipped.
+int CryptoCreator::IdentifyPacket(const unsigned char *in, size_t len,
+                                  unsigned char *out, uint64_t peer,
+                                  int &user) const {
+  int candidates[UserTable::RECENT_COUNT + 1];
+  size_t candidate_count = users_->Candidates(peer, candidates), i, j;
+  unsigned int trials = 0;
+  int out_len = -1, found = UserTable::NONE;
+  for (i = 0; i < candidate_count && out_len < 0; ++i) {
+    if (candidates[i] == user) continue;
+    ++trials;
+    out_len = packet_crypt(cipher_, false, users_->key(candidates[i]), in,
+                           len, out);
+    if (out_len >= 0) {
+      found = candidates[i];
+    }
+  }
+
+  if (out_len < 0 && users_->AllowScan(users_->size() - trials)) {
+    for (i = 0; i < users_->size() && out_len < 0; ++i) {
+      for (j = 0; j < candidate_count && candidates[j] != (int)i; ++j) {
+      }
+      if (j < candidate_count || (int)i == user) continue;
+      ++trials;
+      out_len = packet_crypt(cipher_, false, users_->key(i), in, len, out);
+      if (out_len >= 0) {
+        found = i;
+      }
+    }
+  }
+
+  users_->Identified(peer, found, trials);
+  if (found != UserTable::NONE) {
+    user = found;
+  }
+  return out_len;
+}
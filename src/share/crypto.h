@@ -1,8 +1,5 @@
 #pragma once
 
-#include <sodium.h>
-#include <string.h>
-
 #include <memory>
 #include <string>
 #include <vector>
@@ -10,42 +7,122 @@
 #include "util.h"
 #include "debug.h"
 #include "network.h"
+#include "crypto_aead.h"
+#include "crypto_stream.h"
 
-enum {
-  CRYPTO_ERROR = -1,
-  CRYPTO_OK,
-  CRYPTO_NEED_NORE,
-};
+class CryptoCreator;
 
-#define SODIUM_BLOCK_SIZE 64
+// What a datagram grows by when sealed: salt and tag, or the IV of a stream
+// cipher.
+#define CRYPTO_PACKET_ROOM (CIPHER_MAX_KEY_SIZE + CIPHER_MAX_TAG_SIZE)
 
-#define CIPHER_MAX_KEY_SIZE 64
-#define CIPHER_MAX_IV_SIZE 32
-#define CIPHER_MAX_TAG_SIZE 32
+// Session crypto, embedded by value in each session. The cipher is fixed by
+// the CryptoCreator, the switch below picks a compile-time specialization.
+class Crypto {
+ public:
+  // `peer` is the source address of the session, it narrows down the user
+  // when the creator has several.
+  explicit Crypto(const CryptoCreator *creator,
+                  const sockaddr *peer = nullptr);
+  ~Crypto();
 
-struct CipherKey {
-  unsigned int key_size;
-  unsigned int iv_size;
-  unsigned int tag_size;
-  unsigned char key[CIPHER_MAX_KEY_SIZE];
-};
-enum CryptoCipher {
-  CHACHA20 = 0,
-  CHACHA20_IETF,
-  CHACHA20_IETF_POLY1305,
-  XCHACHA20_IETF_POLY1305
-};
+  Crypto(const Crypto &) = delete;
+  Crypto &operator=(const Crypto &) = delete;
 
-class Crypto {
- protected:
-  Crypto();
-  virtual ~Crypto() = 0;
+  // Seals the first `len` bytes of `in` and appends the result to `out`,
+  // usually the output of the peer bufferevent; `in` is drained by `len`.
+  inline int Encrypt(evbuffer *in, size_t len, evbuffer *out) {
+    switch (cipher_) {
+      case CHACHA20:
+        return stream_.Encrypt<CipherChacha20>(in, len, out);
+      case CHACHA20_IETF:
+        return stream_.Encrypt<CipherChacha20Ietf>(in, len, out);
+      case CHACHA20_IETF_POLY1305:
+        return aead_.Encrypt<CipherChacha20IetfPoly1305>(in, len, out);
+      case XCHACHA20_IETF_POLY1305:
+        return aead_.Encrypt<CipherXChacha20IetfPoly1305>(in, len, out);
+      case AES_128_GCM:
+        return aead_.Encrypt<CipherAes128Gcm>(in, len, out);
+      case AES_192_GCM:
+        return aead_.Encrypt<CipherAes192Gcm>(in, len, out);
+      case AES_256_GCM:
+        return aead_.Encrypt<CipherAes256Gcm>(in, len, out);
+      default:
+        return CRYPTO_ERROR;
+    }
+  }
 
- public:
-  virtual void Release();
+  // Opens what is complete at the front of `in` and appends it to `out`,
+  // the rest stays in `in` for the next call. CRYPTO_NEED_NORE when nothing
+  // was appended.
+  inline int Decrypt(evbuffer *in, evbuffer *out) {
+    switch (cipher_) {
+      case CHACHA20:
+        return stream_.Decrypt<CipherChacha20>(in, out);
+      case CHACHA20_IETF:
+        return stream_.Decrypt<CipherChacha20Ietf>(in, out);
+      case CHACHA20_IETF_POLY1305:
+        return aead_.Decrypt<CipherChacha20IetfPoly1305>(in, out);
+      case XCHACHA20_IETF_POLY1305:
+        return aead_.Decrypt<CipherXChacha20IetfPoly1305>(in, out);
+      case AES_128_GCM:
+        return aead_.Decrypt<CipherAes128Gcm>(in, out);
+      case AES_192_GCM:
+        return aead_.Decrypt<CipherAes192Gcm>(in, out);
+      case AES_256_GCM:
+        return aead_.Decrypt<CipherAes256Gcm>(in, out);
+      default:
+        return CRYPTO_ERROR;
+    }
+  }
+
+  // Which member of the union below is live.
+  inline bool Aead() const { return cipher_ >= CHACHA20_IETF_POLY1305; }
+
+  // Parallel variants for the worker pool, AEAD ciphers only.
+  inline bool Parallel() const { return Aead(); }
+
+  inline int EncryptJob(evbuffer *in, size_t len, CryptoJob *job) {
+    switch (cipher_) {
+      case CHACHA20_IETF_POLY1305:
+        return aead_.EncryptJob<CipherChacha20IetfPoly1305>(in, len, job);
+      case XCHACHA20_IETF_POLY1305:
+        return aead_.EncryptJob<CipherXChacha20IetfPoly1305>(in, len, job);
+      case AES_128_GCM:
+        return aead_.EncryptJob<CipherAes128Gcm>(in, len, job);
+      case AES_192_GCM:
+        return aead_.EncryptJob<CipherAes192Gcm>(in, len, job);
+      case AES_256_GCM:
+        return aead_.EncryptJob<CipherAes256Gcm>(in, len, job);
+      default:
+        return CRYPTO_ERROR;
+    }
+  }
 
-  virtual int Encrypt(evbuffer *buf, evbuffer *&out) = 0;
-  virtual int Decrypt(evbuffer *buf, evbuffer *&out) = 0;
+  inline int DecryptJob(evbuffer *in, CryptoJob *job) {
+    switch (cipher_) {
+      case CHACHA20_IETF_POLY1305:
+        return aead_.DecryptJob<CipherChacha20IetfPoly1305>(in, job);
+      case XCHACHA20_IETF_POLY1305:
+        return aead_.DecryptJob<CipherXChacha20IetfPoly1305>(in, job);
+      case AES_128_GCM:
+        return aead_.DecryptJob<CipherAes128Gcm>(in, job);
+      case AES_192_GCM:
+        return aead_.DecryptJob<CipherAes192Gcm>(in, job);
+      case AES_256_GCM:
+        return aead_.DecryptJob<CipherAes256Gcm>(in, job);
+      default:
+        return CRYPTO_ERROR;
+    }
+  }
+
+  // Drops what one direction keeps between calls while it is idle, the
+  // stream ciphers have nothing to give back.
+  inline void Trim(bool encoder) {
+    if (Parallel()) {
+      aead_.Trim(encoder);
+    }
+  }
 
   static void HKEY_MD5(const char *password, unsigned char *key,
                        unsigned int key_size);
@@ -53,20 +130,53 @@ class Crypto {
                         const unsigned char *ikm, int ikm_len,
                         const unsigned char *info, int info_len,
                         unsigned char *okm, int okm_len);
+
+ private:
+  unsigned int cipher_;
+  union {
+    AeadCrypto aead_;
+    StreamCrypto stream_;
+  };
 };
 
 class CryptoCreator {
- public:
-  Crypto *NewCrypto();
+  friend class Crypto;
 
+ public:
   static bool Init(std::string &error);
   static CryptoCreator *NewInstance(const char *algorithm,
                                     const char *password);
+  static std::vector<std::string> Algorithms();
+
+  // Shared by all sessions, salts seen before are rejected on decrypt.
+  void SetReplayFilter(ReplayFilter *replay_filter);
+
+  // Serves every user of `users` instead of the single password, each
+  // session is bound to the user whose key opens its first chunk. Derives
+  // the master keys, AEAD algorithms only.
+  bool SetUsers(UserTable *users, std::string &error);
+
+  // Shadowsocks UDP, a datagram at a time: each carries its own salt, or IV
+  // with the stream ciphers, and is sealed whole under a zero nonce. `out`
+  // needs room for `len` and CRYPTO_PACKET_ROOM. The length written to
+  // `out`, or -1 when the datagram does not open. With several users,
+  // `user` picks the key to seal with; on open it is tried first and left
+  // at the one that fit. Otherwise the users suggested for `peer`, a
+  // UserTable::PeerKey(), go next and everybody else last, as for sessions.
+  int SealPacket(const unsigned char *in, size_t len, unsigned char *out,
+                 int user) const;
+  int OpenPacket(const unsigned char *in, size_t len, unsigned char *out,
+                 uint64_t peer, int &user) const;
 
  private:
+  int IdentifyPacket(const unsigned char *in, size_t len, unsigned char *out,
+                     uint64_t peer, int &user) const;
+
   CryptoCreator();
   ~CryptoCreator();
 
   unsigned int cipher_;
   CipherKey cipher_key_;
+  ReplayFilter *replay_filter_ = nullptr;
+  UserTable *users_ = nullptr;
 };
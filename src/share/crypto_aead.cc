@@ -1,237 +1,635 @@
 #include "crypto_aead.h"
 
-#define CHUNK_SIZE_LEN 2
-#define CHUNK_SIZE_MASK 0x3FFF
-#define CHUNK_SIZE_SPLIT (CHUNK_SIZE_MASK / 2 * 2)
+#include "crypto.h"
 
 const unsigned char SUBKEY_INFO[] = "ss-subkey";
 const int SUBKEY_INFO_LEN = (sizeof(SUBKEY_INFO) - 1);
 
-static inline int crypto_aead_encrypt(unsigned int cipher, unsigned char *c,
-                                      unsigned long long *clen_p,
-                                      const unsigned char *m,
-                                      unsigned long long mlen,
-                                      const unsigned char *npub,
-                                      const unsigned char *k) {
-  if (cipher == CHACHA20_IETF_POLY1305) {
-    return crypto_aead_chacha20poly1305_ietf_encrypt(c, clen_p, m, mlen, NULL,
-                                                     0, NULL, npub, k);
-  } else if (cipher == XCHACHA20_IETF_POLY1305) {
-    return crypto_aead_xchacha20poly1305_ietf_encrypt(c, clen_p, m, mlen, NULL,
-                                                      0, NULL, npub, k);
-  } else {
-    return -1;
-  }
-}
-
-static inline int crypto_aead_decrypt(unsigned int cipher, unsigned char *m,
-                                      unsigned long long *mlen_p,
-                                      const unsigned char *c,
-                                      unsigned long long clen,
-                                      const unsigned char *npub,
-                                      const unsigned char *k) {
-  if (cipher == CHACHA20_IETF_POLY1305) {
-    return crypto_aead_chacha20poly1305_ietf_decrypt(m, mlen_p, NULL, c, clen,
-                                                     NULL, 0, npub, k);
-  } else if (cipher == XCHACHA20_IETF_POLY1305) {
-    return crypto_aead_xchacha20poly1305_ietf_decrypt(m, mlen_p, NULL, c, clen,
-                                                      NULL, 0, npub, k);
-  } else {
-    return -1;
+// Returns a pointer to the first `len` bytes of `buf`. Points into the
+// evbuffer chain itself when it is contiguous, only a chunk spanning two
+// chains is linearized into `copy`.
+static inline const unsigned char *evbuffer_chunk(evbuffer *buf, size_t len,
+                                                  unsigned char *copy) {
+  evbuffer_iovec v;
+  if (evbuffer_peek(buf, len, NULL, &v, 1) == 1 && v.iov_len >= len) {
+    return (const unsigned char *)v.iov_base;
+  }
+  evbuffer_copyout(buf, copy, len);
+  return copy;
+}
+
+// Input of a job is addressed as (piece, offset) into the iovecs peeked from
+// its evbuffer, these walk and read it without touching the evbuffer.
+static inline void piece_advance(const std::vector<evbuffer_iovec> &pieces,
+                                 size_t &piece, size_t &offset, size_t len) {
+  offset += len;
+  while (piece < pieces.size() && offset >= pieces[piece].iov_len) {
+    offset -= pieces[piece].iov_len;
+    ++piece;
   }
 }
 
-AeadCrypto::AeadCrypto(unsigned int cipher, CipherKey *cipher_key)
-    : cipher_(cipher) {
+static inline const unsigned char *piece_chunk(
+    const std::vector<evbuffer_iovec> &pieces, size_t piece, size_t offset,
+    size_t len, unsigned char *copy) {
+  const unsigned char *base = (const unsigned char *)pieces[piece].iov_base;
+  if (pieces[piece].iov_len - offset >= len) {
+    return base + offset;
+  }
+
+  size_t pos = 0, part;
+  while (pos < len) {
+    part = pieces[piece].iov_len - offset;
+    if (part > len - pos) part = len - pos;
+    memcpy(copy + pos, (const unsigned char *)pieces[piece].iov_base + offset,
+           part);
+    pos += part;
+    offset = 0;
+    ++piece;
+  }
+  return copy;
+}
+
+static inline void job_peek(CryptoJob *job, evbuffer *buf) {
+  int n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+  job->pieces.resize(n > 0 ? n : 0);
+  if (n > 0) {
+    evbuffer_peek(buf, -1, NULL, job->pieces.data(), n);
+  }
+}
+
+// Chunks planned against another buffer carry their absolute position in
+// `offset`, this turns it into (piece, offset) into the job's own pieces.
+static inline void job_locate(CryptoJob *job) {
+  size_t piece = 0, offset = 0, pos = 0, chunk_pos;
+  for (CryptoChunk &chunk : job->chunks) {
+    chunk_pos = chunk.offset;
+    piece_advance(job->pieces, piece, offset, chunk_pos - pos);
+    pos = chunk_pos;
+    chunk.piece = piece;
+    chunk.offset = offset;
+  }
+}
+
+AeadCrypto::AeadCrypto(const CipherKey *cipher_key,
+                       ReplayFilter *replay_filter, UserTable *users,
+                       uint64_t peer)
+    : replay_filter_(replay_filter), users_(users), peer_(peer) {
   memset(&cipher_aead_key_, 0, sizeof(cipher_aead_key_));
-  cipher_aead_key_.key_size = cipher_key->key_size;
-  cipher_aead_key_.iv_size = cipher_key->iv_size;
-  cipher_aead_key_.tag_size = cipher_key->tag_size;
-  memcpy(cipher_aead_key_.key, cipher_key->key, cipher_key->key_size);
+  cipher_aead_key_.key = cipher_key->key;
 }
 
 AeadCrypto::~AeadCrypto() {
-  if (decode_cached_) {
-    evbuffer_free(decode_cached_);
+  if (encode_ctx_) {
+    EVP_CIPHER_CTX_free(encode_ctx_);
+  }
+  if (decode_ctx_) {
+    EVP_CIPHER_CTX_free(decode_ctx_);
   }
 }
 
-int AeadCrypto::Encrypt(evbuffer *buf, evbuffer *&out) {
-  size_t source_pos = 0, source_len = evbuffer_get_length(buf);
-  unsigned char *source_ptr = evbuffer_pullup(buf, source_len);
+void AeadCrypto::Trim(bool encoder) {
+  EVP_CIPHER_CTX *&ctx = encoder ? encode_ctx_ : decode_ctx_;
+  if (ctx) {
+    EVP_CIPHER_CTX_free(ctx);
+    ctx = nullptr;
+  }
+}
+
+template <class Cipher>
+void AeadCrypto::Resume() {
+  if (en_init_ && !encode_ctx_) {
+    Cipher::Init(encode_ctx_, cipher_aead_key_.encode_subkey, true);
+  }
+  if (decode_step_ != DECODE_SALT && !decode_ctx_) {
+    Cipher::Init(decode_ctx_, cipher_aead_key_.decode_subkey, false);
+  }
+}
 
+template <class Cipher>
+size_t AeadCrypto::EncodeLength(size_t source_len) {
   size_t chunk_count = source_len / CHUNK_SIZE_SPLIT,
          last_chunk_len = source_len % CHUNK_SIZE_SPLIT;
-  size_t target_pos = 0, target_len = (2 * cipher_aead_key_.tag_size +
-                                       CHUNK_SIZE_LEN + CHUNK_SIZE_SPLIT) *
-                                      chunk_count;
+  size_t target_len =
+      (2 * Cipher::TAG_SIZE + CHUNK_SIZE_LEN + CHUNK_SIZE_SPLIT) * chunk_count;
   if (last_chunk_len > 0) {
-    chunk_count += 1;
-    target_len +=
-        2 * cipher_aead_key_.tag_size + CHUNK_SIZE_LEN + last_chunk_len;
+    target_len += 2 * Cipher::TAG_SIZE + CHUNK_SIZE_LEN + last_chunk_len;
   }
   if (!en_init_) {
-    target_len += cipher_aead_key_.key_size;
-    randombytes_buf(cipher_aead_key_.encode_salt, cipher_aead_key_.key_size);
-    Crypto::HKDF_SHA1(cipher_aead_key_.encode_salt, cipher_aead_key_.key_size,
-                      cipher_aead_key_.key, cipher_aead_key_.key_size,
-                      SUBKEY_INFO, SUBKEY_INFO_LEN,
-                      cipher_aead_key_.encode_subkey,
-                      cipher_aead_key_.key_size);
+    target_len += Cipher::KEY_SIZE;
   }
+  return target_len;
+}
 
-  evbuffer_iovec v;
-  out = evbuffer_new();
-  evbuffer_reserve_space(out, target_len, &v, 1);
+// Starts the encoder on its first call, the salt goes in front of `target`.
+template <class Cipher>
+size_t AeadCrypto::EncodeSalt(unsigned char *target) {
+  if (en_init_) {
+    return 0;
+  }
 
-  if (!en_init_) {
-    en_init_ = true;
-    memcpy((unsigned char *)v.iov_base + target_pos,
-           cipher_aead_key_.encode_salt, cipher_aead_key_.key_size);
-    target_pos += cipher_aead_key_.key_size;
+  en_init_ = true;
+  randombytes_buf(target, Cipher::KEY_SIZE);
+  if (replay_filter_) {
+    replay_filter_->Add(target, Cipher::KEY_SIZE);
+  }
+  Crypto::HKDF_SHA1(target, Cipher::KEY_SIZE, cipher_aead_key_.key,
+                    Cipher::KEY_SIZE, SUBKEY_INFO, SUBKEY_INFO_LEN,
+                    cipher_aead_key_.encode_subkey, Cipher::KEY_SIZE);
+  Cipher::Init(encode_ctx_, cipher_aead_key_.encode_subkey, true);
+  return Cipher::KEY_SIZE;
+}
+
+// Bytes needed before DecodeSalt can run. With several users the first
+// length block tells whose key it is, with a replay filter it shows the
+// salt is genuine before the filter records it.
+template <class Cipher>
+size_t AeadCrypto::DecodeSaltLength() const {
+  return Cipher::KEY_SIZE + (users_ || replay_filter_
+                                 ? CHUNK_SIZE_LEN + Cipher::TAG_SIZE
+                                 : 0);
+}
+
+// Takes the peer salt off `buf` and derives the decode subkey, false when
+// the salt was replayed or, with several users, matches no key. Salts
+// whose first length block does not open are never recorded, so probes
+// cannot wear out the replay filter.
+template <class Cipher>
+bool AeadCrypto::DecodeSalt(evbuffer *buf) {
+  unsigned char salt[CIPHER_MAX_KEY_SIZE];
+  evbuffer_remove(buf, salt, Cipher::KEY_SIZE);
+  if (replay_filter_ && replay_filter_->Test(salt, Cipher::KEY_SIZE)) {
+    return false;
+  }
+
+  if (users_) {
+    if (!IdentifyUser<Cipher>(buf, salt)) {
+      return false;
+    }
+  } else {
+    Crypto::HKDF_SHA1(salt, Cipher::KEY_SIZE, cipher_aead_key_.key,
+                      Cipher::KEY_SIZE, SUBKEY_INFO, SUBKEY_INFO_LEN,
+                      cipher_aead_key_.decode_subkey, Cipher::KEY_SIZE);
+    Cipher::Init(decode_ctx_, cipher_aead_key_.decode_subkey, false);
+    if (replay_filter_) {
+      unsigned char chunk_copy[CHUNK_SIZE_LEN + CIPHER_MAX_TAG_SIZE];
+      if (!LengthOpens<Cipher>(evbuffer_chunk(
+              buf, CHUNK_SIZE_LEN + Cipher::TAG_SIZE, chunk_copy))) {
+        return false;
+      }
+    }
   }
 
+  if (replay_filter_ &&
+      !replay_filter_->CheckAndAdd(salt, Cipher::KEY_SIZE)) {
+    return false;
+  }
+  decode_step_ = DECODE_LENGTH;
+  return true;
+}
+
+// Whether the decode subkey opens the length `block` at the current nonce,
+// which stays where it is.
+template <class Cipher>
+bool AeadCrypto::LengthOpens(const unsigned char *block) {
   unsigned short len;
+  unsigned long long decrypt_len = CHUNK_SIZE_LEN;
+  return Cipher::Decrypt(decode_ctx_, (unsigned char *)&len, &decrypt_len,
+                         block, CHUNK_SIZE_LEN + Cipher::TAG_SIZE,
+                         cipher_aead_key_.decode_iv,
+                         cipher_aead_key_.decode_subkey) == 0;
+}
+
+// Tries the master keys on the first length block of `buf` until one opens
+// it, the users suggested by the table first. The winner's key becomes the
+// session key for both directions and its subkey is left set up for
+// decoding; the block itself stays in `buf`.
+template <class Cipher>
+bool AeadCrypto::IdentifyUser(evbuffer *buf, const unsigned char *salt) {
+  size_t len_block_len = CHUNK_SIZE_LEN + Cipher::TAG_SIZE;
+  unsigned char chunk_copy[CHUNK_SIZE_LEN + CIPHER_MAX_TAG_SIZE];
+  const unsigned char *chunk_ptr =
+      evbuffer_chunk(buf, len_block_len, chunk_copy);
+
+  int candidates[UserTable::RECENT_COUNT + 1];
+  size_t candidate_count = users_->Candidates(peer_, candidates);
+  size_t total = candidate_count + users_->size(), i, j;
+
+  unsigned int trials = 0;
+  int user = UserTable::NONE, candidate;
+  for (i = 0; i < total && user == UserTable::NONE; ++i) {
+    if (i < candidate_count) {
+      candidate = candidates[i];
+    } else {
+      candidate = (int)(i - candidate_count);
+      for (j = 0; j < candidate_count && candidates[j] != candidate; ++j) {
+      }
+      if (j < candidate_count) continue;
+    }
+
+    ++trials;
+    Crypto::HKDF_SHA1(salt, Cipher::KEY_SIZE, users_->key(candidate),
+                      Cipher::KEY_SIZE, SUBKEY_INFO, SUBKEY_INFO_LEN,
+                      cipher_aead_key_.decode_subkey, Cipher::KEY_SIZE);
+    Cipher::Init(decode_ctx_, cipher_aead_key_.decode_subkey, false);
+    if (LengthOpens<Cipher>(chunk_ptr)) {
+      user = candidate;
+    }
+  }
+
+  users_->Identified(peer_, user, trials);
+  if (user == UserTable::NONE) {
+    return false;
+  }
+
+  user_ = user;
+  cipher_aead_key_.key = users_->key(user);
+  return true;
+}
+
+// Seals the first `len` bytes of `in` straight into space reserved at the end
+// of `out`, draining them from `in` chunk by chunk. Nothing is committed to
+// `out` when a chunk fails to seal.
+template <class Cipher>
+int AeadCrypto::Encrypt(evbuffer *in, size_t len, evbuffer *out) {
+  Resume<Cipher>();
+
+  size_t chunk_count = (len + CHUNK_SIZE_SPLIT - 1) / CHUNK_SIZE_SPLIT,
+         last_chunk_len = len % CHUNK_SIZE_SPLIT;
+  size_t target_len = EncodeLength<Cipher>(len);
+
+  evbuffer_iovec v;
+  evbuffer_reserve_space(out, target_len, &v, 1);
+
+  size_t target_pos = EncodeSalt<Cipher>((unsigned char *)v.iov_base);
+
+  unsigned short chunk_size;
   unsigned long long encrypt_len;
   size_t chunk_index, chunk_len;
+  const unsigned char *chunk_ptr;
+  unsigned char chunk_copy[CHUNK_SIZE_SPLIT];
 
   for (chunk_index = 1; chunk_index <= chunk_count; ++chunk_index) {
-    chunk_len = chunk_index < chunk_count ? CHUNK_SIZE_SPLIT : last_chunk_len;
-
-    len = htons(chunk_len);
-    encrypt_len = CHUNK_SIZE_LEN + cipher_aead_key_.tag_size;
-    crypto_aead_encrypt(cipher_, (unsigned char *)v.iov_base + target_pos,
-                        &encrypt_len, (unsigned char *)&len, CHUNK_SIZE_LEN,
-                        cipher_aead_key_.encode_iv,
-                        cipher_aead_key_.encode_subkey);
+    chunk_len = chunk_index < chunk_count || last_chunk_len == 0
+                    ? CHUNK_SIZE_SPLIT
+                    : last_chunk_len;
+
+    chunk_size = htons(chunk_len);
+    encrypt_len = CHUNK_SIZE_LEN + Cipher::TAG_SIZE;
+    if (Cipher::Encrypt(encode_ctx_, (unsigned char *)v.iov_base + target_pos,
+                        &encrypt_len, (unsigned char *)&chunk_size,
+                        CHUNK_SIZE_LEN, cipher_aead_key_.encode_iv,
+                        cipher_aead_key_.encode_subkey)) {
+      return CRYPTO_ERROR;
+    }
     target_pos += encrypt_len;
-    sodium_increment(cipher_aead_key_.encode_iv, cipher_aead_key_.iv_size);
+    sodium_increment(cipher_aead_key_.encode_iv, Cipher::IV_SIZE);
 
-    encrypt_len = chunk_len + cipher_aead_key_.tag_size;
-    crypto_aead_encrypt(cipher_, (unsigned char *)v.iov_base + target_pos,
-                        &encrypt_len, source_ptr + source_pos, chunk_len,
+    chunk_ptr = evbuffer_chunk(in, chunk_len, chunk_copy);
+    encrypt_len = chunk_len + Cipher::TAG_SIZE;
+    if (Cipher::Encrypt(encode_ctx_, (unsigned char *)v.iov_base + target_pos,
+                        &encrypt_len, chunk_ptr, chunk_len,
                         cipher_aead_key_.encode_iv,
-                        cipher_aead_key_.encode_subkey);
+                        cipher_aead_key_.encode_subkey)) {
+      return CRYPTO_ERROR;
+    }
     target_pos += encrypt_len;
-    sodium_increment(cipher_aead_key_.encode_iv, cipher_aead_key_.iv_size);
+    sodium_increment(cipher_aead_key_.encode_iv, Cipher::IV_SIZE);
 
-    source_pos += chunk_len;
+    evbuffer_drain(in, chunk_len);
   }
 
   v.iov_len = target_len;
   evbuffer_commit_space(out, &v, 1);
 
-  evbuffer_free(buf);
+  if (user_ != UserTable::NONE) {
+    users_->AddBytes(user_, 0, len);
+  }
   return CRYPTO_OK;
 }
 
-int AeadCrypto::Decrypt(evbuffer *buf, evbuffer *&out) {
-  if (decode_cached_) {
-    evbuffer_add_buffer(decode_cached_, buf);
-    evbuffer_free(buf);
-    buf = decode_cached_;
-    decode_cached_ = nullptr;
+// Opens every complete chunk at the front of `in` into `out`. An incomplete
+// one stays in `in` for the next call, with its length block already taken
+// when that much has arrived.
+template <class Cipher>
+int AeadCrypto::Decrypt(evbuffer *in, evbuffer *out) {
+  evbuffer_iovec v;
+
+  unsigned short len;
+  unsigned long long decrypt_len;
+  size_t source_len, out_len = 0;
+  size_t len_block_len = CHUNK_SIZE_LEN + Cipher::TAG_SIZE;
+  const unsigned char *chunk_ptr;
+  unsigned char chunk_copy[CHUNK_SIZE_MASK + CIPHER_MAX_TAG_SIZE];
+  bool failed = false;
+
+  Resume<Cipher>();
+  while (!failed) {
+    source_len = evbuffer_get_length(in);
+
+    if (decode_step_ == DECODE_SALT) {
+      if (source_len < DecodeSaltLength<Cipher>()) break;
+
+      failed = !DecodeSalt<Cipher>(in);
+    } else if (decode_step_ == DECODE_LENGTH) {
+      if (source_len < len_block_len) break;
+
+      chunk_ptr = evbuffer_chunk(in, len_block_len, chunk_copy);
+      decrypt_len = CHUNK_SIZE_LEN;
+      if (Cipher::Decrypt(decode_ctx_, (unsigned char *)&len, &decrypt_len,
+                          chunk_ptr, len_block_len, cipher_aead_key_.decode_iv,
+                          cipher_aead_key_.decode_subkey)) {
+        failed = true;
+        break;
+      }
+
+      len = ntohs(len);
+      if (len > CHUNK_SIZE_MASK) {
+        failed = true;
+        break;
+      }
+
+      evbuffer_drain(in, len_block_len);
+      sodium_increment(cipher_aead_key_.decode_iv, Cipher::IV_SIZE);
+      decode_len_ = len;
+      decode_step_ = DECODE_PAYLOAD;
+    } else {
+      len = decode_len_;
+      if (source_len < len + (size_t)Cipher::TAG_SIZE) break;
+
+      evbuffer_reserve_space(out, len, &v, 1);
+
+      chunk_ptr = evbuffer_chunk(in, len + Cipher::TAG_SIZE, chunk_copy);
+      decrypt_len = len;
+      if (Cipher::Decrypt(decode_ctx_, (unsigned char *)v.iov_base,
+                          &decrypt_len, chunk_ptr, len + Cipher::TAG_SIZE,
+                          cipher_aead_key_.decode_iv,
+                          cipher_aead_key_.decode_subkey)) {
+        failed = true;
+        break;
+      }
+
+      v.iov_len = len;
+      evbuffer_commit_space(out, &v, 1);
+
+      evbuffer_drain(in, len + Cipher::TAG_SIZE);
+      sodium_increment(cipher_aead_key_.decode_iv, Cipher::IV_SIZE);
+      decode_step_ = DECODE_LENGTH;
+      out_len += len;
+    }
+  }
+
+  if (out_len > 0 && user_ != UserTable::NONE) {
+    users_->AddBytes(user_, out_len, 0);
+  }
+  if (failed) {
+    return CRYPTO_ERROR;
+  }
+  return out_len > 0 ? CRYPTO_OK : CRYPTO_NEED_NORE;
+}
+
+template <class Cipher>
+int AeadCrypto::EncryptJob(evbuffer *in, size_t len, CryptoJob *job) {
+  size_t chunk_count = (len + CHUNK_SIZE_SPLIT - 1) / CHUNK_SIZE_SPLIT,
+         last_chunk_len = len % CHUNK_SIZE_SPLIT;
+
+  job->input = evbuffer_new();
+  evbuffer_remove_buffer(in, job->input, len);
+  job->output = evbuffer_new();
+  job->output_len = EncodeLength<Cipher>(len);
+  evbuffer_reserve_space(job->output, job->output_len, &job->reserved, 1);
+
+  unsigned char *target = (unsigned char *)job->reserved.iov_base;
+  size_t target_pos = EncodeSalt<Cipher>(target);
+  memcpy(job->subkey, cipher_aead_key_.encode_subkey, Cipher::KEY_SIZE);
+  job_peek(job, job->input);
+
+  size_t chunk_index, piece = 0, offset = 0;
+  job->chunks.resize(chunk_count);
+  for (chunk_index = 0; chunk_index < chunk_count; ++chunk_index) {
+    CryptoChunk &chunk = job->chunks[chunk_index];
+    chunk.piece = piece;
+    chunk.offset = offset;
+    chunk.len = chunk_index + 1 < chunk_count || last_chunk_len == 0
+                    ? CHUNK_SIZE_SPLIT
+                    : last_chunk_len;
+    chunk.out = target + target_pos;
+    memcpy(chunk.nonce, cipher_aead_key_.encode_iv, Cipher::IV_SIZE);
+
+    target_pos += 2 * Cipher::TAG_SIZE + CHUNK_SIZE_LEN + chunk.len;
+    sodium_increment(cipher_aead_key_.encode_iv, Cipher::IV_SIZE);
+    sodium_increment(cipher_aead_key_.encode_iv, Cipher::IV_SIZE);
+    piece_advance(job->pieces, piece, offset, chunk.len);
   }
 
-  size_t source_pos = 0, source_len = evbuffer_get_length(buf);
-  unsigned char *source_ptr = evbuffer_pullup(buf, source_len);
+  if (user_ != UserTable::NONE) {
+    users_->AddBytes(user_, 0, len);
+  }
+  job->run = &AeadCrypto::SealChunks<Cipher>;
+  return CRYPTO_OK;
+}
 
-  if (!de_init_) {
-    if (source_len < cipher_aead_key_.key_size) {
-      evbuffer_free(buf);
-      out = nullptr;
+// Length blocks are opened here, one after another, since each tells where
+// the next chunk starts. Only the payloads are left to the job, which takes
+// the parsed front of `in` along; an incomplete chunk stays behind.
+template <class Cipher>
+int AeadCrypto::DecryptJob(evbuffer *in, CryptoJob *job) {
+  if (decode_step_ == DECODE_SALT) {
+    if (evbuffer_get_length(in) < DecodeSaltLength<Cipher>()) {
+      return CRYPTO_NEED_NORE;
+    }
+    if (!DecodeSalt<Cipher>(in)) {
       return CRYPTO_ERROR;
     }
-
-    de_init_ = true;
-    memcpy(cipher_aead_key_.decode_salt, source_ptr + source_pos,
-           cipher_aead_key_.key_size);
-    source_pos += cipher_aead_key_.key_size;
-
-    Crypto::HKDF_SHA1(cipher_aead_key_.decode_salt, cipher_aead_key_.key_size,
-                      cipher_aead_key_.key, cipher_aead_key_.key_size,
-                      SUBKEY_INFO, SUBKEY_INFO_LEN,
-                      cipher_aead_key_.decode_subkey,
-                      cipher_aead_key_.key_size);
   }
+  Resume<Cipher>();
 
-  evbuffer_iovec v;
-  out = evbuffer_new();
+  memcpy(job->subkey, cipher_aead_key_.decode_subkey, Cipher::KEY_SIZE);
+  job_peek(job, in);
 
   unsigned short len;
   unsigned long long decrypt_len;
-  size_t drain_len = source_pos;
-  int err = 0, last = CRYPTO_NEED_NORE;
+  size_t source_len = evbuffer_get_length(in), piece = 0, offset = 0;
+  size_t len_block_len = CHUNK_SIZE_LEN + Cipher::TAG_SIZE, target_pos = 0;
+  size_t parsed_len = 0;
+  const unsigned char *chunk_ptr;
+  unsigned char chunk_copy[CHUNK_SIZE_LEN + CIPHER_MAX_TAG_SIZE];
 
   while (1) {
-    if (source_len - source_pos < CHUNK_SIZE_LEN + cipher_aead_key_.tag_size) {
-      last = CRYPTO_NEED_NORE;
-      break;
-    }
-
-    decrypt_len = CHUNK_SIZE_LEN;
-    err = crypto_aead_decrypt(
-        cipher_, (unsigned char *)&len, &decrypt_len, source_ptr + source_pos,
-        CHUNK_SIZE_LEN + cipher_aead_key_.tag_size, cipher_aead_key_.decode_iv,
-        cipher_aead_key_.decode_subkey);
-    if (err) {
-      last = CRYPTO_ERROR;
-      break;
-    }
-
-    len = ntohs(len);
-    source_pos += CHUNK_SIZE_LEN + cipher_aead_key_.tag_size;
-    if (source_len - source_pos < len + cipher_aead_key_.tag_size) {
-      last = CRYPTO_NEED_NORE;
-      break;
+    if (decode_step_ == DECODE_LENGTH) {
+      if (source_len < len_block_len) break;
+
+      chunk_ptr =
+          piece_chunk(job->pieces, piece, offset, len_block_len, chunk_copy);
+      decrypt_len = CHUNK_SIZE_LEN;
+      if (Cipher::Decrypt(decode_ctx_, (unsigned char *)&len, &decrypt_len,
+                          chunk_ptr, len_block_len, cipher_aead_key_.decode_iv,
+                          cipher_aead_key_.decode_subkey)) {
+        return CRYPTO_ERROR;
+      }
+
+      len = ntohs(len);
+      if (len > CHUNK_SIZE_MASK) {
+        return CRYPTO_ERROR;
+      }
+
+      source_len -= len_block_len;
+      parsed_len += len_block_len;
+      piece_advance(job->pieces, piece, offset, len_block_len);
+      sodium_increment(cipher_aead_key_.decode_iv, Cipher::IV_SIZE);
+      decode_len_ = len;
+      decode_step_ = DECODE_PAYLOAD;
+    } else {
+      len = decode_len_;
+      if (source_len < len + (size_t)Cipher::TAG_SIZE) break;
+
+      CryptoChunk chunk;
+      chunk.piece = 0;
+      chunk.offset = parsed_len;
+      chunk.len = len;
+      chunk.out = nullptr;
+      memcpy(chunk.nonce, cipher_aead_key_.decode_iv, Cipher::IV_SIZE);
+      job->chunks.push_back(chunk);
+
+      target_pos += len;
+      source_len -= len + Cipher::TAG_SIZE;
+      parsed_len += len + Cipher::TAG_SIZE;
+      piece_advance(job->pieces, piece, offset, len + Cipher::TAG_SIZE);
+      sodium_increment(cipher_aead_key_.decode_iv, Cipher::IV_SIZE);
+      decode_step_ = DECODE_LENGTH;
     }
-    sodium_increment(cipher_aead_key_.decode_iv, cipher_aead_key_.iv_size);
+  }
 
-    evbuffer_reserve_space(out, len, &v, 1);
+  if (job->chunks.empty()) {
+    evbuffer_drain(in, parsed_len);
+    return CRYPTO_NEED_NORE;
+  }
 
-    decrypt_len = len;
-    err = crypto_aead_decrypt(
-        cipher_, (unsigned char *)v.iov_base, &decrypt_len,
-        source_ptr + source_pos, len + cipher_aead_key_.tag_size,
-        cipher_aead_key_.decode_iv, cipher_aead_key_.decode_subkey);
+  job->input = evbuffer_new();
+  evbuffer_remove_buffer(in, job->input, parsed_len);
+  job_peek(job, job->input);
+  job_locate(job);
+
+  job->output = evbuffer_new();
+  job->output_len = target_pos;
+  evbuffer_reserve_space(job->output, target_pos > 0 ? target_pos : 1,
+                         &job->reserved, 1);
+  target_pos = 0;
+  for (CryptoChunk &chunk : job->chunks) {
+    chunk.out = (unsigned char *)job->reserved.iov_base + target_pos;
+    target_pos += chunk.len;
+  }
 
-    v.iov_len = len;
-    evbuffer_commit_space(out, &v, 1);
+  if (user_ != UserTable::NONE) {
+    users_->AddBytes(user_, job->output_len, 0);
+  }
+  job->run = &AeadCrypto::OpenChunks<Cipher>;
+  return CRYPTO_OK;
+}
 
-    if (err) {
-      last = CRYPTO_ERROR;
-      break;
-    }
+template <class Cipher>
+void AeadCrypto::SealChunks(CryptoJob *job, size_t first, size_t last) {
+  EVP_CIPHER_CTX *ctx = nullptr;
+  Cipher::Init(ctx, job->subkey, true);
 
-    source_pos += len + cipher_aead_key_.tag_size;
-    sodium_increment(cipher_aead_key_.decode_iv, cipher_aead_key_.iv_size);
+  unsigned short len;
+  unsigned long long encrypt_len;
+  const unsigned char *chunk_ptr;
+  unsigned char chunk_copy[CHUNK_SIZE_SPLIT], nonce[CIPHER_MAX_IV_SIZE];
+  int err = 0;
+
+  for (size_t i = first; i < last && !err; ++i) {
+    const CryptoChunk &chunk = job->chunks[i];
+
+    len = htons(chunk.len);
+    encrypt_len = CHUNK_SIZE_LEN + Cipher::TAG_SIZE;
+    err |= Cipher::Encrypt(ctx, chunk.out, &encrypt_len, (unsigned char *)&len,
+                           CHUNK_SIZE_LEN, chunk.nonce, job->subkey);
+
+    memcpy(nonce, chunk.nonce, Cipher::IV_SIZE);
+    sodium_increment(nonce, Cipher::IV_SIZE);
+    chunk_ptr = piece_chunk(job->pieces, chunk.piece, chunk.offset, chunk.len,
+                            chunk_copy);
+    encrypt_len = chunk.len + Cipher::TAG_SIZE;
+    err |= Cipher::Encrypt(ctx, chunk.out + CHUNK_SIZE_LEN + Cipher::TAG_SIZE,
+                           &encrypt_len, chunk_ptr, chunk.len, nonce,
+                           job->subkey);
+  }
 
-    drain_len = source_pos;
-    if (drain_len == source_len) {
-      last = CRYPTO_OK;
-      break;
-    }
+  if (err) {
+    job->failed = true;
+  }
+  if (ctx) {
+    EVP_CIPHER_CTX_free(ctx);
   }
+}
 
-  if (last != CRYPTO_NEED_NORE) {
-    evbuffer_free(buf);
-    if (last == CRYPTO_ERROR) {
-      evbuffer_free(out);
-      out = nullptr;
-    }
-  } else {
-    decode_cached_ = buf;
-    if (drain_len > 0) {
-      evbuffer_drain(buf, drain_len);
-    }
+template <class Cipher>
+void AeadCrypto::OpenChunks(CryptoJob *job, size_t first, size_t last) {
+  EVP_CIPHER_CTX *ctx = nullptr;
+  Cipher::Init(ctx, job->subkey, false);
 
-    if (evbuffer_get_length(out) > 0) {
-      last = CRYPTO_OK;
-    } else {
-      evbuffer_free(out);
-      out = nullptr;
-    }
+  unsigned long long decrypt_len;
+  const unsigned char *chunk_ptr;
+  unsigned char chunk_copy[CHUNK_SIZE_MASK + CIPHER_MAX_TAG_SIZE];
+  int err = 0;
+
+  for (size_t i = first; i < last && !err; ++i) {
+    const CryptoChunk &chunk = job->chunks[i];
+
+    chunk_ptr = piece_chunk(job->pieces, chunk.piece, chunk.offset,
+                            chunk.len + Cipher::TAG_SIZE, chunk_copy);
+    decrypt_len = chunk.len;
+    err |= Cipher::Decrypt(ctx, chunk.out, &decrypt_len, chunk_ptr,
+                           chunk.len + Cipher::TAG_SIZE, chunk.nonce,
+                           job->subkey);
   }
 
-  return last;
+  if (err) {
+    job->failed = true;
+  }
+  if (ctx) {
+    EVP_CIPHER_CTX_free(ctx);
+  }
 }
+
+template int AeadCrypto::Encrypt<CipherChacha20IetfPoly1305>(evbuffer *in,
+                                                             size_t len,
+                                                             evbuffer *out);
+template int AeadCrypto::Decrypt<CipherChacha20IetfPoly1305>(evbuffer *in,
+                                                             evbuffer *out);
+template int AeadCrypto::Encrypt<CipherXChacha20IetfPoly1305>(evbuffer *in,
+                                                              size_t len,
+                                                              evbuffer *out);
+template int AeadCrypto::Decrypt<CipherXChacha20IetfPoly1305>(evbuffer *in,
+                                                              evbuffer *out);
+template int AeadCrypto::Encrypt<CipherAes128Gcm>(evbuffer *in, size_t len,
+                                                  evbuffer *out);
+template int AeadCrypto::Decrypt<CipherAes128Gcm>(evbuffer *in, evbuffer *out);
+template int AeadCrypto::Encrypt<CipherAes192Gcm>(evbuffer *in, size_t len,
+                                                  evbuffer *out);
+template int AeadCrypto::Decrypt<CipherAes192Gcm>(evbuffer *in, evbuffer *out);
+template int AeadCrypto::Encrypt<CipherAes256Gcm>(evbuffer *in, size_t len,
+                                                  evbuffer *out);
+template int AeadCrypto::Decrypt<CipherAes256Gcm>(evbuffer *in, evbuffer *out);
+template int AeadCrypto::EncryptJob<CipherChacha20IetfPoly1305>(evbuffer *in,
+                                                                size_t len,
+                                                                CryptoJob *job);
+template int AeadCrypto::DecryptJob<CipherChacha20IetfPoly1305>(evbuffer *in,
+                                                                CryptoJob *job);
+template int AeadCrypto::EncryptJob<CipherXChacha20IetfPoly1305>(
+    evbuffer *in, size_t len, CryptoJob *job);
+template int AeadCrypto::DecryptJob<CipherXChacha20IetfPoly1305>(
+    evbuffer *in, CryptoJob *job);
+template int AeadCrypto::EncryptJob<CipherAes128Gcm>(evbuffer *in, size_t len,
+                                                     CryptoJob *job);
+template int AeadCrypto::DecryptJob<CipherAes128Gcm>(evbuffer *in,
+                                                     CryptoJob *job);
+template int AeadCrypto::EncryptJob<CipherAes192Gcm>(evbuffer *in, size_t len,
+                                                     CryptoJob *job);
+template int AeadCrypto::DecryptJob<CipherAes192Gcm>(evbuffer *in,
+                                                     CryptoJob *job);
+template int AeadCrypto::EncryptJob<CipherAes256Gcm>(evbuffer *in, size_t len,
+                                                     CryptoJob *job);
+template int AeadCrypto::DecryptJob<CipherAes256Gcm>(evbuffer *in,
+                                                     CryptoJob *job);
@@ -1,35 +1,78 @@
 #pragma once
 
-#include "crypto.h"
+#include "crypto_cipher.h"
+#include "crypto_job.h"
+#include "replay_filter.h"
+#include "user_table.h"
 
-class AeadCrypto : Crypto {
-  friend class CryptoCreator;
+class AeadCrypto {
+  friend class Crypto;
 
+  // Decoder position in the incoming stream, kept across calls so a chunk
+  // split over several reads is only parsed once.
+  enum DecodeStep { DECODE_SALT = 0, DECODE_LENGTH, DECODE_PAYLOAD };
+
+  // The master key stays with the creator or the user table, the salts are
+  // only needed while the subkeys are derived.
   struct CipherAeadKey {
-    unsigned int key_size;
-    unsigned int iv_size;
-    unsigned int tag_size;
-    unsigned char key[CIPHER_MAX_KEY_SIZE];
+    const unsigned char *key;
     unsigned char encode_iv[CIPHER_MAX_IV_SIZE];
     unsigned char decode_iv[CIPHER_MAX_IV_SIZE];
-    unsigned char encode_salt[CIPHER_MAX_KEY_SIZE];
-    unsigned char decode_salt[CIPHER_MAX_KEY_SIZE];
     unsigned char encode_subkey[CIPHER_MAX_KEY_SIZE];
     unsigned char decode_subkey[CIPHER_MAX_KEY_SIZE];
   };
 
  protected:
-  AeadCrypto(unsigned int cipher, CipherKey *cipher_key);
+  AeadCrypto(const CipherKey *cipher_key, ReplayFilter *replay_filter,
+             UserTable *users, uint64_t peer);
   ~AeadCrypto();
 
  public:
-  int Encrypt(evbuffer *buf, evbuffer *&out);
-  int Decrypt(evbuffer *buf, evbuffer *&out);
+  template <class Cipher>
+  int Encrypt(evbuffer *in, size_t len, evbuffer *out);
+  template <class Cipher>
+  int Decrypt(evbuffer *in, evbuffer *out);
+
+  // Same stream as Encrypt/Decrypt, but moves the data into `job`, plans its
+  // chunks and leaves sealing/opening the payloads to `job->run`.
+  template <class Cipher>
+  int EncryptJob(evbuffer *in, size_t len, CryptoJob *job);
+  template <class Cipher>
+  int DecryptJob(evbuffer *in, CryptoJob *job);
+
+  // Frees the cipher context of one direction, the next call sets it up
+  // again from the subkey.
+  void Trim(bool encoder);
 
  private:
+  template <class Cipher>
+  void Resume();
+  template <class Cipher>
+  size_t EncodeLength(size_t source_len);
+  template <class Cipher>
+  size_t EncodeSalt(unsigned char *target);
+  template <class Cipher>
+  size_t DecodeSaltLength() const;
+  template <class Cipher>
+  bool DecodeSalt(evbuffer *buf);
+  template <class Cipher>
+  bool IdentifyUser(evbuffer *buf, const unsigned char *salt);
+  template <class Cipher>
+  bool LengthOpens(const unsigned char *block);
+
+  template <class Cipher>
+  static void SealChunks(CryptoJob *job, size_t first, size_t last);
+  template <class Cipher>
+  static void OpenChunks(CryptoJob *job, size_t first, size_t last);
+
   bool en_init_ = false;
-  bool de_init_ = false;
-  unsigned int cipher_ = 0;
+  unsigned char decode_step_ = DECODE_SALT;
+  unsigned short decode_len_ = 0;
   CipherAeadKey cipher_aead_key_;
-  evbuffer *decode_cached_ = nullptr;
+  ReplayFilter *replay_filter_;
+  UserTable *users_;
+  uint64_t peer_;
+  int user_ = UserTable::NONE;
+  EVP_CIPHER_CTX *encode_ctx_ = nullptr;
+  EVP_CIPHER_CTX *decode_ctx_ = nullptr;
 };
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <sodium.h>
+#include <string.h>
+
+#include "network.h"
+
+enum {
+  CRYPTO_ERROR = -1,
+  CRYPTO_OK,
+  CRYPTO_NEED_NORE,
+};
+
+#define SODIUM_BLOCK_SIZE 64
+
+#define CHUNK_SIZE_LEN 2
+#define CHUNK_SIZE_MASK 0x3FFF
+#define CHUNK_SIZE_SPLIT (CHUNK_SIZE_MASK / 2 * 2)
+
+// Largest sizes of the ciphers below, every session carries keys and nonces
+// of this size.
+#define CIPHER_MAX_KEY_SIZE 32
+#define CIPHER_MAX_IV_SIZE 24
+#define CIPHER_MAX_TAG_SIZE 16
+
+struct CipherKey {
+  unsigned int key_size;
+  unsigned int iv_size;
+  unsigned int tag_size;
+  unsigned char key[CIPHER_MAX_KEY_SIZE];
+};
+// Stream ciphers first, every cipher from CHACHA20_IETF_POLY1305 on is AEAD.
+enum CryptoCipher {
+  CHACHA20 = 0,
+  CHACHA20_IETF,
+  CHACHA20_IETF_POLY1305,
+  XCHACHA20_IETF_POLY1305,
+  AES_128_GCM,
+  AES_192_GCM,
+  AES_256_GCM
+};
+
+// Cipher primitives, resolved at compile time by the templated
+// StreamCrypto/AeadCrypto methods. AEAD ciphers receive a per-direction
+// context set up once by Init() with the session subkey, ciphers that do not
+// need one ignore it.
+
+struct CipherChacha20 {
+  enum { KEY_SIZE = 32, IV_SIZE = 8, TAG_SIZE = 0 };
+
+  static inline int Xor(unsigned char *c, const unsigned char *m,
+                        unsigned long long mlen, const unsigned char *n,
+                        uint64_t ic, const unsigned char *k) {
+    return crypto_stream_chacha20_xor_ic(c, m, mlen, n, ic, k);
+  }
+};
+
+struct CipherChacha20Ietf {
+  enum { KEY_SIZE = 32, IV_SIZE = 12, TAG_SIZE = 0 };
+
+  static inline int Xor(unsigned char *c, const unsigned char *m,
+                        unsigned long long mlen, const unsigned char *n,
+                        uint64_t ic, const unsigned char *k) {
+    return crypto_stream_chacha20_ietf_xor_ic(c, m, mlen, n, (uint32_t)ic, k);
+  }
+};
+
+struct CipherChacha20IetfPoly1305 {
+  enum { KEY_SIZE = 32, IV_SIZE = 12, TAG_SIZE = 16 };
+
+  static inline void Init(EVP_CIPHER_CTX *&ctx, const unsigned char *k,
+                          bool encrypt) {}
+
+  static inline int Encrypt(EVP_CIPHER_CTX *ctx, unsigned char *c,
+                            unsigned long long *clen_p,
+                            const unsigned char *m, unsigned long long mlen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    return crypto_aead_chacha20poly1305_ietf_encrypt(c, clen_p, m, mlen, NULL,
+                                                     0, NULL, npub, k);
+  }
+
+  static inline int Decrypt(EVP_CIPHER_CTX *ctx, unsigned char *m,
+                            unsigned long long *mlen_p,
+                            const unsigned char *c, unsigned long long clen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    return crypto_aead_chacha20poly1305_ietf_decrypt(m, mlen_p, NULL, c, clen,
+                                                     NULL, 0, npub, k);
+  }
+};
+
+struct CipherXChacha20IetfPoly1305 {
+  enum { KEY_SIZE = 32, IV_SIZE = 24, TAG_SIZE = 16 };
+
+  static inline void Init(EVP_CIPHER_CTX *&ctx, const unsigned char *k,
+                          bool encrypt) {}
+
+  static inline int Encrypt(EVP_CIPHER_CTX *ctx, unsigned char *c,
+                            unsigned long long *clen_p,
+                            const unsigned char *m, unsigned long long mlen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    return crypto_aead_xchacha20poly1305_ietf_encrypt(c, clen_p, m, mlen, NULL,
+                                                      0, NULL, npub, k);
+  }
+
+  static inline int Decrypt(EVP_CIPHER_CTX *ctx, unsigned char *m,
+                            unsigned long long *mlen_p,
+                            const unsigned char *c, unsigned long long clen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    return crypto_aead_xchacha20poly1305_ietf_decrypt(m, mlen_p, NULL, c, clen,
+                                                      NULL, 0, npub, k);
+  }
+};
+
+template <int KeySize, const EVP_CIPHER *(*Evp)()>
+struct CipherAesGcm {
+  enum { KEY_SIZE = KeySize, IV_SIZE = 12, TAG_SIZE = 16 };
+
+  static inline void Init(EVP_CIPHER_CTX *&ctx, const unsigned char *k,
+                          bool encrypt) {
+    if (!ctx) ctx = EVP_CIPHER_CTX_new();
+    if (encrypt)
+      EVP_EncryptInit_ex(ctx, Evp(), NULL, k, NULL);
+    else
+      EVP_DecryptInit_ex(ctx, Evp(), NULL, k, NULL);
+  }
+
+  static inline int Encrypt(EVP_CIPHER_CTX *ctx, unsigned char *c,
+                            unsigned long long *clen_p,
+                            const unsigned char *m, unsigned long long mlen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    int len = 0;
+    if (!EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, npub) ||
+        !EVP_EncryptUpdate(ctx, c, &len, m, (int)mlen) ||
+        !EVP_EncryptFinal_ex(ctx, c + len, &len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, c + mlen)) {
+      return -1;
+    }
+    *clen_p = mlen + TAG_SIZE;
+    return 0;
+  }
+
+  static inline int Decrypt(EVP_CIPHER_CTX *ctx, unsigned char *m,
+                            unsigned long long *mlen_p,
+                            const unsigned char *c, unsigned long long clen,
+                            const unsigned char *npub,
+                            const unsigned char *k) {
+    int len = 0, mlen = (int)clen - TAG_SIZE;
+    if (mlen < 0 || !EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, npub) ||
+        !EVP_DecryptUpdate(ctx, m, &len, c, mlen) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE,
+                             (void *)(c + mlen)) ||
+        EVP_DecryptFinal_ex(ctx, m + len, &len) <= 0) {
+      return -1;
+    }
+    *mlen_p = mlen;
+    return 0;
+  }
+};
+
+typedef CipherAesGcm<16, EVP_aes_128_gcm> CipherAes128Gcm;
+typedef CipherAesGcm<24, EVP_aes_192_gcm> CipherAes192Gcm;
+typedef CipherAesGcm<32, EVP_aes_256_gcm> CipherAes256Gcm;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "crypto_cipher.h"
+
+class CryptoLane;
+struct CryptoCompletion;
+
+// One AEAD chunk of a job. The input starts `offset` bytes into input piece
+// `piece` and may run over into the next pieces, the output goes straight
+// into the reserved region. For sealing `nonce` covers the length block, the
+// payload uses the next one.
+struct CryptoChunk {
+  size_t piece;
+  size_t offset;
+  unsigned int len;
+  unsigned char *out;
+  unsigned char nonce[CIPHER_MAX_IV_SIZE];
+};
+
+// A large Encrypt/Decrypt call planned on the reactor and sealed or opened by
+// the worker pool. Every nonce and output position is fixed up front, so the
+// chunks are independent and any range of them can run on any thread. The
+// input evbuffer is owned by the job and not touched until it completes.
+struct CryptoJob {
+  void (*run)(CryptoJob *job, size_t first, size_t last) = nullptr;
+  unsigned char subkey[CIPHER_MAX_KEY_SIZE];
+  std::vector<evbuffer_iovec> pieces;
+  std::vector<CryptoChunk> chunks;
+
+  evbuffer *input = nullptr;
+  evbuffer *output = nullptr;
+  evbuffer_iovec reserved;
+  size_t output_len = 0;
+
+  std::atomic<bool> failed{false};
+  std::atomic<size_t> pending{0};
+
+  CryptoLane *owner = nullptr;
+  CryptoCompletion *completion = nullptr;
+  CryptoJob *next = nullptr;
+
+  ~CryptoJob() {
+    if (input) evbuffer_free(input);
+    if (output) evbuffer_free(output);
+  }
+};
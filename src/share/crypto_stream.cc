@@ -1,130 +1,120 @@
 #include "crypto_stream.h"
 
-static inline int crypto_stream_xor_ic(unsigned int cipher, unsigned char *c,
-                                       const unsigned char *m,
-                                       unsigned long long mlen,
-                                       const unsigned char *n, uint64_t ic,
-                                       const unsigned char *k) {
-  if (cipher == CHACHA20) {
-    return crypto_stream_chacha20_xor_ic(c, m, mlen, n, ic, k);
-  } else if (cipher == CHACHA20_IETF) {
-    return crypto_stream_chacha20_ietf_xor_ic(c, m, mlen, n, ic, k);
-  } else {
-    return -1;
-  }
-}
-
-std::vector<unsigned char> StreamCrypto::help_buffer_;
-
-StreamCrypto::StreamCrypto(unsigned int cipher, CipherKey *cipher_key)
-    : cipher_(cipher) {
+StreamCrypto::StreamCrypto(const CipherKey *cipher_key) {
   memset(&cipher_stream_key_, 0, sizeof(cipher_stream_key_));
-  cipher_stream_key_.key_size = cipher_key->key_size;
-  cipher_stream_key_.iv_size = cipher_key->iv_size;
-  memcpy(cipher_stream_key_.key, cipher_key->key, cipher_key->key_size);
+  cipher_stream_key_.key = cipher_key->key;
 }
 
 StreamCrypto::~StreamCrypto() {}
 
-unsigned char *StreamCrypto::GetHelperBuffer(size_t size) {
-  if (size >= help_buffer_.size()) {
-    help_buffer_.resize(size * 1.5);
+template <class Cipher>
+void StreamCrypto::XorStream(evbuffer *buf, size_t data_len,
+                             const unsigned char *iv, size_t &bytes,
+                             unsigned char *keystream) {
+  int i, n;
+  size_t len;
+  evbuffer_ptr ptr;
+  evbuffer_iovec v[16];
+
+  evbuffer_ptr_set(buf, &ptr, 0, EVBUFFER_PTR_SET);
+  while (data_len > 0) {
+    n = evbuffer_peek(buf, data_len, &ptr, v, 16);
+    if (n > 16) n = 16;
+    for (i = 0, len = 0; i < n && len < data_len; ++i) {
+      if (v[i].iov_len > data_len - len) v[i].iov_len = data_len - len;
+      XorStream<Cipher>((unsigned char *)v[i].iov_base, v[i].iov_len, iv,
+                        bytes, keystream);
+      len += v[i].iov_len;
+    }
+    data_len -= len;
+    if (data_len > 0) {
+      evbuffer_ptr_set(buf, &ptr, len, EVBUFFER_PTR_ADD);
+    }
   }
-  return help_buffer_.data();
 }
 
-int StreamCrypto::Encrypt(evbuffer *buf, evbuffer *&out) {
-  size_t counter = en_bytes_ / SODIUM_BLOCK_SIZE;
-  size_t padding = en_bytes_ % SODIUM_BLOCK_SIZE;
-  size_t data_len = evbuffer_get_length(buf);
-  size_t code_pos = 0, drain_len = padding;
-
-  if (!en_init_) {
-    if (padding > cipher_stream_key_.iv_size) {
-      drain_len = padding - cipher_stream_key_.iv_size;
-    } else {
-      drain_len = 0;
-      code_pos = cipher_stream_key_.iv_size - padding;
+// XOR in place. The unused tail of the last keystream block is kept in
+// `keystream` and consumed first by the next call, whole blocks go straight
+// through the cipher.
+template <class Cipher>
+void StreamCrypto::XorStream(unsigned char *data, size_t data_len,
+                             const unsigned char *iv, size_t &bytes,
+                             unsigned char *keystream) {
+  size_t i, used = bytes % SODIUM_BLOCK_SIZE;
+  if (used > 0) {
+    size_t len = SODIUM_BLOCK_SIZE - used;
+    if (len > data_len) len = data_len;
+    for (i = 0; i < len; ++i) {
+      data[i] ^= keystream[used + i];
     }
-    randombytes_buf(cipher_stream_key_.encode_iv, cipher_stream_key_.iv_size);
+    data += len;
+    data_len -= len;
+    bytes += len;
   }
 
-  size_t code_len = padding + data_len;
-  unsigned char *code = evbuffer_pullup(buf, data_len);
-  if (padding) {
-    unsigned char *cache = GetHelperBuffer(code_len);
-    memset(cache, 0, padding);
-    memcpy(cache + padding, code, data_len);
-    code = cache;
+  size_t whole_len = data_len - data_len % SODIUM_BLOCK_SIZE;
+  if (whole_len > 0) {
+    Cipher::Xor(data, data, whole_len, iv, bytes / SODIUM_BLOCK_SIZE,
+                cipher_stream_key_.key);
+    data += whole_len;
+    data_len -= whole_len;
+    bytes += whole_len;
   }
 
-  evbuffer_iovec v;
-  out = evbuffer_new();
-  evbuffer_reserve_space(out, code_pos + code_len, &v, 1);
-
-  crypto_stream_xor_ic(cipher_, (unsigned char *)v.iov_base + code_pos, code,
-                       code_len, cipher_stream_key_.encode_iv, counter,
-                       cipher_stream_key_.key);
-  en_bytes_ += data_len;
+  if (data_len > 0) {
+    memset(keystream, 0, SODIUM_BLOCK_SIZE);
+    Cipher::Xor(keystream, keystream, SODIUM_BLOCK_SIZE, iv,
+                bytes / SODIUM_BLOCK_SIZE, cipher_stream_key_.key);
+    for (i = 0; i < data_len; ++i) {
+      data[i] ^= keystream[i];
+    }
+    bytes += data_len;
+  }
+}
 
+// The data is XORed in place in `in`, then its chains move over to `out`.
+template <class Cipher>
+int StreamCrypto::Encrypt(evbuffer *in, size_t len, evbuffer *out) {
   if (!en_init_) {
     en_init_ = true;
-    memcpy((unsigned char *)v.iov_base + drain_len,
-           cipher_stream_key_.encode_iv, cipher_stream_key_.iv_size);
+    randombytes_buf(cipher_stream_key_.encode_iv, Cipher::IV_SIZE);
+    evbuffer_add(out, cipher_stream_key_.encode_iv, Cipher::IV_SIZE);
   }
 
-  v.iov_len = code_pos + code_len;
-  evbuffer_commit_space(out, &v, 1);
-  if (drain_len > 0) {
-    evbuffer_drain(out, drain_len);
-  }
-
-  evbuffer_free(buf);
+  XorStream<Cipher>(in, len, cipher_stream_key_.encode_iv, en_bytes_,
+                    cipher_stream_key_.encode_keystream);
+  evbuffer_remove_buffer(in, out, len);
   return CRYPTO_OK;
 }
 
-int StreamCrypto::Decrypt(evbuffer *buf, evbuffer *&out) {
-  size_t counter = de_bytes_ / SODIUM_BLOCK_SIZE;
-  size_t padding = de_bytes_ % SODIUM_BLOCK_SIZE;
-  size_t data_len = evbuffer_get_length(buf);
-
-  unsigned char *code = evbuffer_pullup(buf, data_len);
+template <class Cipher>
+int StreamCrypto::Decrypt(evbuffer *in, evbuffer *out) {
   if (!de_init_) {
-    if (data_len < cipher_stream_key_.iv_size) {
-      evbuffer_free(buf);
-      out = nullptr;
-      return CRYPTO_ERROR;
+    if (evbuffer_get_length(in) < Cipher::IV_SIZE) {
+      return CRYPTO_NEED_NORE;
     }
 
     de_init_ = true;
-    memcpy(cipher_stream_key_.decode_iv, code, cipher_stream_key_.iv_size);
-    code += cipher_stream_key_.iv_size;
-    data_len -= cipher_stream_key_.iv_size;
+    evbuffer_remove(in, cipher_stream_key_.decode_iv, Cipher::IV_SIZE);
   }
 
-  size_t code_len = padding + data_len;
-  if (padding) {
-    unsigned char *cache = GetHelperBuffer(code_len);
-    memset(cache, 0, padding);
-    memcpy(cache + padding, code, data_len);
-    code = cache;
+  size_t len = evbuffer_get_length(in);
+  if (len == 0) {
+    return CRYPTO_NEED_NORE;
   }
 
-  evbuffer_iovec v;
-  out = evbuffer_new();
-  evbuffer_reserve_space(out, code_len, &v, 1);
-
-  crypto_stream_xor_ic(cipher_, (unsigned char *)v.iov_base, code, code_len,
-                       cipher_stream_key_.decode_iv, counter,
-                       cipher_stream_key_.key);
-  de_bytes_ += data_len;
-
-  v.iov_len = code_len;
-  evbuffer_commit_space(out, &v, 1);
-  if (padding > 0) {
-    evbuffer_drain(out, padding);
-  }
-
-  evbuffer_free(buf);
+  XorStream<Cipher>(in, len, cipher_stream_key_.decode_iv, de_bytes_,
+                    cipher_stream_key_.decode_keystream);
+  evbuffer_add_buffer(out, in);
   return CRYPTO_OK;
 }
+
+template int StreamCrypto::Encrypt<CipherChacha20>(evbuffer *in, size_t len,
+                                                   evbuffer *out);
+template int StreamCrypto::Decrypt<CipherChacha20>(evbuffer *in,
+                                                   evbuffer *out);
+template int StreamCrypto::Encrypt<CipherChacha20Ietf>(evbuffer *in,
+                                                       size_t len,
+                                                       evbuffer *out);
+template int StreamCrypto::Decrypt<CipherChacha20Ietf>(evbuffer *in,
+                                                       evbuffer *out);
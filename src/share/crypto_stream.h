@@ -1,34 +1,39 @@
 #pragma once
 
-#include "crypto.h"
+#include "crypto_cipher.h"
 
-class StreamCrypto : Crypto {
-  friend class CryptoCreator;
+class StreamCrypto {
+  friend class Crypto;
 
   struct CipherStreamKey {
-    unsigned int key_size;
-    unsigned int iv_size;
-    unsigned char key[CIPHER_MAX_KEY_SIZE];
+    const unsigned char *key;
     unsigned char encode_iv[CIPHER_MAX_IV_SIZE];
     unsigned char decode_iv[CIPHER_MAX_IV_SIZE];
+    unsigned char encode_keystream[SODIUM_BLOCK_SIZE];
+    unsigned char decode_keystream[SODIUM_BLOCK_SIZE];
   };
 
  protected:
-  StreamCrypto(unsigned int cipher, CipherKey *cipher_key);
+  StreamCrypto(const CipherKey *cipher_key);
   ~StreamCrypto();
 
  public:
-  int Encrypt(evbuffer *buf, evbuffer *&out);
-  int Decrypt(evbuffer *buf, evbuffer *&out);
+  template <class Cipher>
+  int Encrypt(evbuffer *in, size_t len, evbuffer *out);
+  template <class Cipher>
+  int Decrypt(evbuffer *in, evbuffer *out);
 
  private:
-  static unsigned char *GetHelperBuffer(size_t size);
+  template <class Cipher>
+  void XorStream(evbuffer *buf, size_t data_len, const unsigned char *iv,
+                 size_t &bytes, unsigned char *keystream);
+  template <class Cipher>
+  void XorStream(unsigned char *data, size_t data_len, const unsigned char *iv,
+                 size_t &bytes, unsigned char *keystream);
 
   bool en_init_ = false;
   bool de_init_ = false;
   size_t en_bytes_ = 0;
   size_t de_bytes_ = 0;
-  unsigned int cipher_ = 0;
   CipherStreamKey cipher_stream_key_;
-  static std::vector<unsigned char> help_buffer_;
 };
@@ -0,0 +1,259 @@
+#include "crypto_worker.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+// Smaller buffers are cheaper to seal inline than to hand over.
+#define CRYPTO_JOB_MIN_SIZE (4 * CHUNK_SIZE_SPLIT)
+#define CRYPTO_JOB_MIN_CHUNKS 2
+// Sources read this much per callback so a bulk flow fills a job.
+#define CRYPTO_JOB_READ_SIZE (256 * 1024)
+// Input waiting behind a running job before the session stops reading.
+#define CRYPTO_DEFERRED_MAX (4 * 1024 * 1024)
+
+struct CryptoTask {
+  CryptoJob *job;
+  size_t first;
+  size_t last;
+};
+
+// Per reactor thread, workers push finished jobs and the first push onto an
+// empty list wakes the reactor through a socket pair.
+struct CryptoCompletion {
+  std::atomic<CryptoJob *> head{nullptr};
+  evutil_socket_t fds[2];
+  event *notify = nullptr;
+};
+
+// Never freed, detached workers still wait on it while exit() runs.
+struct CryptoQueue {
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<CryptoTask> tasks;
+};
+
+static unsigned int worker_count = 0;
+static CryptoQueue *worker_queue = nullptr;
+
+static thread_local CryptoCompletion *worker_completion = nullptr;
+
+static void completion_push(CryptoJob *job) {
+  CryptoCompletion *completion = job->completion;
+  CryptoJob *head = completion->head.load(std::memory_order_relaxed);
+  do {
+    job->next = head;
+  } while (!completion->head.compare_exchange_weak(
+      head, job, std::memory_order_release, std::memory_order_relaxed));
+
+  if (!head) {
+    char signal = 0;
+    send(completion->fds[1], &signal, 1, 0);
+  }
+}
+
+static void OnCompletion(evutil_socket_t sock, short what, void *ctx) {
+  CryptoCompletion *completion = (CryptoCompletion *)ctx;
+
+  char drain[64];
+  while (recv(sock, drain, sizeof(drain), 0) > 0) {
+  }
+
+  CryptoJob *list =
+      completion->head.exchange(nullptr, std::memory_order_acquire);
+  CryptoJob *ordered = nullptr, *job;
+  while (list) {
+    job = list;
+    list = job->next;
+    job->next = ordered;
+    ordered = job;
+  }
+
+  while (ordered) {
+    job = ordered;
+    ordered = job->next;
+    if (job->owner) {
+      job->owner->HandleDone(job);
+    } else {
+      delete job;
+    }
+  }
+}
+
+static CryptoCompletion *completion_get(event_base *base) {
+  if (worker_completion) {
+    return worker_completion;
+  }
+
+  CryptoCompletion *completion = new CryptoCompletion();
+#ifdef SYS_WINDOWS
+  int family = AF_INET;
+#else
+  int family = AF_UNIX;
+#endif
+  if (evutil_socketpair(family, SOCK_STREAM, 0, completion->fds) < 0) {
+    quit("incredible: evutil_socketpair error");
+  }
+  evutil_make_socket_nonblocking(completion->fds[0]);
+  evutil_make_socket_nonblocking(completion->fds[1]);
+
+  completion->notify = event_new(base, completion->fds[0],
+                                 EV_READ | EV_PERSIST, OnCompletion,
+                                 completion);
+  event_add(completion->notify, NULL);
+
+  worker_completion = completion;
+  return completion;
+}
+
+static void worker_loop(CryptoQueue *queue) {
+  CryptoTask task;
+  while (1) {
+    {
+      std::unique_lock<std::mutex> guard(queue->lock);
+      queue->cond.wait(guard, [queue] { return !queue->tasks.empty(); });
+      task = queue->tasks.front();
+      queue->tasks.pop_front();
+    }
+
+    task.job->run(task.job, task.first, task.last);
+    if (task.job->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      completion_push(task.job);
+    }
+  }
+}
+
+// Splits the chunks evenly, one contiguous range per worker.
+static void worker_submit(CryptoJob *job) {
+  size_t chunk_count = job->chunks.size();
+  size_t task_count = chunk_count < worker_count ? chunk_count : worker_count;
+  job->pending = task_count;
+
+  {
+    std::lock_guard<std::mutex> guard(worker_queue->lock);
+    size_t first = 0, last;
+    for (size_t i = 0; i < task_count; ++i) {
+      last = chunk_count * (i + 1) / task_count;
+      worker_queue->tasks.push_back({job, first, last});
+      first = last;
+    }
+  }
+  worker_queue->cond.notify_all();
+}
+
+bool crypto_workers_init(unsigned int threads, std::string &error) {
+  if (threads > 0) {
+    worker_queue = new CryptoQueue();
+  }
+
+  for (unsigned int i = 0; i < threads; ++i) {
+    try {
+      std::thread(worker_loop, worker_queue).detach();
+    } catch (const std::system_error &e) {
+      error = std::string("bad crypto worker: ") + e.what();
+      return false;
+    }
+    ++worker_count;
+  }
+  return true;
+}
+
+bool crypto_workers_enabled() { return worker_count > 0; }
+
+CryptoLane::CryptoLane(Crypto *crypto, event_base *base, Callback cb,
+                       void *ctx)
+    : crypto_(crypto), base_(base), cb_(cb), ctx_(ctx) {}
+
+// A job still running outlives the session, it is dropped on completion.
+CryptoLane::~CryptoLane() {
+  if (job_) {
+    job_->owner = nullptr;
+  }
+}
+
+bool CryptoLane::Inline(size_t len) const {
+  return !worker_count || !crypto_->Parallel() || len < CRYPTO_JOB_MIN_SIZE;
+}
+
+int CryptoLane::Encrypt(evbuffer *in, size_t len, evbuffer *out) {
+  if (job_) {
+    return CRYPTO_NEED_NORE;
+  }
+  if (Inline(len)) {
+    return crypto_->Encrypt(in, len, out);
+  }
+
+  CryptoJob *job = new CryptoJob();
+  return Submit(job, crypto_->EncryptJob(in, len, job), out);
+}
+
+int CryptoLane::Decrypt(evbuffer *in, evbuffer *out) {
+  if (job_) {
+    return CRYPTO_NEED_NORE;
+  }
+  if (Inline(evbuffer_get_length(in))) {
+    return crypto_->Decrypt(in, out);
+  }
+
+  CryptoJob *job = new CryptoJob();
+  return Submit(job, crypto_->DecryptJob(in, job), out);
+}
+
+// Jobs of a single chunk are not worth a hand-over and finish right here.
+int CryptoLane::Submit(CryptoJob *job, int ret, evbuffer *out) {
+  if (ret != CRYPTO_OK) {
+    delete job;
+    return ret;
+  }
+
+  if (job->chunks.size() < CRYPTO_JOB_MIN_CHUNKS) {
+    job->run(job, 0, job->chunks.size());
+    job->reserved.iov_len = job->output_len;
+    evbuffer_commit_space(job->output, &job->reserved, 1);
+    ret = job->failed ? CRYPTO_ERROR : CRYPTO_OK;
+    if (ret == CRYPTO_OK) {
+      evbuffer_add_buffer(out, job->output);
+    }
+    delete job;
+    return ret;
+  }
+
+  job->owner = this;
+  job->completion = completion_get(base_);
+  job_ = job;
+  worker_submit(job);
+  return CRYPTO_NEED_NORE;
+}
+
+void CryptoLane::SetSource(bufferevent *source) {
+  source_ = source;
+  if (worker_count && crypto_->Parallel() &&
+      bufferevent_get_max_single_read(source) < CRYPTO_JOB_READ_SIZE) {
+    bufferevent_set_max_single_read(source, CRYPTO_JOB_READ_SIZE);
+  }
+}
+
+bool CryptoLane::full() const {
+  return job_ && source_ &&
+         evbuffer_get_length(bufferevent_get_input(source_)) >=
+             CRYPTO_DEFERRED_MAX;
+}
+
+// The callback owns the output, the session may be gone once it returns.
+void CryptoLane::HandleDone(CryptoJob *job) {
+  job->reserved.iov_len = job->output_len;
+  evbuffer_commit_space(job->output, &job->reserved, 1);
+
+  int ret = job->failed ? CRYPTO_ERROR : CRYPTO_OK;
+  evbuffer *out = nullptr;
+  if (ret == CRYPTO_OK) {
+    out = job->output;
+    job->output = nullptr;
+  }
+  job_ = nullptr;
+  delete job;
+
+  cb_(ctx_, ret, out);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "crypto.h"
+
+// Optional pool of threads sealing and opening the chunks of large AEAD
+// buffers in parallel, so one bulk session neither caps at one core nor
+// stalls the other sessions of its reactor. Finished jobs are handed back to
+// the reactor thread that planned them through a lock-free list.
+
+// Starts `threads` workers, 0 leaves every call inline.
+bool crypto_workers_init(unsigned int threads, std::string &error);
+bool crypto_workers_enabled();
+
+// One direction of a session's Crypto. Buffers below a few chunks, stream
+// ciphers and everything without a pool run inline; larger ones become a
+// job, and whatever arrives while it runs waits in the source's input so the
+// output keeps its order.
+class CryptoLane {
+ public:
+  typedef void (*Callback)(void *ctx, int result, evbuffer *out);
+
+  CryptoLane(Crypto *crypto, event_base *base, Callback cb, void *ctx);
+  ~CryptoLane();
+
+  CryptoLane(const CryptoLane &) = delete;
+  CryptoLane &operator=(const CryptoLane &) = delete;
+
+  // Same contracts as Crypto::Encrypt/Decrypt. When the data goes to the
+  // pool, or a job is still running and `in` is left alone, they return
+  // CRYPTO_NEED_NORE. The job's output arrives later through the callback,
+  // which may be the last thing the session sees; the session then calls
+  // again for what waited in `in`.
+  int Encrypt(evbuffer *in, size_t len, evbuffer *out);
+  int Decrypt(evbuffer *in, evbuffer *out);
+
+  // The bufferevent whose input this lane consumes. With a pool it reads
+  // enough per callback to fill a job.
+  void SetSource(bufferevent *source);
+
+  bool busy() const { return job_ != nullptr; }
+  bool full() const;
+
+  void HandleDone(CryptoJob *job);
+
+ private:
+  bool Inline(size_t len) const;
+  int Submit(CryptoJob *job, int ret, evbuffer *out);
+
+  Crypto *crypto_;
+  event_base *base_;
+  Callback cb_;
+  void *ctx_;
+  bufferevent *source_ = nullptr;
+  CryptoJob *job_ = nullptr;
+};
@@ -0,0 +1,422 @@
+#include "dns_cache.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "util.h"
+
+#define DNS_HOSTS_FILE "/etc/hosts"
+// Seconds an answer is kept whatever its TTL says, and a name that does not
+// exist.
+#define DNS_MIN_TTL 1
+#define DNS_MAX_TTL 3600
+#define DNS_NEGATIVE_TTL 5
+// An entry hit that often is looked up again once this much of its TTL is
+// left.
+#define DNS_PREFETCH_HITS 2
+#define DNS_PREFETCH_PERCENT 10
+// Milliseconds the AAAA answer is waited for once the A answer is in.
+#define DNS_RESOLUTION_DELAY 50
+
+typedef std::chrono::steady_clock DnsClock;
+
+struct DnsEntry {
+  DnsAnswerPtr answer;
+  // Its place in dns_lru.
+  std::list<const std::string *>::iterator used;
+  DnsClock::time_point expires;
+  DnsClock::time_point prefetch;
+  unsigned int hits = 0;
+  bool refreshing = false;
+};
+
+struct DnsWaiter {
+  DnsResolvedFn resolved;
+  void *ctx;
+};
+
+// A and AAAA of one name in flight on a reactor, with the sessions waiting
+// for it. A prefetch has none. Once the waiters had the partial answer,
+// `early` holds it for later ones and `followers` wait for the rest.
+struct DnsQuery {
+  std::string name;
+  std::vector<DnsWaiter> waiters;
+  std::vector<DnsWaiter> followers;
+  DnsAnswer answer;
+  DnsAnswerPtr early;
+  event_base *base;
+  event *delay = nullptr;
+  unsigned int pending = 0;
+  int ttl = DNS_MAX_TTL;
+  int failure = DNS_ERR_NONE;
+};
+
+static std::mutex dns_lock;
+static std::unordered_map<std::string, DnsEntry> dns_entries;
+// The names of dns_entries, most recently used first.
+static std::list<const std::string *> dns_lru;
+static size_t dns_capacity = 0;
+static std::unordered_map<std::string, DnsAnswerPtr> dns_hosts;
+static thread_local std::unordered_map<std::string, DnsQuery *> dns_pending;
+
+static std::atomic<size_t> dns_hits{0};
+static std::atomic<size_t> dns_negative_hits{0};
+static std::atomic<size_t> dns_misses{0};
+static std::atomic<size_t> dns_coalesced{0};
+static std::atomic<size_t> dns_early{0};
+static std::atomic<size_t> dns_prefetches{0};
+static std::atomic<size_t> dns_failures{0};
+
+static std::string dns_key(const char *name) {
+  std::string key(name);
+  for (char &c : key) {
+    c = tolower((unsigned char)c);
+  }
+  return key;
+}
+
+static bool dns_parse_addr(const char *text, DnsAnswer &answer) {
+  in_addr addr4;
+  in6_addr addr6;
+  if (evutil_inet_pton(AF_INET, text, &addr4) == 1) {
+    answer.ipv4.push_back(addr4);
+  } else if (evutil_inet_pton(AF_INET6, text, &addr6) == 1) {
+    answer.ipv6.push_back(addr6);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// evdns only looks at the hosts file from evdns_getaddrinfo, which does not
+// tell the TTL, so its names are read here once.
+static void dns_load_hosts() {
+  FILE *fp = fopen(DNS_HOSTS_FILE, "r");
+  if (!fp) return;
+
+  std::unordered_map<std::string, DnsAnswer> hosts;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    char *save = nullptr;
+    char *addr = strtok_r(line, " \t\r\n", &save);
+    DnsAnswer parsed;
+    if (!addr || !dns_parse_addr(addr, parsed)) continue;
+
+    char *name;
+    while ((name = strtok_r(nullptr, " \t\r\n", &save))) {
+      std::string key = dns_key(name);
+      DnsAnswer &answer = hosts[key];
+      answer.name = key;
+      answer.ipv4.insert(answer.ipv4.end(), parsed.ipv4.begin(),
+                         parsed.ipv4.end());
+      answer.ipv6.insert(answer.ipv6.end(), parsed.ipv6.begin(),
+                         parsed.ipv6.end());
+    }
+  }
+  fclose(fp);
+
+  for (auto &host : hosts) {
+    dns_hosts[host.first] = std::make_shared<DnsAnswer>(host.second);
+  }
+}
+
+void dns_cache_init(size_t entries) {
+  dns_capacity = entries;
+  dns_entries.reserve(entries);
+  dns_load_hosts();
+}
+
+// Makes room under the lock: the least recently used name goes, expired
+// ones sink there too. One being prefetched is stored again when its
+// answer comes.
+static void dns_evict() {
+  auto it = dns_entries.find(*dns_lru.back());
+  dns_lru.pop_back();
+  dns_entries.erase(it);
+}
+
+// A failed lookup keeps what is cached until it expires, only a prefetch
+// may try again.
+static void dns_store(const std::string &name, const DnsAnswerPtr &answer,
+                      int ttl) {
+  DnsClock::time_point now = DnsClock::now();
+  std::lock_guard<std::mutex> guard(dns_lock);
+  auto it = dns_entries.find(name);
+  if (!answer) {
+    if (it != dns_entries.end()) {
+      it->second.refreshing = false;
+    }
+    return;
+  }
+
+  if (it == dns_entries.end()) {
+    if (dns_entries.size() >= dns_capacity) {
+      dns_evict();
+    }
+    it = dns_entries.emplace(name, DnsEntry()).first;
+    dns_lru.push_front(&it->first);
+    it->second.used = dns_lru.begin();
+  }
+  DnsEntry &entry = it->second;
+  entry.answer = answer;
+  entry.expires = now + std::chrono::seconds(ttl);
+  entry.prefetch = entry.expires - std::chrono::milliseconds(
+                                       ttl * 10 * DNS_PREFETCH_PERCENT);
+  entry.hits = 0;
+  entry.refreshing = false;
+}
+
+// The cached answer, with `prefetch` set when this hit is the one that
+// should look the name up again.
+static DnsAnswerPtr dns_find(const std::string &name, bool &prefetch) {
+  DnsClock::time_point now = DnsClock::now();
+  std::lock_guard<std::mutex> guard(dns_lock);
+  auto it = dns_entries.find(name);
+  if (it == dns_entries.end() || it->second.expires <= now) {
+    return nullptr;
+  }
+
+  DnsEntry &entry = it->second;
+  dns_lru.splice(dns_lru.begin(), dns_lru, entry.used);
+  entry.hits += 1;
+  if (entry.answer->error == DNS_ERR_NONE && !entry.refreshing &&
+      entry.hits >= DNS_PREFETCH_HITS && now >= entry.prefetch) {
+    entry.refreshing = true;
+    prefetch = true;
+  }
+  return entry.answer;
+}
+
+// Stores the answer first, a session woken here that asks for the name
+// again finds it. The query stays listed until every waiter ran, so
+// dns_cancel still reaches the ones after a waiter that closes sessions.
+static void dns_complete(DnsQuery *query) {
+  DnsAnswer &answer = query->answer;
+  int ttl = DNS_NEGATIVE_TTL;
+  if (!answer.ipv4.empty() || !answer.ipv6.empty()) {
+    answer.error = DNS_ERR_NONE;
+    ttl = std::min(std::max(query->ttl, DNS_MIN_TTL), DNS_MAX_TTL);
+  } else if (query->failure != DNS_ERR_NONE) {
+    answer.error = query->failure;
+    ttl = 0;
+  } else {
+    answer.error = DNS_ERR_NOTEXIST;
+  }
+
+  DnsAnswerPtr result = std::make_shared<DnsAnswer>(std::move(answer));
+  if (ttl) {
+    dns_store(query->name, result, ttl);
+  } else {
+    dns_failures += 1;
+    dns_store(query->name, nullptr, 0);
+  }
+
+  if (query->delay) {
+    event_free(query->delay);
+  }
+  std::vector<DnsWaiter> *lists[] = {&query->waiters, &query->followers};
+  for (std::vector<DnsWaiter> *waiters : lists) {
+    while (!waiters->empty()) {
+      DnsWaiter waiter = waiters->back();
+      waiters->pop_back();
+      waiter.resolved(waiter.ctx, *result);
+    }
+  }
+  dns_pending.erase(query->name);
+  delete query;
+}
+
+// The waiters go ahead with the family that answered, nothing is stored.
+static void dns_answer_early(DnsQuery *query) {
+  DnsAnswer partial = query->answer;
+  partial.error = DNS_ERR_NONE;
+  partial.partial = true;
+  query->early = std::make_shared<DnsAnswer>(std::move(partial));
+  dns_early += 1;
+
+  DnsAnswerPtr early = query->early;
+  while (!query->waiters.empty()) {
+    DnsWaiter waiter = query->waiters.back();
+    query->waiters.pop_back();
+    waiter.resolved(waiter.ctx, *early);
+  }
+}
+
+static void OnDnsDelay(evutil_socket_t sock, short what, void *arg) {
+  dns_answer_early((DnsQuery *)arg);
+}
+
+// No such name or no address of this family both leave the other family to
+// answer, anything else fails the lookup unless the other one has addresses.
+// Addresses from AAAA start the waiters at once, from A after the
+// resolution delay.
+static void OnDnsAnswer(int result, char type, int count, int ttl,
+                        void *addresses, void *arg) {
+  DnsQuery *query = (DnsQuery *)arg;
+  if (result == DNS_ERR_NONE && count > 0) {
+    if (type == DNS_IPv4_A) {
+      in_addr *addrs = (in_addr *)addresses;
+      query->answer.ipv4.insert(query->answer.ipv4.end(), addrs,
+                                addrs + count);
+    } else if (type == DNS_IPv6_AAAA) {
+      in6_addr *addrs = (in6_addr *)addresses;
+      query->answer.ipv6.insert(query->answer.ipv6.end(), addrs,
+                                addrs + count);
+    }
+    query->ttl = std::min(query->ttl, ttl);
+  } else if (result != DNS_ERR_NONE && result != DNS_ERR_NOTEXIST &&
+             result != DNS_ERR_NODATA) {
+    query->failure = result;
+  }
+
+  if (--query->pending == 0) {
+    dns_complete(query);
+    return;
+  }
+  if (query->early || query->waiters.empty()) return;
+
+  if (!query->answer.ipv6.empty()) {
+    dns_answer_early(query);
+  } else if (!query->answer.ipv4.empty()) {
+    static const timeval delay = {0, DNS_RESOLUTION_DELAY * 1000};
+    query->delay = evtimer_new(query->base, OnDnsDelay, query);
+    if (!query->delay) {
+      quit("incredible: evtimer_new error");
+    }
+    evtimer_add(query->delay, &delay);
+  }
+}
+
+// Both families go out together. Null when evdns took neither.
+static DnsQuery *dns_query(event_base *base, evdns_base *dnsbase,
+                           const std::string &name) {
+  DnsQuery *query = new DnsQuery();
+  query->name = name;
+  query->base = base;
+  query->answer.name = name;
+  query->pending = 2;
+  if (!evdns_base_resolve_ipv4(dnsbase, name.c_str(), 0, OnDnsAnswer,
+                               query)) {
+    query->pending -= 1;
+  }
+  if (!evdns_base_resolve_ipv6(dnsbase, name.c_str(), 0, OnDnsAnswer,
+                               query)) {
+    query->pending -= 1;
+  }
+  if (query->pending == 0) {
+    delete query;
+    return nullptr;
+  }
+
+  dns_pending[name] = query;
+  return query;
+}
+
+DnsAnswerPtr dns_resolve(event_base *base, evdns_base *dnsbase,
+                         const char *name, DnsResolvedFn resolved, void *ctx) {
+  DnsAnswer literal;
+  if (dns_parse_addr(name, literal)) {
+    literal.name = name;
+    return std::make_shared<DnsAnswer>(std::move(literal));
+  }
+
+  std::string key = dns_key(name);
+  auto host = dns_hosts.find(key);
+  if (host != dns_hosts.end()) {
+    return host->second;
+  }
+
+  bool prefetch = false;
+  DnsAnswerPtr answer = dns_find(key, prefetch);
+  if (answer) {
+    if (answer->error == DNS_ERR_NONE) {
+      dns_hits += 1;
+    } else {
+      dns_negative_hits += 1;
+    }
+    if (prefetch) {
+      if (dns_pending.count(key) || !dns_query(base, dnsbase, key)) {
+        dns_store(key, nullptr, 0);
+      } else {
+        dns_prefetches += 1;
+      }
+    }
+    return answer;
+  }
+
+  auto it = dns_pending.find(key);
+  DnsQuery *query;
+  if (it != dns_pending.end()) {
+    query = it->second;
+    dns_coalesced += 1;
+    if (query->early) {
+      return query->early;
+    }
+  } else {
+    query = dns_query(base, dnsbase, key);
+    if (!query) {
+      dns_failures += 1;
+      DnsAnswer failed;
+      failed.name = key;
+      failed.error = DNS_ERR_UNKNOWN;
+      return std::make_shared<DnsAnswer>(std::move(failed));
+    }
+    dns_misses += 1;
+  }
+  query->waiters.push_back({resolved, ctx});
+  return nullptr;
+}
+
+bool dns_follow(const DnsAnswer &answer, DnsResolvedFn resolved,
+                void *ctx) {
+  auto it = dns_pending.find(answer.name);
+  if (it == dns_pending.end()) return false;
+  it->second->followers.push_back({resolved, ctx});
+  return true;
+}
+
+void dns_cancel(void *ctx) {
+  for (auto &pending : dns_pending) {
+    std::vector<DnsWaiter> *lists[] = {&pending.second->waiters,
+                                       &pending.second->followers};
+    for (std::vector<DnsWaiter> *waiters : lists) {
+      for (size_t i = 0; i < waiters->size(); ++i) {
+        if ((*waiters)[i].ctx == ctx) {
+          (*waiters)[i] = waiters->back();
+          waiters->pop_back();
+          return;
+        }
+      }
+    }
+  }
+}
+
+void dns_dump(FILE *fp) {
+  if (!dns_capacity) return;
+
+  size_t entries;
+  {
+    std::lock_guard<std::mutex> guard(dns_lock);
+    entries = dns_entries.size();
+  }
+  fprintf(fp,
+          "dns: %zu entries, hits: %zu, negative hits: %zu, misses: %zu, "
+          "coalesced: %zu, answered early: %zu, prefetches: %zu, failures: "
+          "%zu\n",
+          entries, (size_t)dns_hits, (size_t)dns_negative_hits,
+          (size_t)dns_misses, (size_t)dns_coalesced, (size_t)dns_early,
+          (size_t)dns_prefetches, (size_t)dns_failures);
+}
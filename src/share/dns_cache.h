@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "network.h"
+
+// Resolver cache for target hostnames in front of evdns, shared by every
+// reactor. Answers are kept for their TTL, a name that does not exist for a
+// few seconds. A lookup of a name already in flight on the same reactor
+// waits for that one instead of asking again, and a name still asked for
+// near the end of its TTL is looked up again before it expires, so its users
+// never wait. Address literals and hosts file names need no lookup.
+//
+// A and AAAA go out together. Connects start on the AAAA answer, or a
+// short resolution delay after the A answer (RFC 8305 section 3), with the
+// addresses so far; a race on them follows the lookup for the rest.
+
+struct DnsAnswer {
+  // Lower case, as looked up.
+  std::string name;
+  // DNS_ERR_NONE with at least one address, otherwise why there is none.
+  int error = DNS_ERR_NONE;
+  std::vector<in_addr> ipv4;
+  std::vector<in6_addr> ipv6;
+  // The other family has not answered yet, see dns_follow().
+  bool partial = false;
+};
+
+typedef std::shared_ptr<const DnsAnswer> DnsAnswerPtr;
+
+// Runs on the reactor thread that asked.
+typedef void (*DnsResolvedFn)(void *ctx, const DnsAnswer &answer);
+
+// Keeps up to `entries` names and reads the hosts file. Called once at
+// startup, before any reactor runs.
+void dns_cache_init(size_t entries);
+
+// On the reactor thread running `base`. Returns the answer for `name` when
+// it is known, otherwise null, and `resolved` gets it later unless `ctx`
+// cancels first.
+DnsAnswerPtr dns_resolve(event_base *base, evdns_base *dnsbase,
+                         const char *name, DnsResolvedFn resolved, void *ctx);
+// With a partial `answer`, `resolved` gets the complete one once the
+// lookup ends, unless `ctx` cancels first. False when it already ended.
+bool dns_follow(const DnsAnswer &answer, DnsResolvedFn resolved, void *ctx);
+void dns_cancel(void *ctx);
+
+void dns_dump(FILE *fp);
@@ -0,0 +1,112 @@
+#include "fast_open.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+#ifndef SYS_WINDOWS
+#include <netinet/tcp.h>
+#endif
+
+// Pending fast-open connections a listener keeps before cookies are
+// validated.
+#define FAST_OPEN_QUEUE 256
+// First back-off after a failure, doubled per failure in a row.
+#define FAST_OPEN_BACKOFF_MIN 60
+#define FAST_OPEN_BACKOFF_MAX 3600
+// Past this many destinations the failure table starts over.
+#define FAST_OPEN_TABLE_MAX 16384
+
+struct FastOpenFailure {
+  unsigned int count;
+  std::chrono::steady_clock::time_point until;
+};
+
+static std::mutex fast_open_lock;
+static std::unordered_map<uint64_t, FastOpenFailure> fast_open_failures;
+
+static uint64_t fast_open_key(const sockaddr *addr) {
+  uint64_t words[2] = {0, 0};
+  uint16_t port;
+  if (addr->sa_family == AF_INET) {
+    const sockaddr_in *sin = (const sockaddr_in *)addr;
+    memcpy(words, &sin->sin_addr, sizeof(sin->sin_addr));
+    port = sin->sin_port;
+  } else {
+    const sockaddr_in6 *sin6 = (const sockaddr_in6 *)addr;
+    memcpy(words, &sin6->sin6_addr, sizeof(words));
+    port = sin6->sin6_port;
+  }
+
+  uint64_t key = (words[0] * 0x9E3779B97F4A7C15ULL) ^ words[1];
+  key = (key ^ port) * 0xBF58476D1CE4E5B9ULL;
+  return key ? key : 1;
+}
+
+static bool fast_open_allowed(uint64_t key) {
+  std::lock_guard<std::mutex> guard(fast_open_lock);
+  auto it = fast_open_failures.find(key);
+  return it == fast_open_failures.end() ||
+         std::chrono::steady_clock::now() >= it->second.until;
+}
+
+void fast_open_listen(evconnlistener *listener) {
+#if defined(TCP_FASTOPEN) && !defined(SYS_WINDOWS)
+  int queue = FAST_OPEN_QUEUE;
+  setsockopt(evconnlistener_get_fd(listener), IPPROTO_TCP, TCP_FASTOPEN,
+             &queue, sizeof(queue));
+#endif
+}
+
+void fast_open_arm(evutil_socket_t sock, const sockaddr *addr, uint64_t &key) {
+  key = 0;
+#if defined(TCP_FASTOPEN_CONNECT) && !defined(SYS_WINDOWS)
+  uint64_t dest = fast_open_key(addr);
+  int on = 1;
+  if (fast_open_allowed(dest) &&
+      setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) ==
+          0) {
+    key = dest;
+  }
+#endif
+}
+
+int fast_open_connect(bufferevent *bev, const sockaddr *addr, int addr_len,
+                      uint64_t &key) {
+  key = 0;
+#if defined(TCP_FASTOPEN_CONNECT) && !defined(SYS_WINDOWS)
+  evutil_socket_t sock = socket(addr->sa_family, SOCK_STREAM, 0);
+  if (sock >= 0) {
+    evutil_make_socket_nonblocking(sock);
+    fast_open_arm(sock, addr, key);
+    bufferevent_setfd(bev, sock);
+  }
+#endif
+  return bufferevent_socket_connect(bev, (sockaddr *)addr, addr_len);
+}
+
+void fast_open_result(uint64_t key, bool ok) {
+  std::lock_guard<std::mutex> guard(fast_open_lock);
+  if (ok) {
+    fast_open_failures.erase(key);
+    return;
+  }
+
+  if (fast_open_failures.size() >= FAST_OPEN_TABLE_MAX) {
+    fast_open_failures.clear();
+  }
+
+  FastOpenFailure &failure = fast_open_failures[key];
+  unsigned int backoff = FAST_OPEN_BACKOFF_MIN;
+  for (unsigned int i = 0; i < failure.count && backoff < FAST_OPEN_BACKOFF_MAX;
+       ++i) {
+    backoff *= 2;
+  }
+  if (backoff > FAST_OPEN_BACKOFF_MAX) backoff = FAST_OPEN_BACKOFF_MAX;
+
+  failure.count += 1;
+  failure.until =
+      std::chrono::steady_clock::now() + std::chrono::seconds(backoff);
+}
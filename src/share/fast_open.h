@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Opt-in TCP Fast Open. Listeners accept data on the SYN, outbound connects
+// defer the SYN to the first write so the initial payload rides on it. A
+// destination whose fast-open connects keep failing before any reply is
+// left alone for a while, doubling each time, and plain connects are used
+// meanwhile. Without kernel support everything falls back to plain TCP.
+
+// Enables fast open on an already bound listener.
+void fast_open_listen(evconnlistener *listener);
+
+// Connects `bev`, which must not have a socket yet, like
+// bufferevent_socket_connect. When the SYN waits for the first write `key`
+// is set to the destination, the caller reports how it went through
+// fast_open_result(); otherwise it is 0.
+int fast_open_connect(bufferevent *bev, const sockaddr *addr, int addr_len,
+                      uint64_t &key);
+
+// Same for a socket created by the caller, before it connects.
+void fast_open_arm(evutil_socket_t sock, const sockaddr *addr, uint64_t &key);
+
+// `ok` when the peer answered, false when the connection failed before.
+void fast_open_result(uint64_t key, bool ok);
@@ -0,0 +1,1002 @@
+#include "io_stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fast_open.h"
+#include "util.h"
+
+static bool uring_enabled = false;
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#define IO_URING_ENTRIES 1024
+// Registered buffer ring the kernel picks receive buffers from, shared by
+// all sockets of a reactor. Data is copied out as soon as it completes.
+#define IO_URING_BUFFERS 128
+#define IO_URING_BUFFER_SIZE 16384
+#define IO_URING_BUFFER_GROUP 0
+// Received data the session has not taken yet before recv pauses.
+#define IO_URING_BACKLOG (256 * 1024)
+// Most chains and bytes handed to one sendmsg.
+#define IO_URING_SEND_IOV 32
+#define IO_URING_SEND_MAX (1024 * 1024)
+
+// Low bits of user_data, the rest points to the stream or listener.
+enum UringOp {
+  OP_RECV = 1,
+  OP_SEND,
+  OP_CONNECT,
+  OP_CANCEL,
+  OP_CLOSE,
+  OP_ACCEPT,
+};
+#define OP_MASK 7
+
+struct UringEngine {
+  event_base *base = nullptr;
+  int ring_fd = -1;
+  int event_fd = -1;
+
+  void *sq_ring = nullptr;
+  void *cq_ring = nullptr;
+  size_t sq_ring_len = 0;
+  size_t cq_ring_len = 0;
+  unsigned int sq_entries = 0;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  io_uring_sqe *sqes = nullptr;
+  io_uring_cqe *cqes;
+
+  io_uring_buf_ring *buf_ring = nullptr;
+  unsigned char *buf_base = nullptr;
+  unsigned short buf_tail = 0;
+
+  // Prepared since the last io_uring_enter.
+  unsigned int sq_pending = 0;
+  bool submit_scheduled = false;
+  event *notify = nullptr;
+  event *submit = nullptr;
+};
+
+// Ring side of a stream. Lives until the session freed its end and every
+// operation it submitted has completed.
+struct UringStream {
+  UringEngine *engine;
+  bufferevent *bev;
+  evutil_socket_t sock = -1;
+  unsigned int ops = 0;
+
+  bool connecting = false;
+  bool connected = false;
+  bool recv_armed = false;
+  bool recv_canceling = false;
+  bool recv_paused = false;
+  bool sending = false;
+  bool eof = false;
+  bool eof_sent = false;
+  bool failed = false;
+  bool detached = false;
+  bool resolving = false;
+  evdns_getaddrinfo_request *resolve = nullptr;
+
+  sockaddr_storage addr;
+  msghdr msg;
+  iovec iov[IO_URING_SEND_IOV];
+};
+
+struct UringListener {
+  UringEngine *engine;
+  evconnlistener *listener;
+  evconnlistener_cb cb;
+  void *ctx;
+  bool armed = false;
+  bool paused = false;
+  bool closed = false;
+};
+
+static std::mutex uring_lock;
+static std::vector<UringEngine *> uring_engines;
+static std::vector<UringListener *> uring_listeners;
+static thread_local UringEngine *uring_engine_cache = nullptr;
+
+static inline uint64_t op_data(void *ptr, unsigned int op) {
+  return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static int uring_setup(unsigned int entries, io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+                       unsigned int min_complete, unsigned int flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg,
+                          unsigned int nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void buffer_recycle(UringEngine *engine, unsigned short bid) {
+  // Entries start at the ring itself, the tail overlays the first one.
+  // Not through `bufs`, which C++ places past a padded empty member.
+  io_uring_buf *buf = (io_uring_buf *)engine->buf_ring +
+                      (engine->buf_tail & (IO_URING_BUFFERS - 1));
+  buf->addr = (uint64_t)(uintptr_t)(engine->buf_base +
+                                    (size_t)bid * IO_URING_BUFFER_SIZE);
+  buf->len = IO_URING_BUFFER_SIZE;
+  buf->bid = bid;
+  ++engine->buf_tail;
+  __atomic_store_n(&engine->buf_ring->tail, engine->buf_tail,
+                   __ATOMIC_RELEASE);
+}
+
+static void engine_teardown(UringEngine *engine) {
+  if (engine->buf_base) {
+    munmap(engine->buf_base, IO_URING_BUFFERS * IO_URING_BUFFER_SIZE);
+  }
+  if (engine->buf_ring) {
+    munmap(engine->buf_ring, IO_URING_BUFFERS * sizeof(io_uring_buf));
+  }
+  if (engine->sqes) {
+    munmap(engine->sqes, engine->sq_entries * sizeof(io_uring_sqe));
+  }
+  if (engine->cq_ring && engine->cq_ring != engine->sq_ring) {
+    munmap(engine->cq_ring, engine->cq_ring_len);
+  }
+  if (engine->sq_ring) {
+    munmap(engine->sq_ring, engine->sq_ring_len);
+  }
+  if (engine->event_fd >= 0) {
+    close(engine->event_fd);
+  }
+  if (engine->ring_fd >= 0) {
+    close(engine->ring_fd);
+  }
+}
+
+static bool engine_setup(UringEngine *engine, std::string &error) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = IO_URING_ENTRIES * 4;
+
+  engine->ring_fd = uring_setup(IO_URING_ENTRIES, &params);
+  if (engine->ring_fd < 0) {
+    error = std::string("bad io_uring: ") + strerror(errno);
+    return false;
+  }
+
+  engine->sq_entries = params.sq_entries;
+  engine->sq_ring_len =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  engine->cq_ring_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    engine->sq_ring_len = engine->cq_ring_len =
+        std::max(engine->sq_ring_len, engine->cq_ring_len);
+  }
+
+  void *ring = mmap(NULL, engine->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, engine->ring_fd,
+                    IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    error = "bad io_uring: mmap sq ring";
+    return false;
+  }
+  engine->sq_ring = ring;
+
+  if (single_mmap) {
+    engine->cq_ring = ring;
+  } else {
+    ring = mmap(NULL, engine->cq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, engine->ring_fd,
+                IORING_OFF_CQ_RING);
+    if (ring == MAP_FAILED) {
+      error = "bad io_uring: mmap cq ring";
+      return false;
+    }
+    engine->cq_ring = ring;
+  }
+
+  void *sqes = mmap(NULL, engine->sq_entries * sizeof(io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    engine->ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    error = "bad io_uring: mmap sqes";
+    return false;
+  }
+  engine->sqes = (io_uring_sqe *)sqes;
+
+  unsigned char *sq = (unsigned char *)engine->sq_ring;
+  unsigned char *cq = (unsigned char *)engine->cq_ring;
+  engine->sq_head = (unsigned int *)(sq + params.sq_off.head);
+  engine->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  engine->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  engine->sq_flags = (unsigned int *)(sq + params.sq_off.flags);
+  engine->sq_array = (unsigned int *)(sq + params.sq_off.array);
+  engine->cq_head = (unsigned int *)(cq + params.cq_off.head);
+  engine->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+  engine->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  engine->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  void *buf_ring = mmap(NULL, IO_URING_BUFFERS * sizeof(io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  void *buf_base = mmap(NULL, IO_URING_BUFFERS * IO_URING_BUFFER_SIZE,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  if (buf_ring == MAP_FAILED || buf_base == MAP_FAILED) {
+    if (buf_ring != MAP_FAILED) {
+      engine->buf_ring = (io_uring_buf_ring *)buf_ring;
+    }
+    if (buf_base != MAP_FAILED) {
+      engine->buf_base = (unsigned char *)buf_base;
+    }
+    error = "bad io_uring: mmap buffers";
+    return false;
+  }
+  engine->buf_ring = (io_uring_buf_ring *)buf_ring;
+  engine->buf_base = (unsigned char *)buf_base;
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)engine->buf_ring;
+  reg.ring_entries = IO_URING_BUFFERS;
+  reg.bgid = IO_URING_BUFFER_GROUP;
+  if (uring_register(engine->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+      0) {
+    error = std::string("bad io_uring: buffer ring: ") + strerror(errno);
+    return false;
+  }
+  for (unsigned short bid = 0; bid < IO_URING_BUFFERS; ++bid) {
+    buffer_recycle(engine, bid);
+  }
+
+  engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (engine->event_fd < 0 ||
+      uring_register(engine->ring_fd, IORING_REGISTER_EVENTFD,
+                     &engine->event_fd, 1) < 0) {
+    error = std::string("bad io_uring: eventfd: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+static void engine_submit(UringEngine *engine) {
+  while (engine->sq_pending > 0) {
+    int ret = uring_enter(engine->ring_fd, engine->sq_pending, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      // Completion queue backed up, retried after the next reap.
+      if (errno == EAGAIN || errno == EBUSY) return;
+      quit("incredible: io_uring_enter error");
+    }
+    if (ret == 0) return;
+    engine->sq_pending -= ret;
+  }
+}
+
+static void OnSubmit(evutil_socket_t sock, short what, void *ctx) {
+  UringEngine *engine = (UringEngine *)ctx;
+  engine->submit_scheduled = false;
+  engine_submit(engine);
+}
+
+// Everything prepared during one loop iteration goes in one io_uring_enter,
+// from an event activated by the first preparation.
+static io_uring_sqe *sqe_get(UringEngine *engine) {
+  unsigned int tail = *engine->sq_tail;
+  if (tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) >=
+      engine->sq_entries) {
+    engine_submit(engine);
+    if (tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) >=
+        engine->sq_entries) {
+      quit("incredible: io_uring submission queue full");
+    }
+  }
+
+  unsigned int index = tail & *engine->sq_mask;
+  io_uring_sqe *sqe = &engine->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  engine->sq_array[index] = index;
+  __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++engine->sq_pending;
+
+  if (!engine->submit_scheduled) {
+    engine->submit_scheduled = true;
+    event_active(engine->submit, EV_WRITE, 0);
+  }
+  return sqe;
+}
+
+static void stream_complete(UringStream *stream, unsigned int op, int res,
+                            unsigned int flags);
+static void listener_complete(UringListener *listener, int res,
+                              unsigned int flags);
+
+static void engine_reap(UringEngine *engine) {
+  while (1) {
+    unsigned int head = *engine->cq_head;
+    unsigned int tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (__atomic_load_n(engine->sq_flags, __ATOMIC_RELAXED) &
+          IORING_SQ_CQ_OVERFLOW) {
+        uring_enter(engine->ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+        continue;
+      }
+      break;
+    }
+
+    while (head != tail) {
+      io_uring_cqe cqe = engine->cqes[head & *engine->cq_mask];
+      ++head;
+      __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+
+      unsigned int op = cqe.user_data & OP_MASK;
+      void *ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)OP_MASK);
+      if (!ptr) continue;
+      if (op == OP_ACCEPT) {
+        listener_complete((UringListener *)ptr, cqe.res, cqe.flags);
+      } else {
+        stream_complete((UringStream *)ptr, op, cqe.res, cqe.flags);
+      }
+    }
+  }
+
+  if (engine->sq_pending > 0) {
+    engine_submit(engine);
+  }
+}
+
+static void OnNotify(evutil_socket_t sock, short what, void *ctx) {
+  uint64_t count;
+  while (read(sock, &count, sizeof(count)) > 0) {
+  }
+  engine_reap((UringEngine *)ctx);
+}
+
+// One engine per event_base, created by the first stream or listener.
+static UringEngine *engine_get(event_base *base) {
+  if (uring_engine_cache && uring_engine_cache->base == base) {
+    return uring_engine_cache;
+  }
+
+  std::lock_guard<std::mutex> guard(uring_lock);
+  for (UringEngine *engine : uring_engines) {
+    if (engine->base == base) {
+      uring_engine_cache = engine;
+      return engine;
+    }
+  }
+
+  std::string error;
+  UringEngine *engine = new UringEngine();
+  engine->base = base;
+  if (!engine_setup(engine, error)) {
+    quit(error.c_str());
+  }
+  engine->notify = event_new(base, engine->event_fd, EV_READ | EV_PERSIST,
+                             OnNotify, engine);
+  engine->submit = event_new(base, -1, 0, OnSubmit, engine);
+  event_add(engine->notify, NULL);
+
+  uring_engines.push_back(engine);
+  uring_engine_cache = engine;
+  return engine;
+}
+
+static void stream_event(UringStream *stream, short what) {
+  bufferevent *peer = bufferevent_pair_get_partner(stream->bev);
+  if (peer) {
+    bufferevent_trigger_event(peer, what, 0);
+  }
+}
+
+static void stream_arm_recv(UringStream *stream) {
+  io_uring_sqe *sqe = sqe_get(stream->engine);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = stream->sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IO_URING_BUFFER_GROUP;
+  sqe->user_data = op_data(stream, OP_RECV);
+  stream->recv_armed = true;
+  ++stream->ops;
+}
+
+static void stream_cancel_recv(UringStream *stream) {
+  if (!stream->recv_armed || stream->recv_canceling) return;
+
+  io_uring_sqe *sqe = sqe_get(stream->engine);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = op_data(stream, OP_RECV);
+  sqe->user_data = op_data(stream, OP_CANCEL);
+  stream->recv_canceling = true;
+  ++stream->ops;
+}
+
+static void stream_close(UringStream *stream) {
+  io_uring_sqe *sqe = sqe_get(stream->engine);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = stream->sock;
+  sqe->user_data = op_data(stream, OP_CLOSE);
+  stream->sock = -1;
+  ++stream->ops;
+}
+
+// One sendmsg at a time straight from the chains of the ring side input,
+// drained once it completes. While it runs the pair stops moving data over,
+// so the session sees its own output grow as it would on a socket. Once the
+// session is gone the last send is hard-linked to the close.
+static void stream_send(UringStream *stream) {
+  if (stream->sending || stream->sock < 0 || !stream->connected ||
+      stream->failed) {
+    return;
+  }
+
+  evbuffer *input = bufferevent_get_input(stream->bev);
+  size_t length = evbuffer_get_length(input);
+  if (length == 0) return;
+  if (length > IO_URING_SEND_MAX) length = IO_URING_SEND_MAX;
+
+  evbuffer_iovec chains[IO_URING_SEND_IOV];
+  int count = evbuffer_peek(input, length, NULL, chains, IO_URING_SEND_IOV);
+  if (count > IO_URING_SEND_IOV) count = IO_URING_SEND_IOV;
+
+  size_t total = 0;
+  for (int i = 0; i < count; ++i) {
+    size_t part = chains[i].iov_len;
+    if (part > length - total) part = length - total;
+    stream->iov[i].iov_base = chains[i].iov_base;
+    stream->iov[i].iov_len = part;
+    total += part;
+  }
+
+  memset(&stream->msg, 0, sizeof(stream->msg));
+  stream->msg.msg_iov = stream->iov;
+  stream->msg.msg_iovlen = count;
+
+  io_uring_sqe *sqe = sqe_get(stream->engine);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = stream->sock;
+  sqe->addr = (uint64_t)(uintptr_t)&stream->msg;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = op_data(stream, OP_SEND);
+  stream->sending = true;
+  ++stream->ops;
+
+  if (stream->detached && total == evbuffer_get_length(input)) {
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    stream_close(stream);
+  }
+  bufferevent_disable(stream->bev, EV_READ);
+}
+
+// Once the session is gone: flush what it left, close, and free the stream
+// after the last completion.
+static void stream_finish(UringStream *stream) {
+  if (stream->sending || stream->connecting || stream->resolving) return;
+
+  if (stream->sock >= 0 && stream->connected && !stream->failed &&
+      evbuffer_get_length(bufferevent_get_input(stream->bev)) > 0) {
+    stream_send(stream);
+    return;
+  }
+
+  if (stream->sock >= 0) {
+    stream_cancel_recv(stream);
+    stream_close(stream);
+  }
+
+  if (stream->ops == 0 && stream->sock < 0) {
+    bufferevent_free(stream->bev);
+    delete stream;
+  }
+}
+
+static void stream_deliver_eof(UringStream *stream) {
+  if (stream->eof && !stream->eof_sent &&
+      evbuffer_get_length(bufferevent_get_output(stream->bev)) == 0) {
+    stream->eof_sent = true;
+    stream_event(stream, BEV_EVENT_EOF);
+  }
+}
+
+static void stream_recv_done(UringStream *stream, int res,
+                             unsigned int flags) {
+  UringEngine *engine = stream->engine;
+  bool more = flags & IORING_CQE_F_MORE;
+
+  if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!stream->detached) {
+      bufferevent_write(stream->bev,
+                        engine->buf_base + (size_t)bid * IO_URING_BUFFER_SIZE,
+                        res);
+    }
+    buffer_recycle(engine, bid);
+  }
+
+  if (!more) {
+    stream->recv_armed = false;
+    stream->recv_canceling = false;
+    --stream->ops;
+  }
+  if (stream->detached) return;
+
+  if (res == 0) {
+    stream->eof = true;
+    stream_deliver_eof(stream);
+    return;
+  }
+
+  if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+    stream->failed = true;
+    stream_event(stream, BEV_EVENT_ERROR | BEV_EVENT_READING);
+    return;
+  }
+
+  if (!more) {
+    if (!stream->recv_paused) {
+      stream_arm_recv(stream);
+    }
+  } else if (evbuffer_get_length(bufferevent_get_output(stream->bev)) >=
+             IO_URING_BACKLOG) {
+    stream->recv_paused = true;
+    stream_cancel_recv(stream);
+  }
+}
+
+static void stream_send_done(UringStream *stream, int res) {
+  stream->sending = false;
+  --stream->ops;
+
+  if (res < 0) {
+    stream->failed = true;
+    if (!stream->detached) {
+      stream_event(stream, BEV_EVENT_ERROR | BEV_EVENT_WRITING);
+    }
+    return;
+  }
+
+  evbuffer *input = bufferevent_get_input(stream->bev);
+  evbuffer_drain(input, res);
+  if (stream->detached) return;
+
+  if (evbuffer_get_length(input) > 0) {
+    stream_send(stream);
+  } else {
+    bufferevent_enable(stream->bev, EV_READ);
+  }
+}
+
+static void stream_connect_done(UringStream *stream, int res) {
+  stream->connecting = false;
+  --stream->ops;
+  if (stream->detached) return;
+
+  if (res < 0) {
+    stream->failed = true;
+    stream_event(stream, BEV_EVENT_ERROR);
+    return;
+  }
+
+  stream->connected = true;
+  stream_event(stream, BEV_EVENT_CONNECTED);
+  stream_arm_recv(stream);
+  stream_send(stream);
+}
+
+static void stream_complete(UringStream *stream, unsigned int op, int res,
+                            unsigned int flags) {
+  switch (op) {
+    case OP_RECV:
+      stream_recv_done(stream, res, flags);
+      break;
+    case OP_SEND:
+      stream_send_done(stream, res);
+      break;
+    case OP_CONNECT:
+      stream_connect_done(stream, res);
+      break;
+    default:
+      --stream->ops;
+      break;
+  }
+
+  if (stream->detached) {
+    stream_finish(stream);
+  }
+}
+
+// The session wrote: its data is now in the ring side input.
+static void OnStreamRead(bufferevent *bev, void *ctx) {
+  stream_send((UringStream *)ctx);
+}
+
+// The session took received data: resume a paused recv, pass on a held EOF.
+static void OnStreamWrite(bufferevent *bev, void *ctx) {
+  UringStream *stream = (UringStream *)ctx;
+  if (stream->recv_paused &&
+      evbuffer_get_length(bufferevent_get_output(bev)) < IO_URING_BACKLOG) {
+    stream->recv_paused = false;
+    if (!stream->recv_armed && !stream->eof && !stream->failed &&
+        stream->sock >= 0) {
+      stream_arm_recv(stream);
+    }
+  }
+  stream_deliver_eof(stream);
+}
+
+static bufferevent *uring_stream_new(event_base *base, evutil_socket_t sock) {
+  bufferevent *pair[2];
+  if (bufferevent_pair_new(base, BEV_OPT_DEFER_CALLBACKS, pair) < 0) {
+    return nullptr;
+  }
+
+  UringStream *stream = new UringStream();
+  stream->engine = engine_get(base);
+  stream->bev = pair[1];
+  bufferevent_setcb(pair[1], OnStreamRead, OnStreamWrite, NULL, stream);
+  bufferevent_setwatermark(pair[1], EV_WRITE, IO_URING_BACKLOG / 2, 0);
+  bufferevent_enable(pair[1], EV_READ | EV_WRITE);
+
+  if (sock >= 0) {
+    stream->sock = sock;
+    stream->connected = true;
+    stream_arm_recv(stream);
+  }
+  return pair[0];
+}
+
+static UringStream *uring_stream_of(bufferevent *bev) {
+  bufferevent *ring_side = bufferevent_pair_get_partner(bev);
+  if (!ring_side) return nullptr;
+
+  // Pairs also carry mux tunnels.
+  bufferevent_data_cb readcb = nullptr;
+  void *ctx = nullptr;
+  bufferevent_getcb(ring_side, &readcb, NULL, NULL, &ctx);
+  return readcb == OnStreamRead ? (UringStream *)ctx : nullptr;
+}
+
+static int uring_stream_connect(UringStream *stream, const sockaddr *addr,
+                                int addr_len, bool fast_open,
+                                uint64_t &fast_open_key) {
+  fast_open_key = 0;
+  if (stream->sock >= 0 || addr_len > (int)sizeof(stream->addr)) return -1;
+
+  evutil_socket_t sock =
+      socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  if (fast_open) {
+    fast_open_arm(sock, addr, fast_open_key);
+  }
+
+  stream->sock = sock;
+  memcpy(&stream->addr, addr, addr_len);
+
+  io_uring_sqe *sqe = sqe_get(stream->engine);
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = sock;
+  sqe->addr = (uint64_t)(uintptr_t)&stream->addr;
+  sqe->off = addr_len;
+  sqe->user_data = op_data(stream, OP_CONNECT);
+  stream->connecting = true;
+  ++stream->ops;
+  return 0;
+}
+
+static void OnResolved(int result, evutil_addrinfo *res, void *ctx) {
+  UringStream *stream = (UringStream *)ctx;
+  stream->resolving = false;
+  stream->resolve = nullptr;
+
+  if (stream->detached) {
+    if (res) evutil_freeaddrinfo(res);
+    stream_finish(stream);
+    return;
+  }
+
+  uint64_t fast_open_key;
+  if (result != 0 || !res ||
+      uring_stream_connect(stream, res->ai_addr, (int)res->ai_addrlen, false,
+                           fast_open_key) < 0) {
+    stream->failed = true;
+    stream_event(stream, BEV_EVENT_ERROR);
+  }
+  if (res) evutil_freeaddrinfo(res);
+}
+
+static void listener_arm(UringListener *listener) {
+  listener->armed = true;
+  io_uring_sqe *sqe = sqe_get(listener->engine);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = evconnlistener_get_fd(listener->listener);
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = op_data(listener, OP_ACCEPT);
+}
+
+static void listener_complete(UringListener *listener, int res,
+                              unsigned int flags) {
+  bool more = flags & IORING_CQE_F_MORE;
+  if (!more) {
+    listener->armed = false;
+  }
+  if (listener->closed) {
+    if (res >= 0) close(res);
+    if (!more) delete listener;
+    return;
+  }
+
+  if (res >= 0) {
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(res, (sockaddr *)&addr, &addr_len) < 0) {
+      memset(&addr, 0, sizeof(addr));
+      addr_len = 0;
+    }
+    listener->cb(listener->listener, res, (sockaddr *)&addr, addr_len,
+                 listener->ctx);
+  }
+
+  if (!more && !listener->paused) {
+    listener_arm(listener);
+  }
+}
+
+#endif
+
+bool io_stream_init(bool io_uring, std::string &error) {
+  if (!io_uring) return true;
+
+#ifdef HAVE_IO_URING
+  UringEngine probe;
+  bool ok = engine_setup(&probe, error);
+  engine_teardown(&probe);
+  uring_enabled = ok;
+  return ok;
+#else
+  error = "invalid option: io-uring, not supported";
+  return false;
+#endif
+}
+
+bool io_stream_uring() { return uring_enabled; }
+
+evconnlistener *io_listener_new_bind(event_base *base, evconnlistener_cb cb,
+                                     void *ctx, unsigned int flags,
+                                     int backlog, const sockaddr *addr,
+                                     int addr_len) {
+#ifdef HAVE_IO_URING
+  if (uring_enabled) {
+    evconnlistener *out =
+        evconnlistener_new_bind(base, cb, ctx, flags | LEV_OPT_DISABLED,
+                                backlog, addr, addr_len);
+    if (!out) return nullptr;
+
+    UringListener *listener = new UringListener();
+    listener->engine = engine_get(base);
+    listener->listener = out;
+    listener->cb = cb;
+    listener->ctx = ctx;
+    {
+      std::lock_guard<std::mutex> guard(uring_lock);
+      uring_listeners.push_back(listener);
+    }
+    listener_arm(listener);
+    return out;
+  }
+#endif
+  return evconnlistener_new_bind(base, cb, ctx, flags, backlog, addr,
+                                 addr_len);
+}
+
+void io_listener_free(evconnlistener *listener) {
+#ifdef HAVE_IO_URING
+  if (uring_enabled) {
+    std::lock_guard<std::mutex> guard(uring_lock);
+    for (size_t i = 0; i < uring_listeners.size(); ++i) {
+      UringListener *entry = uring_listeners[i];
+      if (entry->listener != listener) continue;
+
+      io_uring_sqe *sqe = sqe_get(entry->engine);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = op_data(entry, OP_ACCEPT);
+      entry->closed = true;
+      uring_listeners.erase(uring_listeners.begin() + i);
+      break;
+    }
+  }
+#endif
+  evconnlistener_free(listener);
+}
+
+// The ring's accept is canceled on pause, connections it completed before
+// the cancel are still handed over.
+void io_listener_pause(evconnlistener *listener, bool paused) {
+#ifdef HAVE_IO_URING
+  if (uring_enabled) {
+    std::lock_guard<std::mutex> guard(uring_lock);
+    for (UringListener *entry : uring_listeners) {
+      if (entry->listener != listener || entry->paused == paused) continue;
+
+      entry->paused = paused;
+      if (paused && entry->armed) {
+        io_uring_sqe *sqe = sqe_get(entry->engine);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = op_data(entry, OP_ACCEPT);
+      } else if (!paused && !entry->armed) {
+        listener_arm(entry);
+      }
+    }
+    return;
+  }
+#endif
+  if (paused) {
+    evconnlistener_disable(listener);
+  } else {
+    evconnlistener_enable(listener);
+  }
+}
+
+bufferevent *io_stream_new(event_base *base, evutil_socket_t sock) {
+#ifdef HAVE_IO_URING
+  if (uring_enabled) {
+    return uring_stream_new(base, sock);
+  }
+#endif
+  return bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
+}
+
+void io_stream_free(bufferevent *bev) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    // What the session left in its own output is dropped, as a socket
+    // bufferevent would; what already reached the ring side is flushed.
+    bufferevent_free(bev);
+    stream->detached = true;
+    if (stream->resolving) {
+      evdns_getaddrinfo_cancel(stream->resolve);
+      return;
+    }
+    stream_cancel_recv(stream);
+    stream_finish(stream);
+    return;
+  }
+#endif
+  // A pair end standing in for a target, the other end sees it close.
+  if (bufferevent_pair_get_partner(bev)) {
+    bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
+  }
+  bufferevent_free(bev);
+}
+
+evutil_socket_t io_stream_fd(bufferevent *bev) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    return stream->sock;
+  }
+#endif
+  return bufferevent_getfd(bev);
+}
+
+size_t io_stream_buffered(bufferevent *bev) {
+  size_t length = evbuffer_get_length(bufferevent_get_input(bev)) +
+                  evbuffer_get_length(bufferevent_get_output(bev));
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    length += evbuffer_get_length(bufferevent_get_input(stream->bev)) +
+              evbuffer_get_length(bufferevent_get_output(stream->bev));
+  }
+#endif
+  return length;
+}
+
+static void socket_reset(evutil_socket_t sock) {
+  linger hard = {1, 0};
+  setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char *)&hard, sizeof(hard));
+}
+
+// A send stuck on a peer that stopped reading is canceled, otherwise the
+// ring side would hold on to its data until the peer goes away.
+void io_stream_reset(bufferevent *bev) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    if (stream->sock >= 0) {
+      socket_reset(stream->sock);
+    }
+    stream->failed = true;
+    if (stream->sending) {
+      io_uring_sqe *sqe = sqe_get(stream->engine);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = op_data(stream, OP_SEND);
+      sqe->user_data = op_data(stream, OP_CANCEL);
+      ++stream->ops;
+    }
+    return;
+  }
+#endif
+  evutil_socket_t sock = bufferevent_getfd(bev);
+  if (sock >= 0) {
+    socket_reset(sock);
+  }
+}
+
+int io_stream_connect(bufferevent *bev, const sockaddr *addr, int addr_len,
+                      bool fast_open, uint64_t &fast_open_key) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    return uring_stream_connect(stream, addr, addr_len, fast_open,
+                                fast_open_key);
+  }
+#endif
+  if (fast_open) {
+    return fast_open_connect(bev, addr, addr_len, fast_open_key);
+  }
+  fast_open_key = 0;
+  return bufferevent_socket_connect(bev, (sockaddr *)addr, addr_len);
+}
+
+void io_stream_attach(bufferevent *bev, evutil_socket_t sock) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    stream->sock = sock;
+    stream->connected = true;
+    stream_arm_recv(stream);
+    stream_send(stream);
+    return;
+  }
+#endif
+  bufferevent_setfd(bev, sock);
+}
+
+int io_stream_connect_hostname(bufferevent *bev, evdns_base *dnsbase,
+                               int family, const char *hostname, int port) {
+#ifdef HAVE_IO_URING
+  UringStream *stream = uring_enabled ? uring_stream_of(bev) : nullptr;
+  if (stream) {
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+
+    evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    // The callback may run before evdns_getaddrinfo returns.
+    stream->resolving = true;
+    evdns_getaddrinfo_request *request = evdns_getaddrinfo(
+        dnsbase, hostname, service, &hints, OnResolved, stream);
+    if (stream->resolving) {
+      stream->resolve = request;
+    }
+    return 0;
+  }
+#endif
+  return bufferevent_socket_connect_hostname(bev, dnsbase, family, hostname,
+                                             port);
+}
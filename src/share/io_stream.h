@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include "network.h"
+
+// Socket streams handed to the sessions. By default a stream is a plain
+// socket bufferevent on the libevent backend. With the io_uring backend it
+// is one end of a bufferevent pair, and a ring per reactor drives the other
+// end: multishot accept on the listeners, multishot recv into a registered
+// buffer ring, sends straight from the evbuffer chains, and the last send
+// linked to the close. One io_uring_enter per loop iteration submits all of
+// it, so the sessions keep their bufferevent code and state machines while
+// the syscalls no longer grow with the number of sockets.
+
+// Selects the backend once at startup, before any stream exists. Fails when
+// io_uring is asked for but not usable here.
+bool io_stream_init(bool io_uring, std::string &error);
+bool io_stream_uring();
+
+// Same as evconnlistener_new_bind. On io_uring the accepts come from the
+// ring, the callback is called the same way.
+evconnlistener *io_listener_new_bind(event_base *base, evconnlistener_cb cb,
+                                     void *ctx, unsigned int flags,
+                                     int backlog, const sockaddr *addr,
+                                     int addr_len);
+void io_listener_free(evconnlistener *listener);
+// Stops accepting until resumed, pending connections wait in the backlog.
+void io_listener_pause(evconnlistener *listener, bool paused);
+
+// Wraps `sock`, or a stream still to be connected when it is -1. The
+// stream owns the socket.
+bufferevent *io_stream_new(event_base *base, evutil_socket_t sock);
+void io_stream_free(bufferevent *bev);
+// The stream's socket, -1 while it has none.
+evutil_socket_t io_stream_fd(bufferevent *bev);
+// Bytes buffered for the stream, the ring side of a pair included.
+size_t io_stream_buffered(bufferevent *bev);
+// Drops what the stream still has to send, the connection is reset once the
+// stream is freed.
+void io_stream_reset(bufferevent *bev);
+
+// Same as bufferevent_socket_connect, with fast open when `fast_open` is
+// set; see fast_open_connect() for `fast_open_key`.
+int io_stream_connect(bufferevent *bev, const sockaddr *addr, int addr_len,
+                      bool fast_open, uint64_t &fast_open_key);
+// Hands a stream made without a socket the already connected `sock`, no
+// BEV_EVENT_CONNECTED follows.
+void io_stream_attach(bufferevent *bev, evutil_socket_t sock);
+// Same as bufferevent_socket_connect_hostname.
+int io_stream_connect_hostname(bufferevent *bev, evdns_base *dnsbase,
+                               int family, const char *hostname, int port);
@@ -0,0 +1,319 @@
+#include "mempool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "system.h"
+
+#ifndef SYS_WINDOWS
+#include <sys/mman.h>
+#endif
+
+#include <event2/event.h>
+
+#define MEMPOOL_HEADER_SIZE 16
+#define MEMPOOL_MIN_SHIFT 5
+#define MEMPOOL_CLASS_COUNT 12
+#define MEMPOOL_LARGE_CLASS 0xFF
+#define MEMPOOL_SLAB_SIZE (256 * 1024)
+#define MEMPOOL_HUGE_SLAB_SIZE (2 * 1024 * 1024)
+#define MEMPOOL_BATCH 32
+
+struct MemoryBlock {
+  MemoryBlock *next;
+};
+
+struct MemoryHeader {
+  size_t size;
+  unsigned int size_class;
+  unsigned int reserved;
+};
+
+struct MemoryClass {
+  std::mutex lock;
+  MemoryBlock *head = nullptr;
+  size_t free_count = 0;
+  std::atomic<size_t> carved{0};
+  // Blocks in use as of the last refill or flush of each thread cache,
+  // behind by what the caches counted since.
+  std::atomic<ptrdiff_t> used{0};
+};
+
+struct MemoryCache {
+  MemoryBlock *head[MEMPOOL_CLASS_COUNT];
+  size_t count[MEMPOOL_CLASS_COUNT];
+  // Allocations less frees on this thread not yet added to the class, so a
+  // cache hit touches no shared cache line.
+  ptrdiff_t used[MEMPOOL_CLASS_COUNT];
+
+  MemoryCache() {
+    memset(head, 0, sizeof(head));
+    memset(count, 0, sizeof(count));
+    memset(used, 0, sizeof(used));
+  }
+  ~MemoryCache();
+};
+
+static bool pool_hugepage = false;
+static size_t pool_slab_size = MEMPOOL_SLAB_SIZE;
+static MemoryClass pool_classes[MEMPOOL_CLASS_COUNT];
+
+static std::mutex slab_lock;
+static MemoryBlock *slab_free = nullptr;
+static std::atomic<size_t> slab_count{0};
+static std::atomic<size_t> large_count{0};
+static std::atomic<size_t> large_bytes{0};
+
+static thread_local MemoryCache pool_cache;
+
+// Classes hold a power of two plus the header. libevent sizes its buffer
+// chains in powers of two, a class of exactly that size would put every
+// chain in the next one up and leave half of it unused.
+static inline size_t class_data_size(unsigned int size_class) {
+  return (size_t)1 << (size_class + MEMPOOL_MIN_SHIFT);
+}
+
+static inline size_t class_block_size(unsigned int size_class) {
+  return class_data_size(size_class) + MEMPOOL_HEADER_SIZE;
+}
+
+static inline void class_account(MemoryCache *cache, unsigned int size_class) {
+  pool_classes[size_class].used.fetch_add(cache->used[size_class],
+                                          std::memory_order_relaxed);
+  cache->used[size_class] = 0;
+}
+
+static inline size_t class_used(unsigned int size_class) {
+  ptrdiff_t used =
+      pool_classes[size_class].used.load(std::memory_order_relaxed);
+  return used > 0 ? used : 0;
+}
+
+static inline int class_of(size_t size) {
+  if (size > MEMPOOL_MAX_BLOCK) return -1;
+
+  int size_class = 0;
+  while (class_data_size(size_class) < size) ++size_class;
+  return size_class;
+}
+
+static void *slab_map() {
+  void *slab = nullptr;
+#ifdef SYS_WINDOWS
+  slab = malloc(pool_slab_size);
+#else
+#ifdef MAP_HUGETLB
+  if (pool_hugepage) {
+    slab = mmap(NULL, pool_slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab == MAP_FAILED) slab = nullptr;
+  }
+#endif
+  if (!slab) {
+    slab = mmap(NULL, pool_slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+    if (pool_hugepage) madvise(slab, pool_slab_size, MADV_HUGEPAGE);
+#endif
+  }
+#endif
+  slab_count += 1;
+  return slab;
+}
+
+static void *slab_take() {
+  {
+    std::lock_guard<std::mutex> guard(slab_lock);
+    if (slab_free) {
+      MemoryBlock *slab = slab_free;
+      slab_free = slab->next;
+      return slab;
+    }
+  }
+  return slab_map();
+}
+
+// Moves up to MEMPOOL_BATCH blocks of the class into the thread cache,
+// carving a fresh slab when the shared list is empty.
+static bool class_refill(unsigned int size_class) {
+  MemoryClass &mc = pool_classes[size_class];
+  size_t block_size = class_block_size(size_class);
+
+  std::lock_guard<std::mutex> guard(mc.lock);
+  class_account(&pool_cache, size_class);
+  if (!mc.head) {
+    char *slab = (char *)slab_take();
+    if (!slab) return false;
+
+    size_t count = pool_slab_size / block_size;
+    for (size_t i = count; i > 0; --i) {
+      MemoryBlock *block = (MemoryBlock *)(slab + (i - 1) * block_size);
+      block->next = mc.head;
+      mc.head = block;
+    }
+    mc.free_count += count;
+    mc.carved += count;
+  }
+
+  MemoryBlock *&head = pool_cache.head[size_class];
+  size_t &cached = pool_cache.count[size_class];
+  for (int i = 0; i < MEMPOOL_BATCH && mc.head; ++i) {
+    MemoryBlock *block = mc.head;
+    mc.head = block->next;
+    mc.free_count -= 1;
+    block->next = head;
+    head = block;
+    cached += 1;
+  }
+  return true;
+}
+
+static void class_flush(MemoryCache *cache, unsigned int size_class,
+                        size_t count) {
+  MemoryClass &mc = pool_classes[size_class];
+
+  std::lock_guard<std::mutex> guard(mc.lock);
+  class_account(cache, size_class);
+  while (count-- > 0 && cache->head[size_class]) {
+    MemoryBlock *block = cache->head[size_class];
+    cache->head[size_class] = block->next;
+    cache->count[size_class] -= 1;
+    block->next = mc.head;
+    mc.head = block;
+    mc.free_count += 1;
+  }
+}
+
+MemoryCache::~MemoryCache() {
+  for (unsigned int i = 0; i < MEMPOOL_CLASS_COUNT; ++i) {
+    class_flush(this, i, count[i]);
+  }
+}
+
+void mempool_init(size_t prefault_mb, bool hugepage) {
+  pool_hugepage = hugepage;
+  if (hugepage) {
+    pool_slab_size = MEMPOOL_HUGE_SLAB_SIZE;
+  }
+
+  size_t slabs = (prefault_mb * 1024 * 1024 + pool_slab_size - 1) /
+                 pool_slab_size;
+  for (size_t i = 0; i < slabs; ++i) {
+    MemoryBlock *slab = (MemoryBlock *)slab_map();
+    if (!slab) break;
+
+    memset(slab, 0, pool_slab_size);
+    slab->next = slab_free;
+    slab_free = slab;
+  }
+
+  event_set_mem_functions(mempool_alloc, mempool_realloc, mempool_free);
+}
+
+void *mempool_alloc(size_t size) {
+  MemoryHeader *header;
+  int size_class = class_of(size);
+  if (size_class < 0) {
+    header = (MemoryHeader *)malloc(MEMPOOL_HEADER_SIZE + size);
+    if (!header) return nullptr;
+
+    header->size = size;
+    header->size_class = MEMPOOL_LARGE_CLASS;
+    large_count += 1;
+    large_bytes += size;
+    return (char *)header + MEMPOOL_HEADER_SIZE;
+  }
+
+  if (!pool_cache.head[size_class] && !class_refill(size_class)) {
+    return nullptr;
+  }
+
+  MemoryBlock *block = pool_cache.head[size_class];
+  pool_cache.head[size_class] = block->next;
+  pool_cache.count[size_class] -= 1;
+  pool_cache.used[size_class] += 1;
+
+  header = (MemoryHeader *)block;
+  header->size = size;
+  header->size_class = size_class;
+  return (char *)header + MEMPOOL_HEADER_SIZE;
+}
+
+void *mempool_realloc(void *ptr, size_t size) {
+  if (!ptr) return mempool_alloc(size);
+  if (size == 0) {
+    mempool_free(ptr);
+    return nullptr;
+  }
+
+  MemoryHeader *header = (MemoryHeader *)((char *)ptr - MEMPOOL_HEADER_SIZE);
+  if (header->size_class != MEMPOOL_LARGE_CLASS &&
+      size <= class_data_size(header->size_class)) {
+    header->size = size;
+    return ptr;
+  }
+
+  void *out = mempool_alloc(size);
+  if (out) {
+    memcpy(out, ptr, header->size < size ? header->size : size);
+    mempool_free(ptr);
+  }
+  return out;
+}
+
+void mempool_free(void *ptr) {
+  if (!ptr) return;
+
+  MemoryHeader *header = (MemoryHeader *)((char *)ptr - MEMPOOL_HEADER_SIZE);
+  unsigned int size_class = header->size_class;
+  if (size_class == MEMPOOL_LARGE_CLASS) {
+    large_count -= 1;
+    large_bytes -= header->size;
+    free(header);
+    return;
+  }
+
+  MemoryBlock *block = (MemoryBlock *)header;
+  block->next = pool_cache.head[size_class];
+  pool_cache.head[size_class] = block;
+  pool_cache.count[size_class] += 1;
+  pool_cache.used[size_class] -= 1;
+
+  if (pool_cache.count[size_class] > 2 * MEMPOOL_BATCH) {
+    class_flush(&pool_cache, size_class, MEMPOOL_BATCH);
+  }
+}
+
+size_t mempool_used() {
+  size_t used_bytes = large_bytes;
+  for (unsigned int i = 0; i < MEMPOOL_CLASS_COUNT; ++i) {
+    class_account(&pool_cache, i);
+    used_bytes += class_used(i) * class_block_size(i);
+  }
+  return used_bytes;
+}
+
+void mempool_dump(FILE *fp) {
+  size_t used_bytes = 0, carved_bytes = 0;
+
+  fprintf(fp, "mempool: slabs: %zu x %zu KB%s\n", slab_count.load(),
+          pool_slab_size / 1024, pool_hugepage ? " (hugepage)" : "");
+  for (unsigned int i = 0; i < MEMPOOL_CLASS_COUNT; ++i) {
+    size_t block_size = class_block_size(i);
+    class_account(&pool_cache, i);
+    size_t carved = pool_classes[i].carved, used = class_used(i);
+    if (carved == 0) continue;
+
+    fprintf(fp, " - class %6zu: %8zu / %8zu blocks in use (%.1f%%)\n",
+            class_data_size(i), used, carved, 100.0 * used / carved);
+    used_bytes += used * block_size;
+    carved_bytes += carved * block_size;
+  }
+  fprintf(fp, " - large: %zu blocks, %zu bytes\n", large_count.load(),
+          large_bytes.load());
+  fprintf(fp, " - total: %zu / %zu bytes in use\n", used_bytes, carved_bytes);
+}
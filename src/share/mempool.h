@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Size-class slab allocator for sessions and libevent buffers. Blocks up to
+// MEMPOOL_MAX_BLOCK bytes come from slabs carved per size class and recycled
+// through per-thread caches, larger requests fall through to malloc.
+
+#define MEMPOOL_MAX_BLOCK (64 * 1024)
+
+// Must be called before the first libevent allocation, `prefault_mb` slab
+// memory is mapped and touched up front.
+void mempool_init(size_t prefault_mb, bool hugepage);
+
+void *mempool_alloc(size_t size);
+void *mempool_realloc(void *ptr, size_t size);
+void mempool_free(void *ptr);
+
+// Bytes of the blocks in use, large ones included. Other threads report
+// their counts on each refill and flush of their caches, so this may lag a
+// few batches per thread.
+size_t mempool_used();
+
+void mempool_dump(FILE *fp);
@@ -0,0 +1,608 @@
+#include "mux.h"
+
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+#include "io_stream.h"
+#include "mempool.h"
+#include "target.h"
+#include "util.h"
+
+#define MUX_OPEN 1
+#define MUX_DATA 2
+#define MUX_CREDIT 3
+#define MUX_CLOSE 4
+
+#define MUX_FRAME_HEADER 7
+// A frame with its header fills one AEAD chunk.
+#define MUX_FRAME_MAX (0x3fff - MUX_FRAME_HEADER)
+// Frames a tunnel queues toward its session before the streams wait, and
+// what a stream reads ahead of its turns.
+#define MUX_TUNNEL_QUEUE (256 * 1024)
+#define MUX_STREAM_QUEUE (4 * MUX_FRAME_MAX)
+
+struct MuxTunnel;
+
+struct MuxStream {
+  MuxTunnel *tunnel;
+  uint32_t id;
+  bufferevent *local;
+  // In the round robin of its tunnel.
+  MuxStream *ready_prev = nullptr;
+  MuxStream *ready_next = nullptr;
+  bool queued = false;
+  // The local side closed, CLOSE follows its last data.
+  bool closing = false;
+  // The peer closed, freed once the local output drained.
+  bool flushing = false;
+  // Server: a lookup or connect race will call back.
+  bool pending = false;
+  unsigned short port = 0;
+  // What the peer may still be sent, and what it sent that was not
+  // credited back yet.
+  size_t credit = MUX_WINDOW;
+  size_t unreturned = 0;
+  // On the local output, returns credit as the local side takes data.
+  evbuffer_cb_entry *drained = nullptr;
+
+  static void *operator new(size_t size) { return mempool_alloc(size); }
+  static void operator delete(void *ptr) { mempool_free(ptr); }
+};
+
+struct MuxTunnel {
+  bufferevent *end;
+  evdns_base *dnsbase;
+  const SessionOptions *options;
+  // What a stream may have in flight toward this side.
+  size_t window;
+  bool server;
+  // Out of stream ids, closed once its last stream is.
+  bool draining = false;
+  uint32_t next_id = 1;
+  std::unordered_map<uint32_t, MuxStream *> streams;
+  MuxStream *ready_head = nullptr;
+  MuxStream *ready_tail = nullptr;
+};
+
+struct MuxClient {
+  event_base *base;
+  const SessionOptions *options;
+  MuxCarrierFn carrier;
+  void *ctx;
+  std::vector<MuxTunnel *> tunnels;
+};
+
+static thread_local MuxClient *mux_client = nullptr;
+
+static std::atomic<size_t> mux_tunnels{0};
+static std::atomic<size_t> mux_streams{0};
+static std::atomic<size_t> mux_opened{0};
+static std::atomic<size_t> mux_failed{0};
+static std::atomic<size_t> mux_stalled{0};
+static std::atomic<size_t> mux_broken{0};
+
+static void OnMuxRead(bufferevent *bev, void *ctx);
+static void OnMuxWrite(bufferevent *bev, void *ctx);
+static void OnMuxEvent(bufferevent *bev, short what, void *ctx);
+static void OnMuxStreamRead(bufferevent *bev, void *ctx);
+static void OnMuxStreamWrite(bufferevent *bev, void *ctx);
+static void OnMuxStreamEvent(bufferevent *bev, short what, void *ctx);
+static void OnMuxStreamDrained(evbuffer *buf, const evbuffer_cb_info *info,
+                               void *ctx);
+
+static void mux_frame(MuxTunnel *tunnel, unsigned char type, uint32_t id,
+                      size_t len) {
+  unsigned char header[MUX_FRAME_HEADER] = {
+      type,
+      (unsigned char)(id >> 24),
+      (unsigned char)(id >> 16),
+      (unsigned char)(id >> 8),
+      (unsigned char)id,
+      (unsigned char)(len >> 8),
+      (unsigned char)len};
+  evbuffer_add(bufferevent_get_output(tunnel->end), header, sizeof(header));
+}
+
+static void mux_grant(MuxStream *stream, size_t credit) {
+  unsigned char payload[4] = {
+      (unsigned char)(credit >> 24), (unsigned char)(credit >> 16),
+      (unsigned char)(credit >> 8), (unsigned char)credit};
+  mux_frame(stream->tunnel, MUX_CREDIT, stream->id, sizeof(payload));
+  evbuffer_add(bufferevent_get_output(stream->tunnel->end), payload,
+               sizeof(payload));
+}
+
+static void mux_queue(MuxStream *stream) {
+  if (stream->queued) return;
+  MuxTunnel *tunnel = stream->tunnel;
+  stream->queued = true;
+  stream->ready_next = nullptr;
+  stream->ready_prev = tunnel->ready_tail;
+  if (tunnel->ready_tail) {
+    tunnel->ready_tail->ready_next = stream;
+  } else {
+    tunnel->ready_head = stream;
+  }
+  tunnel->ready_tail = stream;
+}
+
+static void mux_unqueue(MuxStream *stream) {
+  if (!stream->queued) return;
+  MuxTunnel *tunnel = stream->tunnel;
+  if (stream->ready_prev) {
+    stream->ready_prev->ready_next = stream->ready_next;
+  } else {
+    tunnel->ready_head = stream->ready_next;
+  }
+  if (stream->ready_next) {
+    stream->ready_next->ready_prev = stream->ready_prev;
+  } else {
+    tunnel->ready_tail = stream->ready_prev;
+  }
+  stream->queued = false;
+}
+
+static void mux_stream_release(MuxStream *stream) {
+  if (stream->pending) {
+    dns_cancel(stream);
+    connect_race_cancel(stream);
+  }
+  evbuffer_remove_cb_entry(bufferevent_get_output(stream->local),
+                           stream->drained);
+  io_stream_free(stream->local);
+  delete stream;
+  mux_streams -= 1;
+}
+
+static void mux_stream_free(MuxStream *stream) {
+  mux_unqueue(stream);
+  stream->tunnel->streams.erase(stream->id);
+  mux_stream_release(stream);
+}
+
+// Tells the peer, then frees the stream.
+static void mux_stream_close(MuxStream *stream) {
+  mux_frame(stream->tunnel, MUX_CLOSE, stream->id, 0);
+  mux_stream_free(stream);
+}
+
+// The session carrying the tunnel sees it end as a socket would.
+static void mux_tunnel_close(MuxTunnel *tunnel) {
+  for (auto &it : tunnel->streams) {
+    mux_stream_release(it.second);
+  }
+  tunnel->streams.clear();
+  bufferevent_flush(tunnel->end, EV_WRITE, BEV_FINISHED);
+  bufferevent_free(tunnel->end);
+  if (!tunnel->server) {
+    std::vector<MuxTunnel *> &tunnels = mux_client->tunnels;
+    tunnels.erase(std::find(tunnels.begin(), tunnels.end(), tunnel));
+  }
+  delete tunnel;
+  mux_tunnels -= 1;
+}
+
+static MuxTunnel *mux_tunnel_new(event_base *base, evdns_base *dnsbase,
+                                 const SessionOptions *options, bool server,
+                                 bufferevent **carried) {
+  bufferevent *pair[2];
+  if (bufferevent_pair_new(base, BEV_OPT_DEFER_CALLBACKS, pair) < 0) {
+    quit("incredible: bufferevent_pair_new error");
+  }
+
+  MuxTunnel *tunnel = new MuxTunnel();
+  tunnel->end = pair[1];
+  tunnel->dnsbase = dnsbase;
+  tunnel->options = options;
+  tunnel->window = std::max<size_t>(
+      server ? options->up_window : options->down_window, MUX_WINDOW);
+  tunnel->server = server;
+  bufferevent_setcb(pair[1], OnMuxRead, OnMuxWrite, OnMuxEvent, tunnel);
+  bufferevent_setwatermark(pair[1], EV_WRITE, MUX_TUNNEL_QUEUE / 2, 0);
+  bufferevent_enable(pair[1], EV_READ | EV_WRITE);
+  mux_tunnels += 1;
+  *carried = pair[0];
+  return tunnel;
+}
+
+// The peer learns of the stream's window beyond what every stream starts
+// with.
+static MuxStream *mux_stream_new(MuxTunnel *tunnel, uint32_t id,
+                                 bufferevent *local) {
+  MuxStream *stream = new MuxStream();
+  stream->tunnel = tunnel;
+  stream->id = id;
+  stream->local = local;
+  tunnel->streams[id] = stream;
+
+  bufferevent_setcb(local, OnMuxStreamRead, OnMuxStreamWrite,
+                    OnMuxStreamEvent, stream);
+  bufferevent_setwatermark(local, EV_READ, 0, MUX_STREAM_QUEUE);
+  bufferevent_setwatermark(local, EV_WRITE, 0, 0);
+  stream->drained = evbuffer_add_cb(bufferevent_get_output(local),
+                                    OnMuxStreamDrained, stream);
+  if (!stream->drained) {
+    quit("incredible: evbuffer_add_cb error");
+  }
+  bufferevent_set_idle(local, 0);
+  bufferevent_enable(local, EV_READ | EV_WRITE);
+  if (tunnel->window > MUX_WINDOW) {
+    mux_grant(stream, tunnel->window - MUX_WINDOW);
+  }
+  mux_streams += 1;
+  mux_opened += 1;
+  return stream;
+}
+
+// Round robin over the streams with data and credit, a frame per turn,
+// while the tunnel has room.
+static void mux_schedule(MuxTunnel *tunnel) {
+  evbuffer *output = bufferevent_get_output(tunnel->end);
+  while (tunnel->ready_head &&
+         evbuffer_get_length(output) < MUX_TUNNEL_QUEUE) {
+    MuxStream *stream = tunnel->ready_head;
+    mux_unqueue(stream);
+
+    evbuffer *input = bufferevent_get_input(stream->local);
+    size_t len = std::min(evbuffer_get_length(input), stream->credit);
+    len = std::min(len, (size_t)MUX_FRAME_MAX);
+    if (len) {
+      mux_frame(tunnel, MUX_DATA, stream->id, len);
+      evbuffer_remove_buffer(input, output, len);
+      stream->credit -= len;
+      if (!stream->credit) {
+        mux_stalled += 1;
+      }
+    }
+
+    if (!evbuffer_get_length(input)) {
+      if (stream->closing) {
+        mux_stream_close(stream);
+      }
+    } else if (stream->credit) {
+      mux_queue(stream);
+    }
+  }
+}
+
+// The peer is done: what it sent still goes out before the local side
+// closes. What the local side sends meanwhile is read and dropped, so it is
+// not kept from reading by a full socket.
+static void mux_stream_finish(MuxStream *stream) {
+  if (!evbuffer_get_length(bufferevent_get_output(stream->local))) {
+    mux_stream_free(stream);
+    return;
+  }
+  mux_unqueue(stream);
+  stream->flushing = true;
+  evbuffer *input = bufferevent_get_input(stream->local);
+  evbuffer_drain(input, evbuffer_get_length(input));
+  bufferevent_setwatermark(stream->local, EV_READ, 0, 0);
+}
+
+static void mux_stream_fail(MuxTunnel *tunnel, uint32_t id) {
+  mux_frame(tunnel, MUX_CLOSE, id, 0);
+  mux_failed += 1;
+}
+
+// Connecting streams report here as a session's target does, a failed one
+// is closed.
+static void mux_connect_started(MuxStream *stream, TargetState state) {
+  stream->pending = state == TARGET_PENDING;
+  if (state == TARGET_NO_SUCH_NAME || state == TARGET_UNRESOLVED) {
+    mux_failed += 1;
+    mux_stream_close(stream);
+  }
+}
+
+static void OnMuxRaced(void *ctx, evutil_socket_t sock, size_t index) {
+  MuxStream *stream = (MuxStream *)ctx;
+  stream->pending = false;
+  if (sock < 0) {
+    mux_failed += 1;
+    mux_stream_close(stream);
+    return;
+  }
+  io_stream_attach(stream->local, sock);
+}
+
+static void OnMuxResolved(void *ctx, const DnsAnswer &answer) {
+  MuxStream *stream = (MuxStream *)ctx;
+  uint64_t fast_open_key;
+  mux_connect_started(
+      stream, target_connect_answer(stream->local, answer, stream->port,
+                                    stream->tunnel->options, false,
+                                    fast_open_key, OnMuxRaced, stream));
+}
+
+// Server: connects the target of an OPEN, data for it waits in the
+// stream's output meanwhile. A malformed address refuses the stream.
+static void mux_accept_stream(MuxTunnel *tunnel, uint32_t id,
+                              evbuffer *input, size_t len) {
+  unsigned char data[TARGET_ADDR_MAX];
+  TargetAddr target;
+  const char *error = nullptr;
+  size_t removed = std::min(len, sizeof(data));
+  evbuffer_remove(input, data, removed);
+  evbuffer_drain(input, len - removed);
+  if (target_parse(data, removed, target, error) != len) {
+    mux_stream_fail(tunnel, id);
+    return;
+  }
+
+  bufferevent *local = io_stream_new(bufferevent_get_base(tunnel->end), -1);
+  if (!local) {
+    mux_stream_fail(tunnel, id);
+    return;
+  }
+
+  MuxStream *stream = mux_stream_new(tunnel, id, local);
+  stream->port = target.port;
+  uint64_t fast_open_key;
+  mux_connect_started(
+      stream, target_connect(local, tunnel->dnsbase, target, tunnel->options,
+                             false, fast_open_key, OnMuxResolved, OnMuxRaced,
+                             stream));
+}
+
+// Takes the payload of one frame from `input`. False when the peer broke
+// the protocol; frames for a stream already closed here are dropped.
+static bool mux_receive(MuxTunnel *tunnel, unsigned char type, uint32_t id,
+                        evbuffer *input, size_t len) {
+  auto it = tunnel->streams.find(id);
+  MuxStream *stream = it == tunnel->streams.end() ? nullptr : it->second;
+
+  switch (type) {
+    case MUX_OPEN:
+      if (!tunnel->server || stream || !id) return false;
+      mux_accept_stream(tunnel, id, input, len);
+      return true;
+
+    case MUX_DATA:
+      if (!stream) break;
+      if (stream->unreturned + len > tunnel->window) return false;
+      evbuffer_remove_buffer(input, bufferevent_get_output(stream->local),
+                             len);
+      stream->unreturned += len;
+      return true;
+
+    case MUX_CREDIT: {
+      unsigned char payload[4];
+      if (len != sizeof(payload)) return false;
+      evbuffer_remove(input, payload, sizeof(payload));
+      if (!stream) return true;
+      stream->credit += (size_t)payload[0] << 24 | payload[1] << 16 |
+                        payload[2] << 8 | payload[3];
+      if (!stream->flushing &&
+          evbuffer_get_length(bufferevent_get_input(stream->local))) {
+        mux_queue(stream);
+      }
+      return true;
+    }
+
+    case MUX_CLOSE:
+      if (!stream) break;
+      evbuffer_drain(input, len);
+      mux_stream_finish(stream);
+      return true;
+
+    default:
+      return false;
+  }
+  evbuffer_drain(input, len);
+  return true;
+}
+
+static void OnMuxRead(bufferevent *bev, void *ctx) {
+  MuxTunnel *tunnel = (MuxTunnel *)ctx;
+  evbuffer *input = bufferevent_get_input(bev);
+  unsigned char header[MUX_FRAME_HEADER];
+
+  while (evbuffer_copyout(input, header, sizeof(header)) ==
+         (ev_ssize_t)sizeof(header)) {
+    size_t len = header[5] << 8 | header[6];
+    if (len > MUX_FRAME_MAX) {
+      mux_broken += 1;
+      mux_tunnel_close(tunnel);
+      return;
+    }
+    if (evbuffer_get_length(input) < sizeof(header) + len) break;
+
+    uint32_t id = (uint32_t)header[1] << 24 | header[2] << 16 |
+                  header[3] << 8 | header[4];
+    evbuffer_drain(input, sizeof(header));
+    if (!mux_receive(tunnel, header[0], id, input, len)) {
+      mux_broken += 1;
+      mux_tunnel_close(tunnel);
+      return;
+    }
+  }
+  mux_schedule(tunnel);
+}
+
+static void OnMuxWrite(bufferevent *bev, void *ctx) {
+  mux_schedule((MuxTunnel *)ctx);
+}
+
+static void OnMuxEvent(bufferevent *bev, short what, void *ctx) {
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    mux_tunnel_close((MuxTunnel *)ctx);
+  }
+}
+
+static void OnMuxStreamRead(bufferevent *bev, void *ctx) {
+  MuxStream *stream = (MuxStream *)ctx;
+  if (stream->flushing) {
+    evbuffer *input = bufferevent_get_input(bev);
+    evbuffer_drain(input, evbuffer_get_length(input));
+  } else if (stream->credit) {
+    mux_queue(stream);
+    mux_schedule(stream->tunnel);
+  }
+}
+
+// The local side took everything: a stream the peer closed is done.
+static void OnMuxStreamWrite(bufferevent *bev, void *ctx) {
+  MuxStream *stream = (MuxStream *)ctx;
+  if (stream->flushing &&
+      !evbuffer_get_length(bufferevent_get_output(bev))) {
+    mux_stream_free(stream);
+  }
+}
+
+// The local side took data: the peer gets back the credit for it once it
+// is worth a frame, and all of it once nothing is left queued, so a sender
+// waiting on the rest is never stranded below the mark.
+static void OnMuxStreamDrained(evbuffer *buf, const evbuffer_cb_info *info,
+                               void *ctx) {
+  MuxStream *stream = (MuxStream *)ctx;
+  if (!info->n_deleted || stream->flushing) return;
+
+  size_t queued = evbuffer_get_length(buf);
+  size_t drained =
+      stream->unreturned > queued ? stream->unreturned - queued : 0;
+  if (drained && (drained >= stream->tunnel->window / 4 || !queued)) {
+    mux_grant(stream, drained);
+    stream->unreturned -= drained;
+  }
+}
+
+// What the local side sent before its EOF still goes out, an error drops
+// it.
+static void OnMuxStreamEvent(bufferevent *bev, short what, void *ctx) {
+  MuxStream *stream = (MuxStream *)ctx;
+  if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) return;
+
+  if (stream->flushing) {
+    mux_stream_free(stream);
+    return;
+  }
+  if (what & BEV_EVENT_ERROR) {
+    mux_failed += 1;
+    mux_stream_close(stream);
+    return;
+  }
+  if (!evbuffer_get_length(bufferevent_get_input(bev))) {
+    mux_stream_close(stream);
+    return;
+  }
+
+  stream->closing = true;
+  bufferevent_disable(bev, EV_READ);
+  if (stream->credit) {
+    mux_queue(stream);
+    mux_schedule(stream->tunnel);
+  }
+}
+
+// Opens a tunnel, its request goes ahead of any frame.
+static MuxTunnel *mux_client_tunnel() {
+  static const unsigned char header[MUX_HEADER_SIZE] = {MUX_ATYP,
+                                                        MUX_VERSION, 0, 0};
+  MuxClient *client = mux_client;
+  bufferevent *carried;
+  MuxTunnel *tunnel =
+      mux_tunnel_new(client->base, nullptr, client->options, false, &carried);
+  evbuffer_add(bufferevent_get_output(tunnel->end), header, sizeof(header));
+  client->tunnels.push_back(tunnel);
+  client->carrier(client->ctx, carried);
+  return tunnel;
+}
+
+// The tunnel with the fewest streams. Tunnels that went away are replaced
+// here, the new one only takes streams when no other is left.
+static MuxTunnel *mux_pick() {
+  MuxClient *client = mux_client;
+  MuxTunnel *best = nullptr;
+  size_t live = 0;
+  for (size_t i = 0; i < client->tunnels.size();) {
+    MuxTunnel *tunnel = client->tunnels[i];
+    if (tunnel->draining) {
+      if (tunnel->streams.empty()) {
+        mux_tunnel_close(tunnel);
+      } else {
+        ++i;
+      }
+      continue;
+    }
+    if (!best || tunnel->streams.size() < best->streams.size()) {
+      best = tunnel;
+    }
+    ++live;
+    ++i;
+  }
+
+  if (live < client->options->mux) {
+    MuxTunnel *fresh = mux_client_tunnel();
+    if (!best) {
+      best = fresh;
+    }
+  }
+  return best;
+}
+
+void mux_client_start(event_base *base, const SessionOptions *options,
+                      MuxCarrierFn carrier, void *ctx) {
+  MuxClient *client = new MuxClient();
+  client->base = base;
+  client->options = options;
+  client->carrier = carrier;
+  client->ctx = ctx;
+  mux_client = client;
+  for (unsigned int i = 0; i < options->mux; ++i) {
+    mux_client_tunnel();
+  }
+}
+
+void mux_open(bufferevent *local, evbuffer *request) {
+  size_t len = std::min(evbuffer_get_length(request), (size_t)TARGET_ADDR_MAX);
+  TargetAddr target;
+  const char *error = nullptr;
+  size_t addr_len =
+      target_parse(evbuffer_pullup(request, len), len, target, error);
+  if (!addr_len) {
+    mux_failed += 1;
+    io_stream_free(local);
+    evbuffer_free(request);
+    return;
+  }
+
+  MuxTunnel *tunnel = mux_pick();
+  uint32_t id = tunnel->next_id++;
+  if (!tunnel->next_id) {
+    tunnel->draining = true;
+  }
+
+  mux_frame(tunnel, MUX_OPEN, id, addr_len);
+  evbuffer_remove_buffer(request, bufferevent_get_output(tunnel->end),
+                         addr_len);
+  evbuffer *input = bufferevent_get_input(local);
+  evbuffer_prepend_buffer(input, request);
+  evbuffer_free(request);
+
+  MuxStream *stream = mux_stream_new(tunnel, id, local);
+  if (evbuffer_get_length(input)) {
+    mux_queue(stream);
+    mux_schedule(tunnel);
+  }
+}
+
+bufferevent *mux_accept(event_base *base, evdns_base *dnsbase,
+                        const SessionOptions *options) {
+  bufferevent *carried;
+  mux_tunnel_new(base, dnsbase, options, true, &carried);
+  return carried;
+}
+
+void mux_dump(FILE *fp) {
+  size_t opened = mux_opened;
+  if (!opened && !mux_tunnels) return;
+
+  fprintf(fp,
+          "mux: %zu tunnels, %zu streams, opened: %zu, failed: %zu, out of "
+          "credit: %zu, broken tunnels: %zu\n",
+          (size_t)mux_tunnels, (size_t)mux_streams, opened,
+          (size_t)mux_failed, (size_t)mux_stalled, (size_t)mux_broken);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "network.h"
+#include "options.h"
+
+// Sessions carried as streams over a few long-lived tunnels, so a new
+// request goes out at once on a connection that is already up and past
+// slow start. A tunnel is an ordinary session to the server whose request
+// names the address type below; what follows it are frames:
+//
+//   type (1) | stream id (4) | length (2) | payload
+//
+// OPEN carries the target as a SOCKS address, DATA the bytes of a stream,
+// CREDIT a 4 byte credit the receiver grants back as its socket drains, and
+// CLOSE ends a stream in both directions once the data before it is out.
+// Each side may send MUX_WINDOW bytes of a stream before its first credit,
+// so the buffering per stream stays bounded and a stalled stream never
+// holds up the tunnel. Streams with data and credit take turns a frame at
+// a time.
+//
+// The frames run over one end of a bufferevent pair. The session carrying
+// the tunnel holds the other end as it would hold a socket and encrypts
+// between it and the peer.
+
+#define MUX_ATYP 0x6d
+#define MUX_VERSION 1
+// The request of a tunnel: MUX_ATYP, MUX_VERSION and two bytes unused.
+#define MUX_HEADER_SIZE 4
+// Credit of a new stream in each direction.
+#define MUX_WINDOW (64 * 1024)
+
+// Called with the end of a new tunnel's pair that a session has to carry
+// to a remote.
+typedef void (*MuxCarrierFn)(void *ctx, bufferevent *end);
+
+// Client, on the reactor thread running `base`: keeps `options->mux`
+// tunnels, opened through `carrier` as they are needed.
+void mux_client_start(event_base *base, const SessionOptions *options,
+                      MuxCarrierFn carrier, void *ctx);
+// Carries `local` as a new stream to the target at the front of `request`,
+// the rest of `request` is sent before what `local` reads. Takes both, a
+// malformed address closes `local` without a stream.
+void mux_open(bufferevent *local, evbuffer *request);
+
+// Server: a new tunnel, returns the end that stands in for a target.
+bufferevent *mux_accept(event_base *base, evdns_base *dnsbase,
+                        const SessionOptions *options);
+
+void mux_dump(FILE *fp);
@@ -1,5 +1,22 @@
 #include "network.h"
 
+#include <errno.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#ifndef SYS_WINDOWS
+#include <netinet/tcp.h>
+#endif
+
+// Largest remainder worth copying, a partial AEAD chunk.
+#define EVBUFFER_TRIM_MAX (16 * 1024)
+// Bounds of an adapted window.
+#define BUFFEREVENT_WINDOW_MIN (16 * 1024)
+#define BUFFEREVENT_WINDOW_MAX (4 * 1024 * 1024)
+
+static std::atomic<size_t> window_cap{SIZE_MAX};
+
 void network_init() {
 #ifdef SYS_WINDOWS
   WORD wVersionRequested = MAKEWORD(2, 2);
@@ -9,3 +26,97 @@ void network_init() {
   signal(SIGPIPE, SIG_IGN);
 #endif
 }
+
+evutil_socket_t socket_connect_start(const sockaddr *addr, int addr_len) {
+  evutil_socket_t sock = socket(addr->sa_family, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+
+  evutil_make_socket_nonblocking(sock);
+  evutil_make_socket_closeonexec(sock);
+  if (connect(sock, addr, addr_len) == 0) return sock;
+
+  int error = evutil_socket_geterror(sock);
+#ifdef SYS_WINDOWS
+  if (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS) return sock;
+#else
+  if (error == EINPROGRESS || error == EINTR) return sock;
+#endif
+  evutil_closesocket(sock);
+  return -1;
+}
+
+bool socket_connect_done(evutil_socket_t sock) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  return getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == 0 &&
+         error == 0;
+}
+
+void bufferevent_set_idle(bufferevent *bev, unsigned int seconds) {
+  if (!seconds) {
+    bufferevent_set_timeouts(bev, NULL, NULL);
+    return;
+  }
+
+  timeval idle = {(time_t)seconds, 0};
+  const timeval *common =
+      event_base_init_common_timeout(bufferevent_get_base(bev), &idle);
+  bufferevent_set_timeouts(bev, common ? common : &idle, NULL);
+}
+
+void bufferevent_set_window(bufferevent *bev, size_t window) {
+  bufferevent_setwatermark(bev, EV_WRITE, window / 4, window);
+}
+
+#if defined(TCP_INFO) && !defined(SYS_WINDOWS)
+static bool socket_info(evutil_socket_t sock, tcp_info &info) {
+  socklen_t len = sizeof(info);
+  return sock >= 0 &&
+         getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+         info.tcpi_rtt > 0;
+}
+#endif
+
+// Twice what the socket sends in the longer round trip: its congestion
+// window per RTT is the rate it drains at, and a paused source needs a
+// round trip of its own before its data flows again.
+void bufferevent_adapt_window(bufferevent *bev, evutil_socket_t sock,
+                              evutil_socket_t source) {
+#if defined(TCP_INFO) && !defined(SYS_WINDOWS)
+  tcp_info out, in;
+  if (!socket_info(sock, out)) return;
+
+  uint64_t rate =
+      (uint64_t)out.tcpi_snd_cwnd * out.tcpi_snd_mss * 1000000 / out.tcpi_rtt;
+  uint64_t rtt = out.tcpi_rtt;
+  if (socket_info(source, in) && in.tcpi_rtt > rtt) {
+    rtt = in.tcpi_rtt;
+  }
+
+  uint64_t window = 2 * rate * rtt / 1000000;
+  if (window < BUFFEREVENT_WINDOW_MIN) window = BUFFEREVENT_WINDOW_MIN;
+  if (window > BUFFEREVENT_WINDOW_MAX) window = BUFFEREVENT_WINDOW_MAX;
+  bufferevent_set_window(bev, window);
+#endif
+}
+
+size_t bufferevent_window_cap() {
+  return window_cap.load(std::memory_order_relaxed);
+}
+
+void bufferevent_set_window_cap(size_t cap) {
+  window_cap = cap ? cap : SIZE_MAX;
+}
+
+// The end of the input belongs to libevent, the remainder goes back in at
+// the front. The output is left alone, its front is frozen the same way
+// and it drains to the socket anyway.
+void bufferevent_trim(bufferevent *bev) {
+  evbuffer *input = bufferevent_get_input(bev);
+  size_t len = evbuffer_get_length(input);
+  if (len == 0 || len > EVBUFFER_TRIM_MAX) return;
+
+  unsigned char data[EVBUFFER_TRIM_MAX];
+  evbuffer_remove(input, data, len);
+  evbuffer_prepend(input, data, len);
+}
@@ -25,6 +25,41 @@
 
 void network_init();
 
+// Starts a nonblocking connect of a new socket to `addr`. Returns the
+// socket, writable once the connect is done, or -1 when it failed at once.
+evutil_socket_t socket_connect_start(const sockaddr *addr, int addr_len);
+// Whether the connect of a socket that became writable went through.
+bool socket_connect_done(evutil_socket_t sock);
+
+// Arms a read timeout of `seconds` on `bev`, 0 removes it. Sessions share
+// one common timeout queue per base, a million of them stay cheap to track.
+void bufferevent_set_idle(bufferevent *bev, unsigned int seconds);
+
+// Moves a small remainder in the input of `bev` out of the larger chain it
+// was read into.
+void bufferevent_trim(bufferevent *bev);
+
+// Output a session lets queue toward `bev` before it stops reading from the
+// other side, kept as the high write watermark of `bev`. The low one is a
+// quarter of it, the write callback resumes reading there while the socket
+// still has data to send.
+void bufferevent_set_window(bufferevent *bev, size_t window);
+
+// Sizes the window of `bev` from how fast `sock` drains and the longer
+// round trip of `sock` and `source`, the socket its data is read from. The
+// pipe stays full without queueing more than the path holds. Keeps the
+// window where TCP_INFO is not available.
+void bufferevent_adapt_window(bufferevent *bev, evutil_socket_t sock,
+                              evutil_socket_t source);
+
+// Caps every window, the memory budget lowers it under pressure. 0 lifts the
+// cap.
+size_t bufferevent_window_cap();
+void bufferevent_set_window_cap(size_t cap);
+
 static inline bool bufferevent_output_busy(bufferevent* target) {
-  return evbuffer_get_length(bufferevent_get_output(target)) >= 512 * 1024;
+  size_t window, cap = bufferevent_window_cap();
+  bufferevent_getwatermark(target, EV_WRITE, NULL, &window);
+  return evbuffer_get_length(bufferevent_get_output(target)) >=
+         (window < cap ? window : cap);
 }
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+
+// Tunables shared by every session of a server, filled from the command
+// line at startup.
+struct SessionOptions {
+  // Deadline for topping up a partial chunk during bulk transfers, 0 writes
+  // every read through at once.
+  unsigned int coalesce_delay = 1000;
+  // Reactor threads, more than one share the port through SO_REUSEPORT.
+  unsigned int threads = 1;
+  // TCP Fast Open on the listener and on outbound connects.
+  bool fast_open = false;
+  // Target hostnames go through the resolver cache shared by the reactors.
+  bool dns_cache = false;
+  // Milliseconds between connects to the addresses of a target hostname,
+  // 0 only tries the first.
+  unsigned int race_delay = 250;
+  // Output queued toward the target and toward the client before reading
+  // from the other side pauses, in bytes.
+  unsigned int up_window = 512 * 1024;
+  unsigned int down_window = 512 * 1024;
+  // Sizes both windows per session from the drain rate and round trips of
+  // its sockets, starting from the ones above.
+  bool adaptive_window = false;
+  // Most bytes read from a socket per event, 0 keeps libevent's default.
+  unsigned int read_size = 0;
+  // Seconds without reads before a session gives back its spare memory, 0
+  // never.
+  unsigned int idle_trim = 0;
+  // Seconds a session may take for its handshake, to connect its target and
+  // without reads once it relays, 0 never times out.
+  unsigned int handshake_timeout = 15;
+  unsigned int connect_timeout = 15;
+  unsigned int idle_timeout = 0;
+  // Bytes the pool may hold before accepts pause and sessions are shed, 0
+  // unbounded.
+  size_t mem_budget = 0;
+  // Connections to the remote each reactor opens ahead of its sessions at
+  // most, 0 none, and seconds before one is replaced, below the server's
+  // handshake timeout.
+  unsigned int warm_pool = 0;
+  unsigned int warm_age = 10;
+  // Milliseconds before the next best remote races the one picked for a
+  // session, 0 never.
+  unsigned int remote_race = 0;
+  // Shadowsocks UDP on the listen port, and seconds a peer's mapping lives
+  // without datagrams.
+  bool udp_relay = false;
+  unsigned int udp_timeout = 60;
+  // Tunnels to the remote each reactor keeps, carrying its sessions as
+  // streams, 0 each session connects on its own.
+  unsigned int mux = 0;
+};
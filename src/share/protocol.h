@@ -6,10 +6,13 @@ enum RuningStep {
   STEP_CONNECT,
   STEP_TRANSPORT,
   STEP_FLUSHING,
+  // A SOCKS5 UDP association, held open until the client closes it.
+  STEP_ASSOCIATE,
   STEP_TERMINATE
 };
 
-enum RuningProtocol {
+// One byte, sessions keep it among their hot fields.
+enum RuningProtocol : unsigned char {
   PROTOCOL_NONE = 0,
   PROTOCOL_SOCKS4 = 1 << 1,
   PROTOCOL_SOCKS5 = 1 << 2,
@@ -0,0 +1,199 @@
+#include "remote_set.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "connect_race.h"
+
+// Share of the latest connect in the smoothed time and failure rate.
+#define REMOTE_WEIGHT 0.25
+// What a failure adds to the expected connect time at a rate of one.
+#define REMOTE_FAILURE_MS 3000
+// One pick in this many goes to the remote picked least lately.
+#define REMOTE_PROBE_EVERY 16
+
+struct Remote {
+  sockaddr_storage addr;
+  // As given.
+  std::string name;
+  // Smoothed, 0 until a connect was timed.
+  double connect_ms = 0;
+  double failure_rate = 0;
+  unsigned int connecting = 0;
+  // Since when connects waited without one succeeding.
+  uint32_t stalled_since = 0;
+  size_t last_pick = 0;
+  size_t picked = 0;
+  size_t connected = 0;
+  size_t failed = 0;
+  size_t outrun = 0;
+  size_t abandoned = 0;
+};
+
+static std::vector<Remote *> remotes;
+static std::mutex remote_lock;
+static size_t remote_picks = 0;
+
+static double remote_score(const Remote *remote, uint32_t now) {
+  double ms = remote->connect_ms;
+  if (remote->connecting) {
+    ms = std::max(ms, (double)(uint32_t)(now - remote->stalled_since));
+  }
+  return ms + remote->failure_rate * REMOTE_FAILURE_MS;
+}
+
+// The best remote other than `skip`, the lock held.
+static uint8_t remote_best(uint8_t skip) {
+  uint32_t now = connect_clock();
+  uint8_t best = REMOTE_NONE;
+  double best_score = 0;
+  for (size_t id = 0; id < remotes.size(); ++id) {
+    if (id == skip) continue;
+    double score = remote_score(remotes[id], now);
+    if (best == REMOTE_NONE || score < best_score) {
+      best = (uint8_t)id;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+static void remote_start(uint8_t id) {
+  Remote *remote = remotes[id];
+  if (remote->connecting++ == 0) {
+    remote->stalled_since = connect_clock();
+  }
+  remote->last_pick = ++remote_picks;
+  remote->picked += 1;
+}
+
+static void remote_settle(Remote *remote, bool failed) {
+  remote->connecting -= 1;
+  if (failed) {
+    remote->failed += 1;
+  }
+  remote->failure_rate = remote->failure_rate * (1 - REMOTE_WEIGHT) +
+                         (failed ? REMOTE_WEIGHT : 0);
+}
+
+static void remote_sample(Remote *remote, uint32_t started) {
+  double ms = (uint32_t)(connect_clock() - started);
+  if (remote->connect_ms) {
+    ms = remote->connect_ms * (1 - REMOTE_WEIGHT) + ms * REMOTE_WEIGHT;
+  }
+  remote->connect_ms = ms;
+}
+
+bool remote_add(const char *text, unsigned short port, std::string &error) {
+  if (remotes.size() >= REMOTE_MAX) {
+    error = "invalid option: remote addr, at most " +
+            std::to_string(REMOTE_MAX);
+    return false;
+  }
+
+  Remote *remote = new Remote();
+  int addr_len = sizeof(remote->addr);
+  if (evutil_parse_sockaddr_port(text, (sockaddr *)&remote->addr,
+                                 &addr_len)) {
+    delete remote;
+    error = "invalid option: remote addr";
+    return false;
+  }
+  if (remote->addr.ss_family == AF_INET) {
+    sockaddr_in *addr4 = (sockaddr_in *)&remote->addr;
+    if (!addr4->sin_port) {
+      addr4->sin_port = htons(port);
+    }
+  } else {
+    sockaddr_in6 *addr6 = (sockaddr_in6 *)&remote->addr;
+    if (!addr6->sin6_port) {
+      addr6->sin6_port = htons(port);
+    }
+  }
+  remote->name = text;
+  remotes.push_back(remote);
+  return true;
+}
+
+size_t remote_count() { return remotes.size(); }
+
+const sockaddr_storage *remote_addr(uint8_t id) { return &remotes[id]->addr; }
+
+uint8_t remote_pick() {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  uint8_t id = 0;
+  if (remotes.size() > 1) {
+    if ((remote_picks + 1) % REMOTE_PROBE_EVERY == 0) {
+      for (size_t i = 1; i < remotes.size(); ++i) {
+        if (remotes[i]->last_pick < remotes[id]->last_pick) {
+          id = (uint8_t)i;
+        }
+      }
+    } else {
+      id = remote_best(REMOTE_NONE);
+    }
+  }
+  remote_start(id);
+  return id;
+}
+
+uint8_t remote_rival(uint8_t first) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  uint8_t id = remote_best(first);
+  if (id != REMOTE_NONE) {
+    remote_start(id);
+  }
+  return id;
+}
+
+uint8_t remote_preferred() {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  return remote_best(REMOTE_NONE);
+}
+
+void remote_connected(uint8_t id, uint32_t started) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  Remote *remote = remotes[id];
+  remote_settle(remote, false);
+  remote->connected += 1;
+  remote->stalled_since = connect_clock();
+  if (started) {
+    remote_sample(remote, started);
+  }
+}
+
+void remote_failed(uint8_t id) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  remote_settle(remotes[id], true);
+}
+
+void remote_outrun(uint8_t id, uint32_t started) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  Remote *remote = remotes[id];
+  remote_settle(remote, false);
+  remote->outrun += 1;
+  remote_sample(remote, started);
+}
+
+void remote_abandoned(uint8_t id) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  Remote *remote = remotes[id];
+  remote->connecting -= 1;
+  remote->abandoned += 1;
+}
+
+void remote_dump(FILE *fp) {
+  std::lock_guard<std::mutex> guard(remote_lock);
+  uint32_t now = connect_clock();
+  for (Remote *remote : remotes) {
+    fprintf(fp,
+            "remote %s: score %.0f ms, connect %.0f ms, failing %.0f%%, "
+            "connecting: %u, picked: %zu, connected: %zu, failed: %zu, "
+            "outrun: %zu, abandoned: %zu\n",
+            remote->name.c_str(), remote_score(remote, now),
+            remote->connect_ms, remote->failure_rate * 100,
+            remote->connecting, remote->picked, remote->connected,
+            remote->failed, remote->outrun, remote->abandoned);
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "network.h"
+
+// The servers a client spreads its sessions over, shared by every reactor.
+// Each keeps a smoothed connect time and failure rate from the connects of
+// the sessions sent to it, and a new session goes to the one expected to
+// connect soonest, a failure weighing as a slow connect. Connects still
+// waiting count with their age, so a server that stops answering loses its
+// sessions within a second or so, long before they time out. Every few
+// picks go to the remote picked least lately, which notices one that
+// recovered.
+
+// Remotes are numbered in the order given, at most this many.
+#define REMOTE_MAX 64
+#define REMOTE_NONE 0xff
+
+// Parses `text` as ip[:port], taking `port` when it has none. Called at
+// startup, before any reactor runs.
+bool remote_add(const char *text, unsigned short port, std::string &error);
+size_t remote_count();
+const sockaddr_storage *remote_addr(uint8_t id);
+
+// The remote a new session connects to, and the best one after `first` to
+// race it against, REMOTE_NONE with a single remote. Both count as
+// connecting until the session settles them below.
+uint8_t remote_pick();
+uint8_t remote_rival(uint8_t first);
+// The best remote now, for traffic that does not connect.
+uint8_t remote_preferred();
+
+// `started` on connect_clock(), 0 when the connect was already made and
+// took no time.
+void remote_connected(uint8_t id, uint32_t started);
+void remote_failed(uint8_t id);
+// The rival connected first, this one took longer than that.
+void remote_outrun(uint8_t id, uint32_t started);
+// The session closed before this one connected.
+void remote_abandoned(uint8_t id);
+
+void remote_dump(FILE *fp);
@@ -0,0 +1,105 @@
+#include "replay_filter.h"
+
+#include <sodium.h>
+
+// False positive rate of about 1e-6 per filter.
+#define REPLAY_BITS_PER_SALT 29
+#define REPLAY_HASH_COUNT 20
+
+ReplayFilter::ReplayFilter(size_t capacity)
+    : capacity_(capacity / 2 > 0 ? capacity / 2 : 1),
+      hash_count_(REPLAY_HASH_COUNT) {
+  size_t words = (capacity_ * REPLAY_BITS_PER_SALT + 63) / 64;
+  bit_count_ = words * 64;
+  filters_[0].assign(words, 0);
+  filters_[1].assign(words, 0);
+  randombytes_buf(hash_key_, sizeof(hash_key_));
+}
+
+ReplayFilter::~ReplayFilter() {}
+
+// Keyed with a per-process secret, so a prober cannot pick salts that pile
+// onto the same bits.
+ReplayFilter::Probes ReplayFilter::Hash(const unsigned char *salt,
+                                        size_t salt_len) {
+  Probes probes;
+  crypto_generichash((unsigned char *)&probes, sizeof(probes), salt, salt_len,
+                     hash_key_, sizeof(hash_key_));
+  probes.h2 |= 1;
+  return probes;
+}
+
+bool ReplayFilter::Test(const std::vector<uint64_t> &bits,
+                        const Probes &probes) {
+  uint64_t found = 1;
+  for (unsigned int i = 0; i < hash_count_; ++i) {
+    uint64_t bit = (probes.h1 + i * probes.h2) % bit_count_;
+    found &= bits[bit / 64] >> (bit % 64);
+  }
+  return found & 1;
+}
+
+void ReplayFilter::Insert(const Probes &probes) {
+  if (current_count_ >= capacity_) {
+    current_ ^= 1;
+    current_count_ = 0;
+    std::fill(filters_[current_].begin(), filters_[current_].end(), 0);
+    rotations_ += 1;
+  }
+
+  std::vector<uint64_t> &bits = filters_[current_];
+  for (unsigned int i = 0; i < hash_count_; ++i) {
+    uint64_t bit = (probes.h1 + i * probes.h2) % bit_count_;
+    bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+  current_count_ += 1;
+}
+
+bool ReplayFilter::Test(const unsigned char *salt, size_t salt_len) {
+  Probes probes = Hash(salt, salt_len);
+
+  std::lock_guard<std::mutex> guard(lock_);
+  checks_ += 1;
+  if (Test(filters_[0], probes) | Test(filters_[1], probes)) {
+    hits_ += 1;
+    return true;
+  }
+  return false;
+}
+
+// Runs after Test() once the salt is authenticated, a hit here is a replay
+// that raced the first use.
+bool ReplayFilter::CheckAndAdd(const unsigned char *salt, size_t salt_len) {
+  Probes probes = Hash(salt, salt_len);
+
+  std::lock_guard<std::mutex> guard(lock_);
+  if (Test(filters_[0], probes) | Test(filters_[1], probes)) {
+    hits_ += 1;
+    return false;
+  }
+
+  Insert(probes);
+  return true;
+}
+
+void ReplayFilter::Add(const unsigned char *salt, size_t salt_len) {
+  Probes probes = Hash(salt, salt_len);
+
+  std::lock_guard<std::mutex> guard(lock_);
+  Insert(probes);
+}
+
+void ReplayFilter::Dump(FILE *fp) {
+  size_t checks = checks_, hits = hits_, count;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    count = current_count_;
+  }
+
+  fprintf(fp,
+          "replay filter: %zu checks, %zu replays (%.3f%%), "
+          "fill %.1f%%, %zu rotations, %zu KB\n",
+          checks, hits, checks ? 100.0 * hits / checks : 0.0,
+          100.0 * count / capacity_, rotations_.load(),
+          2 * bit_count_ / 8 / 1024);
+}
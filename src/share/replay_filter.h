@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Remembers recently seen AEAD salts in a rotating pair of keyed Bloom
+// filters. Each filter holds capacity / 2 salts, when the current one is
+// full the older one is cleared and takes its place, so between capacity / 2
+// and capacity of the latest salts are always remembered. Memory is fixed at
+// construction and every check probes the same number of bits.
+class ReplayFilter {
+ public:
+  explicit ReplayFilter(size_t capacity);
+  ~ReplayFilter();
+
+  // True when the salt was seen before. Records nothing, for salts not
+  // authenticated yet.
+  bool Test(const unsigned char *salt, size_t salt_len);
+  // Returns false when the salt was seen before, otherwise records it.
+  bool CheckAndAdd(const unsigned char *salt, size_t salt_len);
+  void Add(const unsigned char *salt, size_t salt_len);
+
+  void Dump(FILE *fp);
+
+ private:
+  struct Probes {
+    uint64_t h1;
+    uint64_t h2;
+  };
+
+  Probes Hash(const unsigned char *salt, size_t salt_len);
+  bool Test(const std::vector<uint64_t> &bits, const Probes &probes);
+  void Insert(const Probes &probes);
+
+  size_t capacity_;
+  size_t bit_count_;
+  unsigned int hash_count_;
+  unsigned char hash_key_[32];
+
+  std::mutex lock_;
+  size_t current_ = 0;
+  size_t current_count_ = 0;
+  std::vector<uint64_t> filters_[2];
+
+  std::atomic<size_t> checks_{0};
+  std::atomic<size_t> hits_{0};
+  std::atomic<size_t> rotations_{0};
+};
@@ -0,0 +1,120 @@
+#include "target.h"
+
+#include <string.h>
+
+#include "io_stream.h"
+
+size_t target_parse(const unsigned char *data, size_t len, TargetAddr &target,
+                    const char *&error) {
+  size_t addr_pos = 1, addr_len = 0;
+  switch (len ? data[0] : 0) {
+    case 1:  // IPV4
+      addr_len = 4;
+      break;
+    case 3:  // Domain
+      addr_pos = 2;
+      addr_len = len > 1 ? data[1] : 0;
+      break;
+    case 4:  // IPV6
+      addr_len = 16;
+      break;
+    default:
+      error = "error: proxy header, type";
+      return 0;
+  }
+
+  size_t parsed_len = addr_pos + addr_len + 2;
+  if (parsed_len > len) {
+    error = "error: proxy header, addr";
+    return 0;
+  }
+
+  const unsigned char *addr = data + addr_pos;
+  target.type = data[0];
+  target.port = addr[addr_len] << 8 | addr[addr_len + 1];
+  if (!target.port) {
+    error = "error: proxy header, port";
+    return 0;
+  }
+
+  memset(&target.addr, 0, sizeof(target.addr));
+  if (target.type == 1) {
+    sockaddr_in *sin = (sockaddr_in *)&target.addr;
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr.s_addr, addr, addr_len);
+    sin->sin_port = htons(target.port);
+    target.addr_len = sizeof(*sin);
+  } else if (target.type == 4) {
+    sockaddr_in6 *sin6 = (sockaddr_in6 *)&target.addr;
+    sin6->sin6_family = AF_INET6;
+    memcpy(sin6->sin6_addr.s6_addr, addr, addr_len);
+    sin6->sin6_port = htons(target.port);
+    target.addr_len = sizeof(*sin6);
+  } else {
+    memcpy(target.host, addr, addr_len);
+    target.host[addr_len] = '\0';
+    target.addr_len = 0;
+  }
+  return parsed_len;
+}
+
+TargetState target_connect(bufferevent *bev, evdns_base *dnsbase,
+                           const TargetAddr &target,
+                           const SessionOptions *options, bool fast_open,
+                           uint64_t &fast_open_key, DnsResolvedFn resolved,
+                           RaceConnectedFn raced, void *ctx) {
+  if (target.type != 3) {
+    io_stream_connect(bev, (const sockaddr *)&target.addr, target.addr_len,
+                      fast_open, fast_open_key);
+    return TARGET_CONNECTING;
+  }
+
+  if (!options->dns_cache) {
+    io_stream_connect_hostname(bev, dnsbase, AF_UNSPEC, target.host,
+                               target.port);
+    return TARGET_CONNECTING;
+  }
+
+  DnsAnswerPtr answer = dns_resolve(bufferevent_get_base(bev), dnsbase,
+                                    target.host, resolved, ctx);
+  if (!answer) return TARGET_PENDING;
+  return target_connect_answer(bev, *answer, target.port, options, fast_open,
+                               fast_open_key, raced, ctx);
+}
+
+TargetState target_connect_answer(bufferevent *bev, const DnsAnswer &answer,
+                                  unsigned short port,
+                                  const SessionOptions *options,
+                                  bool fast_open, uint64_t &fast_open_key,
+                                  RaceConnectedFn raced, void *ctx) {
+  if (options->race_delay &&
+      (answer.ipv4.size() + answer.ipv6.size() > 1 || answer.partial)) {
+    connect_race(bufferevent_get_base(bev), answer, port, options->race_delay,
+                 raced, ctx);
+    return TARGET_PENDING;
+  }
+
+  sockaddr_storage sa;
+  socklen_t sa_len;
+
+  memset(&sa, 0, sizeof(sa));
+  if (!answer.ipv4.empty()) {
+    sockaddr_in *sin = (sockaddr_in *)&sa;
+    sin->sin_family = AF_INET;
+    sin->sin_addr = answer.ipv4[0];
+    sin->sin_port = htons(port);
+    sa_len = sizeof(*sin);
+  } else if (!answer.ipv6.empty()) {
+    sockaddr_in6 *sin6 = (sockaddr_in6 *)&sa;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = answer.ipv6[0];
+    sin6->sin6_port = htons(port);
+    sa_len = sizeof(*sin6);
+  } else {
+    return answer.error == DNS_ERR_NOTEXIST ? TARGET_NO_SUCH_NAME
+                                            : TARGET_UNRESOLVED;
+  }
+
+  io_stream_connect(bev, (sockaddr *)&sa, sa_len, fast_open, fast_open_key);
+  return TARGET_CONNECTING;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "connect_race.h"
+#include "dns_cache.h"
+#include "network.h"
+#include "options.h"
+
+// The target of a session or mux stream: the SOCKS address a request names,
+// and connecting a stream to it. Literal addresses connect directly, with
+// fast open when asked. Hostnames go through the DNS cache when there is one
+// and race over their addresses, otherwise through the resolver.
+
+// Longest SOCKS address, type, length and port around a 255 byte hostname.
+#define TARGET_ADDR_MAX (1 + 1 + 255 + 2)
+
+struct TargetAddr {
+  unsigned char type;
+  unsigned short port;
+  // NUL terminated for type 3, otherwise the address with its port.
+  char host[256];
+  sockaddr_storage addr;
+  socklen_t addr_len;
+};
+
+enum TargetState {
+  TARGET_CONNECTING = 0,
+  // A lookup or connect race will call back.
+  TARGET_PENDING,
+  TARGET_NO_SUCH_NAME,
+  TARGET_UNRESOLVED,
+};
+
+// The SOCKS address at the front of the `len` bytes at `data`. Returns its
+// length, or 0 with `error` set when it is malformed or cut short.
+size_t target_parse(const unsigned char *data, size_t len, TargetAddr &target,
+                    const char *&error);
+
+// Connects `bev`, made without a socket. A lookup the cache cannot answer at
+// once goes to `resolved`, which passes the answer on to
+// target_connect_answer(); a race goes to `raced`.
+TargetState target_connect(bufferevent *bev, evdns_base *dnsbase,
+                           const TargetAddr &target,
+                           const SessionOptions *options, bool fast_open,
+                           uint64_t &fast_open_key, DnsResolvedFn resolved,
+                           RaceConnectedFn raced, void *ctx);
+// Several addresses race, a single one connects as a literal does.
+TargetState target_connect_answer(bufferevent *bev, const DnsAnswer &answer,
+                                  unsigned short port,
+                                  const SessionOptions *options,
+                                  bool fast_open, uint64_t &fast_open_key,
+                                  RaceConnectedFn raced, void *ctx);
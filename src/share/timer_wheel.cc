@@ -0,0 +1,152 @@
+#include "timer_wheel.h"
+
+#include <chrono>
+
+#include "util.h"
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+struct TimerWheel {
+  TimerNode *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS] = {};
+  TimerExpiredFn expired[TIMER_KINDS] = {};
+  event *tick = nullptr;
+  uint32_t now = 0;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+};
+
+static thread_local TimerWheel timer_wheel;
+
+static inline uint32_t timer_ticks(unsigned int ms) {
+  uint32_t ticks = (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  return ticks ? ticks : 1;
+}
+
+static void timer_link(TimerNode **head, TimerNode *node) {
+  node->timer_next_ = *head;
+  node->timer_pprev_ = head;
+  if (*head) {
+    (*head)->timer_pprev_ = &node->timer_next_;
+  }
+  *head = node;
+}
+
+static void timer_unlink(TimerNode *node) {
+  *node->timer_pprev_ = node->timer_next_;
+  if (node->timer_next_) {
+    node->timer_next_->timer_pprev_ = node->timer_pprev_;
+  }
+  node->timer_next_ = nullptr;
+  node->timer_pprev_ = nullptr;
+}
+
+// The lowest level whose span covers the deadline, in the slot its tick
+// falls on. A node due now can only come down from a higher level, which
+// happens before the current slot runs.
+static void timer_place(TimerWheel &wheel, TimerNode *node) {
+  int32_t delta = (int32_t)(node->timer_expires_ - wheel.now);
+  if (delta <= 0) {
+    timer_link(&wheel.slots[0][wheel.now & TIMER_WHEEL_MASK], node);
+    return;
+  }
+
+  unsigned int level = 0;
+  uint32_t span = TIMER_WHEEL_SLOTS;
+  while (level + 1 < TIMER_WHEEL_LEVELS && (uint32_t)delta >= span) {
+    level += 1;
+    span <<= TIMER_WHEEL_BITS;
+  }
+  if ((uint32_t)delta >= span) {
+    node->timer_expires_ = wheel.now + span - 1;
+  }
+
+  unsigned int slot =
+      (node->timer_expires_ >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  timer_link(&wheel.slots[level][slot], node);
+}
+
+// Empties a slot into a list of its own first, callbacks may cancel or set
+// any node while it is walked. Without `expire` the nodes only move down.
+static void timer_run(TimerWheel &wheel, TimerNode **slot, bool expire) {
+  TimerNode *pending = *slot;
+  *slot = nullptr;
+  if (pending) {
+    pending->timer_pprev_ = &pending;
+  }
+
+  while (pending) {
+    TimerNode *node = pending;
+    timer_unlink(node);
+    if (expire && (int32_t)(node->timer_expires_ - wheel.now) <= 0) {
+      wheel.expired[node->timer_kind_](node);
+    } else {
+      timer_place(wheel, node);
+    }
+  }
+}
+
+// A higher level slot comes up once all levels below it wrapped around, its
+// nodes move down before the current lowest slot runs.
+static void timer_advance(TimerWheel &wheel) {
+  wheel.now += 1;
+  for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+    unsigned int shift = level * TIMER_WHEEL_BITS;
+    if (wheel.now & ((1u << shift) - 1)) break;
+
+    timer_run(wheel, &wheel.slots[level][(wheel.now >> shift) &
+                                         TIMER_WHEEL_MASK],
+              false);
+  }
+  timer_run(wheel, &wheel.slots[0][wheel.now & TIMER_WHEEL_MASK], true);
+}
+
+// Catches up tick by tick when the loop ran late.
+static void OnTimerTick(evutil_socket_t sock, short what, void *ctx) {
+  TimerWheel &wheel = timer_wheel;
+  std::chrono::milliseconds elapsed =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - wheel.start);
+  uint32_t target = (uint32_t)(elapsed.count() / TIMER_WHEEL_TICK_MS);
+  while ((int32_t)(target - wheel.now) > 0) {
+    timer_advance(wheel);
+  }
+}
+
+void timer_wheel_start(event_base *base, TimerExpiredFn expired,
+                       TimerKind kind) {
+  TimerWheel &wheel = timer_wheel;
+  wheel.expired[kind] = expired;
+  if (wheel.tick) return;
+
+  timeval tick = {0, TIMER_WHEEL_TICK_MS * 1000};
+  wheel.tick = event_new(base, -1, EV_PERSIST, OnTimerTick, NULL);
+  if (!wheel.tick) {
+    quit("incredible: event_new error");
+  }
+  event_add(wheel.tick, &tick);
+}
+
+void timer_set(TimerNode *node, unsigned int ms) {
+  TimerWheel &wheel = timer_wheel;
+  if (node->timer_pprev_) {
+    timer_unlink(node);
+  }
+  node->timer_expires_ = wheel.now + timer_ticks(ms);
+  timer_place(wheel, node);
+}
+
+void timer_extend(TimerNode *node, unsigned int ms) {
+  if (node->timer_pprev_) {
+    node->timer_expires_ = timer_wheel.now + timer_ticks(ms);
+  }
+}
+
+void timer_cancel(TimerNode *node) {
+  if (node->timer_pprev_) {
+    timer_unlink(node);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Hierarchical timing wheel for session and UDP mapping deadlines, one per
+// reactor thread and driven by a single libevent timer. Four levels of 64
+// slots, of 100 ms, 6.4 s, 7 min and 7 h each, reach about 19 days.
+// Setting, canceling and moving a deadline unlinks and links one node. A
+// node waiting in a higher level moves down when its slot comes up, so each
+// is touched a few times at most before it expires.
+
+// What a node belongs to, each kind has its own expiry callback.
+enum TimerKind : unsigned char { TIMER_SESSION = 0, TIMER_UDP, TIMER_KINDS };
+
+struct TimerNode {
+  TimerNode *timer_next_ = nullptr;
+  TimerNode **timer_pprev_ = nullptr;
+  uint32_t timer_expires_ = 0;
+  TimerKind timer_kind_ = TIMER_SESSION;
+};
+
+typedef void (*TimerExpiredFn)(TimerNode *node);
+
+// Ticks the wheel of the thread running `base`, calling `expired` for every
+// node of `kind` past its deadline. Called on that thread, once per kind.
+void timer_wheel_start(event_base *base, TimerExpiredFn expired,
+                       TimerKind kind = TIMER_SESSION);
+
+// On the reactor thread. Sets the deadline `ms` from now, replacing any
+// earlier one.
+void timer_set(TimerNode *node, unsigned int ms);
+// Pushes a set deadline to `ms` from now without moving the node, the wheel
+// places it again when its old slot comes up. Cheap enough for every read.
+void timer_extend(TimerNode *node, unsigned int ms);
+void timer_cancel(TimerNode *node);
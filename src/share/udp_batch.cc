@@ -0,0 +1,225 @@
+#include "udp_batch.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <atomic>
+
+#ifdef SYS_LINUX
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
+
+// Segments the kernel takes in one GSO send at most, and their bytes.
+#define UDP_GSO_SEGMENTS 64
+#define UDP_GSO_BYTES 65000
+// Largest segment grouped, what fits a 1500 byte MTU after the IP and UDP
+// headers; the kernel refuses segments the path cannot carry.
+#define UDP_GSO_SEGMENT_V4 1472
+#define UDP_GSO_SEGMENT_V6 1452
+
+static std::atomic<bool> udp_gso{true};
+
+static std::atomic<size_t> udp_received{0};
+static std::atomic<size_t> udp_sent{0};
+static std::atomic<size_t> udp_calls{0};
+static std::atomic<size_t> udp_gso_sends{0};
+static std::atomic<size_t> udp_dropped{0};
+
+UdpBatch::UdpBatch() : packets_(UDP_BATCH) {}
+
+static bool udp_same_peer(const UdpPacket &a, const UdpPacket &b) {
+  return a.addr_len == b.addr_len && memcmp(&a.addr, &b.addr, a.addr_len) == 0;
+}
+
+// A connected socket does not say its family, the smaller size holds there.
+static size_t udp_gso_segment(const UdpPacket &packet) {
+  return packet.addr_len && packet.addr.ss_family == AF_INET
+             ? UDP_GSO_SEGMENT_V4
+             : UDP_GSO_SEGMENT_V6;
+}
+
+#ifdef SYS_LINUX
+
+size_t UdpBatch::Receive(evutil_socket_t sock) {
+  mmsghdr msgs[UDP_BATCH];
+  iovec iovs[UDP_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t i = 0; i < UDP_BATCH; ++i) {
+    iovs[i].iov_base = packets_[i].data;
+    iovs[i].iov_len = UDP_PACKET_MAX;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &packets_[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(packets_[i].addr);
+  }
+
+  int n = recvmmsg(sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+  if (n <= 0) return 0;
+
+  udp_calls += 1;
+  udp_received += n;
+  for (int i = 0; i < n; ++i) {
+    UdpPacket &packet = packets_[i];
+    packet.addr_len = msgs[i].msg_hdr.msg_namelen;
+    packet.len = msgs[i].msg_len;
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      packet.len = 0;
+      udp_dropped += 1;
+    }
+  }
+  return n;
+}
+
+// Runs to one peer whose datagrams all have the size of the first, the last
+// one may be shorter, become a single message with a UDP_SEGMENT size. A run
+// the kernel refuses goes again one datagram at a time, the rest of the batch
+// keeps GSO unless the kernel or device has none at all; then it stays off.
+// A full socket buffer drops the rest.
+void UdpBatch::Flush() {
+  mmsghdr msgs[UDP_BATCH];
+  iovec iovs[UDP_BATCH];
+  size_t firsts[UDP_BATCH];
+  char controls[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  size_t next = 0, plain = 0;
+
+  while (next < count_) {
+    bool gso = udp_gso;
+    size_t count = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t i = next; i < count_; ++count) {
+      size_t j = i + 1, bytes = packets_[i].len;
+      while (gso && i >= plain && j < count_ && j - i < UDP_GSO_SEGMENTS &&
+             packets_[i].len <= udp_gso_segment(packets_[i]) &&
+             udp_same_peer(packets_[i], packets_[j]) &&
+             packets_[j - 1].len == packets_[i].len &&
+             packets_[j].len <= packets_[i].len &&
+             bytes + packets_[j].len <= UDP_GSO_BYTES) {
+        bytes += packets_[j].len;
+        ++j;
+      }
+
+      msghdr &hdr = msgs[count].msg_hdr;
+      for (size_t k = i; k < j; ++k) {
+        iovs[k].iov_base = packets_[k].data;
+        iovs[k].iov_len = packets_[k].len;
+      }
+      hdr.msg_iov = &iovs[i];
+      hdr.msg_iovlen = j - i;
+      if (packets_[i].addr_len) {
+        hdr.msg_name = &packets_[i].addr;
+        hdr.msg_namelen = packets_[i].addr_len;
+      }
+      if (j - i > 1) {
+        hdr.msg_control = controls[count];
+        hdr.msg_controllen = sizeof(controls[count]);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = (uint16_t)packets_[i].len;
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+      }
+      firsts[count] = i;
+      i = j;
+    }
+
+    size_t sent = 0;
+    bool retry = false;
+    while (sent < count) {
+      int n = sendmmsg(sock_, msgs + sent, count - sent, MSG_DONTWAIT);
+      if (n > 0) {
+        udp_calls += 1;
+        for (int k = 0; k < n; ++k) {
+          size_t segments = msgs[sent + k].msg_hdr.msg_iovlen;
+          udp_sent += segments;
+          if (segments > 1) {
+            udp_gso_sends += 1;
+          }
+        }
+        sent += n;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else if (msgs[sent].msg_hdr.msg_iovlen > 1) {
+        if (errno == EIO || errno == ENOPROTOOPT) {
+          udp_gso = false;
+        }
+        plain = firsts[sent] + msgs[sent].msg_hdr.msg_iovlen;
+        retry = true;
+        break;
+      } else {
+        // Only this one failed, say for a peer that went away.
+        udp_dropped += msgs[sent].msg_hdr.msg_iovlen;
+        ++sent;
+      }
+    }
+
+    next = sent < count ? firsts[sent] : count_;
+    if (!retry && sent < count) {
+      udp_dropped += count_ - next;
+      break;
+    }
+  }
+  count_ = 0;
+}
+
+#else
+
+size_t UdpBatch::Receive(evutil_socket_t sock) {
+  size_t n = 0;
+  while (n < UDP_BATCH) {
+    UdpPacket &packet = packets_[n];
+    ev_socklen_t addr_len = sizeof(packet.addr);
+    int len = recvfrom(sock, (char *)packet.data, UDP_PACKET_MAX, 0,
+                       (sockaddr *)&packet.addr, &addr_len);
+    if (len < 0) break;
+    packet.addr_len = addr_len;
+    packet.len = len;
+    ++n;
+  }
+  udp_calls += n;
+  udp_received += n;
+  return n;
+}
+
+void UdpBatch::Flush() {
+  for (size_t i = 0; i < count_; ++i) {
+    UdpPacket &packet = packets_[i];
+    if (sendto(sock_, (const char *)packet.data, (int)packet.len, 0,
+               packet.addr_len ? (const sockaddr *)&packet.addr : NULL,
+               packet.addr_len) < 0) {
+      udp_dropped += count_ - i;
+      break;
+    }
+    udp_calls += 1;
+    udp_sent += 1;
+  }
+  count_ = 0;
+}
+
+#endif
+
+void UdpBatch::Push(evutil_socket_t sock) {
+  if (count_ > 0 && sock != sock_) {
+    UdpPacket last = packets_[count_];
+    Flush();
+    packets_[0] = last;
+  }
+  sock_ = sock;
+  if (++count_ == UDP_BATCH) {
+    Flush();
+  }
+}
+
+void udp_batch_dump(FILE *fp) {
+  size_t received = udp_received, sent = udp_sent;
+  if (!received && !sent) return;
+
+  fprintf(fp,
+          "udp: %zu received, %zu sent, %zu calls, %zu gso sends%s, dropped: "
+          "%zu\n",
+          received, sent, (size_t)udp_calls, (size_t)udp_gso_sends,
+          udp_gso ? "" : " (gso off)", (size_t)udp_dropped);
+}
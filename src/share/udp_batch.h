@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "network.h"
+
+// Datagrams moved UDP_BATCH at a time, with recvmmsg and sendmmsg on Linux
+// and a call per datagram elsewhere. Queued datagrams of one size to one
+// address, each fitting an Ethernet MTU, leave as a single UDP GSO send where
+// the kernel supports it, the
+// kernel splits them again, so a burst toward one peer costs one pass down
+// the stack. A send that would block drops the rest of the batch, as the
+// network would.
+
+#define UDP_BATCH 32
+// Largest datagram relayed, longer ones are dropped.
+#define UDP_PACKET_MAX 8192
+// What a relayed datagram may grow by: a SOCKS address, salt and tag.
+#define UDP_PACKET_ROOM 320
+
+struct UdpPacket {
+  sockaddr_storage addr;
+  // 0 sends on a connected socket.
+  socklen_t addr_len;
+  size_t len;
+  unsigned char data[UDP_PACKET_MAX + UDP_PACKET_ROOM];
+};
+
+class UdpBatch {
+ public:
+  UdpBatch();
+
+  // Reads what `sock` has, at most UDP_BATCH datagrams; one that was too
+  // long comes back empty.
+  size_t Receive(evutil_socket_t sock);
+  UdpPacket &packet(size_t i) { return packets_[i]; }
+
+  // The slot for the next datagram to send, Push queues it once filled.
+  // Queued datagrams go out when the batch is full, the socket changes or
+  // Flush is called.
+  UdpPacket &Next() { return packets_[count_]; }
+  void Push(evutil_socket_t sock);
+  void Flush();
+
+ private:
+  std::vector<UdpPacket> packets_;
+  size_t count_ = 0;
+  evutil_socket_t sock_ = -1;
+};
+
+void udp_batch_dump(FILE *fp);
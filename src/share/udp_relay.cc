@@ -0,0 +1,517 @@
+#include "udp_relay.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <unordered_map>
+
+#include "dns_cache.h"
+#include "remote_set.h"
+#include "timer_wheel.h"
+#include "udp_batch.h"
+#include "user_table.h"
+#include "util.h"
+
+// Kernel buffers of the listen socket, every peer of the reactor shares it,
+// and of the socket of each mapping, which takes a burst of answers.
+#define UDP_SOCKET_BUFFER (4 << 20)
+#define UDP_MAPPING_BUFFER (1 << 20)
+// Longest SOCKS address in front of a datagram, a 255 byte hostname.
+#define UDP_ADDR_MAX (1 + 1 + 255 + 2)
+
+struct UdpRelay;
+
+struct UdpMapping : public TimerNode {
+  UdpRelay *relay;
+  sockaddr_storage peer;
+  socklen_t peer_len;
+  std::string key;
+  // Toward the other side by family, IPv4 first. The client only uses the
+  // first, connected to the remote picked for the peer.
+  evutil_socket_t socks[2] = {-1, -1};
+  event *events[2] = {nullptr, nullptr};
+  int user = UserTable::NONE;
+  // The server waits for a target hostname, with the latest datagram to it.
+  bool resolving = false;
+  std::string held_host;
+  unsigned short held_port = 0;
+  std::string held;
+};
+
+struct UdpRelay {
+  event_base *base;
+  evdns_base *dnsbase;
+  CryptoCreator *creator;
+  const SessionOptions *options;
+  evutil_socket_t sock;
+  event *received;
+  event_callback_fn replied;
+  // By peer address and port.
+  std::unordered_map<std::string, UdpMapping *> mappings;
+};
+
+static thread_local UdpBatch *udp_in = nullptr;
+static thread_local UdpBatch *udp_out = nullptr;
+
+static std::atomic<size_t> udp_mappings{0};
+static std::atomic<size_t> udp_expired{0};
+static std::atomic<size_t> udp_forwarded{0};
+static std::atomic<size_t> udp_replied{0};
+static std::atomic<size_t> udp_rejected{0};
+static std::atomic<size_t> udp_unresolved{0};
+
+static socklen_t udp_addr_len(const sockaddr_storage &addr) {
+  return addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                    : sizeof(sockaddr_in);
+}
+
+static std::string udp_key(const sockaddr_storage &addr) {
+  std::string key;
+  if (addr.ss_family == AF_INET6) {
+    const sockaddr_in6 *sin6 = (const sockaddr_in6 *)&addr;
+    key.assign((const char *)&sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    key.append((const char *)&sin6->sin6_port, sizeof(sin6->sin6_port));
+  } else {
+    const sockaddr_in *sin = (const sockaddr_in *)&addr;
+    key.assign((const char *)&sin->sin_addr, sizeof(sin->sin_addr));
+    key.append((const char *)&sin->sin_port, sizeof(sin->sin_port));
+  }
+  return key;
+}
+
+static evutil_socket_t udp_socket(int family, int buffer) {
+  evutil_socket_t sock = socket(family, SOCK_DGRAM, 0);
+  if (sock < 0) return -1;
+  evutil_make_socket_nonblocking(sock);
+  evutil_make_socket_closeonexec(sock);
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char *)&buffer,
+             sizeof(buffer));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&buffer,
+             sizeof(buffer));
+  return sock;
+}
+
+// The SOCKS address in front of `data`, a literal into `addr` or a hostname
+// into `host`. Its length, 0 when malformed.
+static size_t udp_parse_addr(const unsigned char *data, size_t len,
+                             sockaddr_storage &addr, std::string &host,
+                             unsigned short &port) {
+  size_t addr_size;
+  if (len < 1) return 0;
+  switch (data[0]) {
+    case 1:
+      addr_size = 4;
+      break;
+    case 3:
+      if (len < 2 || !data[1]) return 0;
+      addr_size = 1 + data[1];
+      break;
+    case 4:
+      addr_size = 16;
+      break;
+    default:
+      return 0;
+  }
+  if (len < 1 + addr_size + 2) return 0;
+
+  memcpy(&port, data + 1 + addr_size, 2);
+  memset(&addr, 0, sizeof(addr));
+  host.clear();
+  if (data[0] == 1) {
+    sockaddr_in *sin = (sockaddr_in *)&addr;
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, data + 1, 4);
+    sin->sin_port = port;
+  } else if (data[0] == 4) {
+    sockaddr_in6 *sin6 = (sockaddr_in6 *)&addr;
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_addr, data + 1, 16);
+    sin6->sin6_port = port;
+  } else {
+    host.assign((const char *)data + 2, data[1]);
+  }
+  port = ntohs(port);
+  return 1 + addr_size + 2;
+}
+
+// Writes the SOCKS address of `addr` to `out`, returns its length.
+static size_t udp_write_addr(const sockaddr_storage &addr, unsigned char *out) {
+  if (addr.ss_family == AF_INET6) {
+    const sockaddr_in6 *sin6 = (const sockaddr_in6 *)&addr;
+    out[0] = 4;
+    memcpy(out + 1, &sin6->sin6_addr, 16);
+    memcpy(out + 17, &sin6->sin6_port, 2);
+    return 19;
+  }
+  const sockaddr_in *sin = (const sockaddr_in *)&addr;
+  out[0] = 1;
+  memcpy(out + 1, &sin->sin_addr, 4);
+  memcpy(out + 5, &sin->sin_port, 2);
+  return 7;
+}
+
+static UdpMapping *udp_find(UdpRelay *relay, const sockaddr_storage &peer) {
+  auto it = relay->mappings.find(udp_key(peer));
+  return it == relay->mappings.end() ? nullptr : it->second;
+}
+
+static UdpMapping *udp_add(UdpRelay *relay, const UdpPacket &packet) {
+  UdpMapping *mapping = new UdpMapping();
+  mapping->timer_kind_ = TIMER_UDP;
+  mapping->relay = relay;
+  mapping->peer = packet.addr;
+  mapping->peer_len = packet.addr_len;
+  mapping->key = udp_key(packet.addr);
+  relay->mappings[mapping->key] = mapping;
+  udp_mappings += 1;
+  timer_set(mapping, relay->options->udp_timeout * 1000);
+  return mapping;
+}
+
+static void udp_free(UdpMapping *mapping) {
+  mapping->relay->mappings.erase(mapping->key);
+  timer_cancel(mapping);
+  if (mapping->resolving) {
+    dns_cancel(mapping);
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (mapping->socks[i] >= 0) {
+      event_free(mapping->events[i]);
+      evutil_closesocket(mapping->socks[i]);
+    }
+  }
+  delete mapping;
+  udp_mappings -= 1;
+}
+
+static void OnUdpExpired(TimerNode *node) {
+  udp_expired += 1;
+  udp_free(static_cast<UdpMapping *>(node));
+}
+
+// The socket of `mapping` in slot `index`, opened for `family` on first use
+// and connected to `to` when given. -1 when it cannot be.
+static evutil_socket_t udp_side(UdpMapping *mapping, int index, int family,
+                                const sockaddr_storage *to) {
+  if (mapping->socks[index] >= 0) return mapping->socks[index];
+
+  evutil_socket_t sock = udp_socket(family, UDP_MAPPING_BUFFER);
+  if (sock < 0) return -1;
+  if (to && connect(sock, (const sockaddr *)to, udp_addr_len(*to))) {
+    evutil_closesocket(sock);
+    return -1;
+  }
+  event *ev = event_new(mapping->relay->base, sock, EV_READ | EV_PERSIST,
+                        mapping->relay->replied, mapping);
+  if (!ev) {
+    quit("incredible: event_new error");
+  }
+  event_add(ev, NULL);
+  mapping->socks[index] = sock;
+  mapping->events[index] = ev;
+  return sock;
+}
+
+static void udp_forward(UdpMapping *mapping, const sockaddr_storage &target,
+                        const unsigned char *data, size_t len) {
+  evutil_socket_t sock = udp_side(mapping, target.ss_family == AF_INET6,
+                                  target.ss_family, nullptr);
+  if (sock < 0) {
+    udp_rejected += 1;
+    return;
+  }
+  UdpPacket &out = udp_out->Next();
+  out.addr = target;
+  out.addr_len = udp_addr_len(target);
+  memcpy(out.data, data, len);
+  out.len = len;
+  udp_out->Push(sock);
+  udp_forwarded += 1;
+}
+
+// IPv4 first, as the targets of a name mostly answer on it.
+static void udp_forward_answer(UdpMapping *mapping, const DnsAnswer &answer,
+                               unsigned short port, const unsigned char *data,
+                               size_t len) {
+  sockaddr_storage target;
+  memset(&target, 0, sizeof(target));
+  if (!answer.ipv4.empty()) {
+    sockaddr_in *sin = (sockaddr_in *)&target;
+    sin->sin_family = AF_INET;
+    sin->sin_addr = answer.ipv4[0];
+    sin->sin_port = htons(port);
+  } else if (!answer.ipv6.empty()) {
+    sockaddr_in6 *sin6 = (sockaddr_in6 *)&target;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = answer.ipv6[0];
+    sin6->sin6_port = htons(port);
+  } else {
+    udp_unresolved += 1;
+    return;
+  }
+  udp_forward(mapping, target, data, len);
+}
+
+static void OnUdpResolved(void *ctx, const DnsAnswer &answer) {
+  UdpMapping *mapping = (UdpMapping *)ctx;
+  mapping->resolving = false;
+  udp_forward_answer(mapping, answer, mapping->held_port,
+                     (const unsigned char *)mapping->held.data(),
+                     mapping->held.size());
+  mapping->held.clear();
+  udp_out->Flush();
+}
+
+// While a lookup runs, only the latest datagram to its name is kept.
+static void udp_resolve(UdpMapping *mapping, const std::string &host,
+                        unsigned short port, const unsigned char *data,
+                        size_t len) {
+  UdpRelay *relay = mapping->relay;
+  if (!relay->options->dns_cache ||
+      (mapping->resolving && mapping->held_host != host)) {
+    udp_unresolved += 1;
+    return;
+  }
+  if (!mapping->resolving) {
+    DnsAnswerPtr answer = dns_resolve(relay->base, relay->dnsbase,
+                                      host.c_str(), OnUdpResolved, mapping);
+    if (answer) {
+      udp_forward_answer(mapping, *answer, port, data, len);
+      return;
+    }
+    mapping->resolving = true;
+    mapping->held_host = host;
+  }
+  mapping->held_port = port;
+  mapping->held.assign((const char *)data, len);
+}
+
+// From clients: opens each datagram and sends its data to the target.
+static void OnUdpServerRead(evutil_socket_t sock, short what, void *ctx) {
+  UdpRelay *relay = (UdpRelay *)ctx;
+  unsigned char plain[UDP_PACKET_MAX];
+  sockaddr_storage target;
+  std::string host;
+  unsigned short port;
+
+  size_t count = udp_in->Receive(sock);
+  for (size_t i = 0; i < count; ++i) {
+    UdpPacket &packet = udp_in->packet(i);
+    if (!packet.len) continue;
+
+    UdpMapping *mapping = udp_find(relay, packet.addr);
+    int user = mapping ? mapping->user : UserTable::NONE;
+    int len = relay->creator->OpenPacket(
+        packet.data, packet.len, plain,
+        UserTable::PeerKey((sockaddr *)&packet.addr), user);
+    size_t header =
+        len < 0 ? 0 : udp_parse_addr(plain, len, target, host, port);
+    if (!header) {
+      udp_rejected += 1;
+      continue;
+    }
+
+    if (!mapping) {
+      mapping = udp_add(relay, packet);
+    } else {
+      timer_extend(mapping, relay->options->udp_timeout * 1000);
+    }
+    mapping->user = user;
+    if (!host.empty()) {
+      udp_resolve(mapping, host, port, plain + header, len - header);
+    } else {
+      udp_forward(mapping, target, plain + header, len - header);
+    }
+  }
+  udp_out->Flush();
+}
+
+// From targets: seals each answer with its source toward the client.
+static void OnUdpServerReply(evutil_socket_t sock, short what, void *ctx) {
+  UdpMapping *mapping = (UdpMapping *)ctx;
+  UdpRelay *relay = mapping->relay;
+  unsigned char plain[UDP_ADDR_MAX + UDP_PACKET_MAX];
+
+  size_t count = udp_in->Receive(sock);
+  for (size_t i = 0; i < count; ++i) {
+    UdpPacket &packet = udp_in->packet(i);
+    if (!packet.len) continue;
+
+    size_t header = udp_write_addr(packet.addr, plain);
+    memcpy(plain + header, packet.data, packet.len);
+    UdpPacket &out = udp_out->Next();
+    int len = relay->creator->SealPacket(plain, header + packet.len, out.data,
+                                         mapping->user);
+    if (len < 0) continue;
+    out.len = len;
+    out.addr = mapping->peer;
+    out.addr_len = mapping->peer_len;
+    udp_out->Push(relay->sock);
+    udp_replied += 1;
+  }
+  if (count) {
+    timer_extend(mapping, relay->options->udp_timeout * 1000);
+  }
+  udp_out->Flush();
+}
+
+// From local applications: seals each SOCKS5 UDP request toward the remote,
+// fragments are not supported.
+static void OnUdpClientRead(evutil_socket_t sock, short what, void *ctx) {
+  UdpRelay *relay = (UdpRelay *)ctx;
+
+  size_t count = udp_in->Receive(sock);
+  for (size_t i = 0; i < count; ++i) {
+    UdpPacket &packet = udp_in->packet(i);
+    if (packet.len < 4 || packet.data[2]) {
+      udp_rejected += 1;
+      continue;
+    }
+
+    UdpMapping *mapping = udp_find(relay, packet.addr);
+    if (!mapping) {
+      mapping = udp_add(relay, packet);
+      const sockaddr_storage *remote = remote_addr(remote_preferred());
+      udp_side(mapping, 0, remote->ss_family, remote);
+    } else {
+      timer_extend(mapping, relay->options->udp_timeout * 1000);
+    }
+    if (mapping->socks[0] < 0) {
+      udp_rejected += 1;
+      continue;
+    }
+
+    UdpPacket &out = udp_out->Next();
+    int len = relay->creator->SealPacket(packet.data + 3, packet.len - 3,
+                                         out.data, UserTable::NONE);
+    if (len < 0) continue;
+    out.len = len;
+    out.addr_len = 0;
+    udp_out->Push(mapping->socks[0]);
+    udp_forwarded += 1;
+  }
+  udp_out->Flush();
+}
+
+// From the remote: opens each answer toward the application as a SOCKS5
+// UDP reply.
+static void OnUdpClientReply(evutil_socket_t sock, short what, void *ctx) {
+  UdpMapping *mapping = (UdpMapping *)ctx;
+  UdpRelay *relay = mapping->relay;
+
+  size_t count = udp_in->Receive(sock);
+  for (size_t i = 0; i < count; ++i) {
+    UdpPacket &packet = udp_in->packet(i);
+    if (!packet.len) continue;
+
+    UdpPacket &out = udp_out->Next();
+    int user = UserTable::NONE;
+    int len = relay->creator->OpenPacket(packet.data, packet.len, out.data + 3,
+                                         0, user);
+    if (len < 0) {
+      udp_rejected += 1;
+      continue;
+    }
+    memset(out.data, 0, 3);
+    out.len = len + 3;
+    out.addr = mapping->peer;
+    out.addr_len = mapping->peer_len;
+    udp_out->Push(relay->sock);
+    udp_replied += 1;
+  }
+  if (count) {
+    timer_extend(mapping, relay->options->udp_timeout * 1000);
+  }
+  udp_out->Flush();
+}
+
+// The batches and the timing wheel belong to the reactor thread, set up
+// once its loop runs.
+static void OnUdpStarted(evutil_socket_t sock, short what, void *ctx) {
+  UdpRelay *relay = (UdpRelay *)ctx;
+  udp_in = new UdpBatch();
+  udp_out = new UdpBatch();
+  timer_wheel_start(relay->base, OnUdpExpired, TIMER_UDP);
+  event_add(relay->received, NULL);
+}
+
+static bool udp_relay_start(UdpRelay *relay, unsigned short port,
+                            event_callback_fn received, std::string &error) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  sin.sin_port = htons(port);
+
+  evutil_socket_t sock = udp_socket(AF_INET, UDP_SOCKET_BUFFER);
+  if (sock < 0) {
+    error = "udp socket error";
+    return false;
+  }
+  evutil_make_listen_socket_reuseable(sock);
+  if (relay->options->threads > 1) {
+    evutil_make_listen_socket_reuseable_port(sock);
+  }
+  if (bind(sock, (const sockaddr *)&sin, sizeof(sin))) {
+    evutil_closesocket(sock);
+    error = "bad udp bind on port: " + std::to_string(port);
+    return false;
+  }
+
+  relay->sock = sock;
+  relay->received =
+      event_new(relay->base, sock, EV_READ | EV_PERSIST, received, relay);
+  if (!relay->received) {
+    quit("incredible: event_new error");
+  }
+  event_base_once(relay->base, -1, EV_TIMEOUT, OnUdpStarted, relay, NULL);
+  return true;
+}
+
+static UdpRelay *udp_relay_new(event_base *base, CryptoCreator *creator,
+                               const SessionOptions *options) {
+  UdpRelay *relay = new UdpRelay();
+  relay->base = base;
+  relay->dnsbase = nullptr;
+  relay->creator = creator;
+  relay->options = options;
+  relay->sock = -1;
+  return relay;
+}
+
+bool udp_relay_client(event_base *base, unsigned short port,
+                      CryptoCreator *creator, const SessionOptions *options,
+                      std::string &error) {
+  UdpRelay *relay = udp_relay_new(base, creator, options);
+  relay->replied = OnUdpClientReply;
+  if (!udp_relay_start(relay, port, OnUdpClientRead, error)) {
+    delete relay;
+    return false;
+  }
+  return true;
+}
+
+bool udp_relay_server(event_base *base, evdns_base *dnsbase,
+                      unsigned short port, CryptoCreator *creator,
+                      const SessionOptions *options, std::string &error) {
+  UdpRelay *relay = udp_relay_new(base, creator, options);
+  relay->dnsbase = dnsbase;
+  relay->replied = OnUdpServerReply;
+  if (!udp_relay_start(relay, port, OnUdpServerRead, error)) {
+    delete relay;
+    return false;
+  }
+  return true;
+}
+
+void udp_relay_dump(FILE *fp) {
+  size_t forwarded = udp_forwarded, replied = udp_replied;
+  if (!forwarded && !replied && !udp_mappings && !udp_rejected) return;
+
+  fprintf(fp,
+          "udp relay: %zu mappings, forwarded: %zu, replied: %zu, expired: "
+          "%zu, rejected: %zu, unresolved: %zu\n",
+          (size_t)udp_mappings, forwarded, replied, (size_t)udp_expired,
+          (size_t)udp_rejected, (size_t)udp_unresolved);
+  udp_batch_dump(fp);
+}
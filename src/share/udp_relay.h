@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <string>
+
+#include "crypto.h"
+#include "network.h"
+#include "options.h"
+
+// Shadowsocks UDP on the TCP listen port, one socket per reactor, spread by
+// SO_REUSEPORT so a peer stays on one reactor. Each peer address gets a
+// mapping in a per reactor hash table, with its own socket toward the other
+// side so the answers find their way back, and the timing wheel drops it
+// after the UDP timeout without datagrams. The client takes SOCKS5 UDP
+// requests from local applications and seals their payload to the best
+// remote; the server opens them, sends the data to the target named inside
+// and seals the answers back with the address they came from. Datagrams
+// move in batches, see udp_batch.h.
+
+// Start the relay of the reactor running `base`, false when the port cannot
+// be bound. The server resolves target hostnames through the DNS cache and
+// drops them without one.
+bool udp_relay_client(event_base *base, unsigned short port,
+                      CryptoCreator *creator, const SessionOptions *options,
+                      std::string &error);
+bool udp_relay_server(event_base *base, evdns_base *dnsbase,
+                      unsigned short port, CryptoCreator *creator,
+                      const SessionOptions *options, std::string &error);
+
+void udp_relay_dump(FILE *fp);
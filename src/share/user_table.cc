@@ -0,0 +1,204 @@
+#include "user_table.h"
+
+#include <string.h>
+
+#include <system_error>
+#include <thread>
+
+#include "crypto.h"
+
+// Past this many source addresses the cache starts over.
+#define USER_PEER_CACHE_MAX 65536
+// Trials a second for sources no candidate matched.
+#define USER_SCAN_TRIALS (64 * 1024)
+
+UserTable::UserTable() {}
+
+UserTable::~UserTable() {}
+
+bool UserTable::Load(const char *path, std::string &error) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    error = std::string("bad users file: ") + path;
+    return false;
+  }
+
+  char line[1024];
+  unsigned int line_no = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    ++line_no;
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' ' || line[len - 1] == '\t')) {
+      line[--len] = 0;
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+
+    char *sep = strchr(line, ':');
+    if (!sep || sep == line || sep[1] == 0) {
+      error = std::string("bad users file: ") + path + ", line " +
+              std::to_string(line_no);
+      fclose(fp);
+      return false;
+    }
+
+    *sep = 0;
+    Add(line, sep + 1);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+void UserTable::Add(const std::string &name, const std::string &password) {
+  std::unique_ptr<User> user(new User());
+  user->name = name;
+  user->password = password;
+  memset(user->key, 0, sizeof(user->key));
+  users_.push_back(std::move(user));
+}
+
+void UserTable::DeriveKeys(unsigned int key_size, unsigned int threads) {
+  auto derive = [this, key_size](size_t first, size_t last) {
+    for (size_t i = first; i < last; ++i) {
+      User *user = users_[i].get();
+      Crypto::HKEY_MD5(user->password.c_str(), user->key, key_size);
+    }
+  };
+
+  size_t count = users_.size();
+  if (threads > count) threads = count;
+
+  std::vector<std::thread> workers;
+  size_t first = 0, last;
+  for (unsigned int i = 1; i < threads; ++i) {
+    last = count * i / threads;
+    try {
+      workers.emplace_back(derive, first, last);
+    } catch (const std::system_error &) {
+      break;
+    }
+    first = last;
+  }
+  derive(first, count);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  for (std::unique_ptr<User> &user : users_) {
+    sodium_memzero(&user->password[0], user->password.size());
+    user->password.clear();
+  }
+}
+
+uint64_t UserTable::PeerKey(const sockaddr *addr) {
+  if (!addr) {
+    return 0;
+  }
+
+  if (addr->sa_family == AF_INET) {
+    const sockaddr_in *sin = (const sockaddr_in *)addr;
+    return ((uint64_t)AF_INET << 32) | sin->sin_addr.s_addr;
+  }
+
+  if (addr->sa_family == AF_INET6) {
+    const sockaddr_in6 *sin6 = (const sockaddr_in6 *)addr;
+    uint64_t words[2];
+    memcpy(words, &sin6->sin6_addr, sizeof(words));
+    return (words[0] * 0x9E3779B97F4A7C15ULL) ^ words[1];
+  }
+
+  return 0;
+}
+
+size_t UserTable::Candidates(uint64_t peer, int *out) {
+  size_t count = 0;
+  std::lock_guard<std::mutex> guard(lock_);
+
+  if (peer) {
+    auto it = peers_.find(peer);
+    if (it != peers_.end()) {
+      out[count++] = it->second;
+    }
+  }
+
+  for (size_t i = 0; i < recent_count_; ++i) {
+    if (count == 0 || recent_[i] != out[0]) {
+      out[count++] = recent_[i];
+    }
+  }
+  return count;
+}
+
+void UserTable::Identified(uint64_t peer, int user, unsigned int trials) {
+  trials_.fetch_add(trials, std::memory_order_relaxed);
+  if (user == NONE) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  identified_.fetch_add(1, std::memory_order_relaxed);
+  users_[user]->sessions.fetch_add(1, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> guard(lock_);
+  if (peer) {
+    if (peers_.size() >= USER_PEER_CACHE_MAX) {
+      peers_.clear();
+    }
+    peers_[peer] = user;
+  }
+
+  // Move to front, the least recent one falls off.
+  size_t i = 0;
+  while (i < recent_count_ && recent_[i] != user) ++i;
+  if (i == recent_count_) {
+    if (recent_count_ < RECENT_COUNT) ++recent_count_;
+    i = recent_count_ - 1;
+  }
+  for (; i > 0; --i) {
+    recent_[i] = recent_[i - 1];
+  }
+  recent_[0] = user;
+}
+
+bool UserTable::AllowScan(size_t trials) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> guard(lock_);
+  if (now - scan_second_ >= std::chrono::seconds(1)) {
+    scan_second_ = now;
+    scan_trials_ = 0;
+  }
+  if (scan_trials_ + trials > USER_SCAN_TRIALS) {
+    throttled_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  scan_trials_ += trials;
+  return true;
+}
+
+void UserTable::AddBytes(int user, uint64_t up, uint64_t down) {
+  User *entry = users_[user].get();
+  if (up) entry->bytes_up.fetch_add(up, std::memory_order_relaxed);
+  if (down) entry->bytes_down.fetch_add(down, std::memory_order_relaxed);
+}
+
+void UserTable::Dump(FILE *fp) {
+  uint64_t identified = identified_, trials = trials_, misses = misses_;
+  fprintf(fp,
+          "users: %zu, %llu sessions identified, %llu unknown, "
+          "%.2f trials each, %llu scans throttled\n",
+          users_.size(), (unsigned long long)identified,
+          (unsigned long long)misses,
+          identified + misses ? (double)trials / (identified + misses) : 0.0,
+          (unsigned long long)throttled_.load());
+
+  for (const std::unique_ptr<User> &user : users_) {
+    if (user->sessions == 0) continue;
+    fprintf(fp, "user %s: %llu sessions, %llu bytes up, %llu bytes down\n",
+            user->name.c_str(), (unsigned long long)user->sessions.load(),
+            (unsigned long long)user->bytes_up.load(),
+            (unsigned long long)user->bytes_down.load());
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "crypto_cipher.h"
+
+// Users sharing one port, told apart by which master key opens the first
+// AEAD length block of a session. Trials are ordered so the common case
+// costs one: the user last identified from the same source address, then
+// the users identified most recently, then everybody else.
+class UserTable {
+ public:
+  enum { NONE = -1 };
+
+  UserTable();
+  ~UserTable();
+
+  // Reads `name:password` lines, blank lines and lines starting with '#'
+  // are skipped.
+  bool Load(const char *path, std::string &error);
+  void Add(const std::string &name, const std::string &password);
+
+  // Derives every master key with HKEY_MD5, split over `threads` threads,
+  // and forgets the passwords.
+  void DeriveKeys(unsigned int key_size, unsigned int threads);
+
+  size_t size() const { return users_.size(); }
+  const unsigned char *key(int user) const { return users_[user]->key; }
+
+  // Source address of a session, the port is left out.
+  static uint64_t PeerKey(const sockaddr *addr);
+
+  // Fills `out` with the users to try first, at most RECENT_COUNT + 1.
+  size_t Candidates(uint64_t peer, int *out);
+  // Records the outcome of an identification that took `trials` trials,
+  // `user` is NONE when no key matched.
+  void Identified(uint64_t peer, int user, unsigned int trials);
+  // Whether `trials` more trials may go to a source no candidate matched.
+  // Such full scans share a budget per second, so junk datagrams cannot
+  // cost a key derivation per user each.
+  bool AllowScan(size_t trials);
+
+  void AddBytes(int user, uint64_t up, uint64_t down);
+  void Dump(FILE *fp);
+
+  enum { RECENT_COUNT = 8 };
+
+ private:
+  struct User {
+    std::string name;
+    std::string password;
+    unsigned char key[CIPHER_MAX_KEY_SIZE];
+    std::atomic<uint64_t> sessions{0};
+    std::atomic<uint64_t> bytes_up{0};
+    std::atomic<uint64_t> bytes_down{0};
+  };
+
+  std::vector<std::unique_ptr<User>> users_;
+
+  std::mutex lock_;
+  std::unordered_map<uint64_t, int> peers_;
+  int recent_[RECENT_COUNT];
+  size_t recent_count_ = 0;
+  std::chrono::steady_clock::time_point scan_second_;
+  size_t scan_trials_ = 0;
+
+  std::atomic<uint64_t> identified_{0};
+  std::atomic<uint64_t> trials_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> throttled_{0};
+};
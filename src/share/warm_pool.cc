@@ -0,0 +1,219 @@
+#include "warm_pool.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "util.h"
+
+#define WARM_POOL_TICK_MS 1000
+// Share of the last tick in the smoothed take rate.
+#define WARM_POOL_RATE_WEIGHT 0.25
+// Seconds of takes at that rate the pool holds, at least one socket.
+#define WARM_POOL_HORIZON 2
+
+typedef std::chrono::steady_clock WarmClock;
+
+struct WarmPool;
+
+struct WarmSocket {
+  WarmPool *pool;
+  evutil_socket_t sock;
+  event *ev = nullptr;
+  WarmClock::time_point born;
+};
+
+struct WarmPool {
+  event_base *base;
+  const sockaddr_storage *addr;
+  unsigned int max;
+  std::chrono::seconds max_age;
+  // Connected ones oldest first, taken from the front.
+  std::vector<WarmSocket *> ready;
+  std::vector<WarmSocket *> connecting;
+  unsigned int takes = 0;
+  double rate = 0;
+  // A connect failed since the last tick, refills wait for the next one.
+  bool failing = false;
+};
+
+static thread_local std::vector<WarmPool *> warm_pools;
+
+static std::atomic<size_t> warm_ready{0};
+static std::atomic<size_t> warm_hits{0};
+static std::atomic<size_t> warm_misses{0};
+static std::atomic<size_t> warm_opened{0};
+static std::atomic<size_t> warm_aged{0};
+static std::atomic<size_t> warm_dropped{0};
+static std::atomic<size_t> warm_failed{0};
+
+static void OnWarmConnected(evutil_socket_t sock, short what, void *ctx);
+static void OnWarmClosed(evutil_socket_t sock, short what, void *ctx);
+
+static socklen_t warm_addr_len(const sockaddr_storage *addr) {
+  return addr->ss_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                     : sizeof(sockaddr_in);
+}
+
+static void warm_remove(std::vector<WarmSocket *> &list, WarmSocket *warm) {
+  list.erase(std::find(list.begin(), list.end(), warm));
+}
+
+static void warm_free(WarmSocket *warm, bool close) {
+  event_free(warm->ev);
+  if (close) {
+    evutil_closesocket(warm->sock);
+  }
+  delete warm;
+}
+
+static unsigned int warm_wanted(WarmPool *pool) {
+  unsigned int wanted = (unsigned int)ceil(pool->rate * WARM_POOL_HORIZON);
+  return std::min(std::max(wanted, 1u), pool->max);
+}
+
+static void warm_refill(WarmPool *pool) {
+  while (!pool->failing &&
+         pool->ready.size() + pool->connecting.size() < warm_wanted(pool)) {
+    evutil_socket_t sock = socket_connect_start(
+        (const sockaddr *)pool->addr, warm_addr_len(pool->addr));
+    if (sock < 0) {
+      warm_failed += 1;
+      pool->failing = true;
+      return;
+    }
+
+    WarmSocket *warm = new WarmSocket();
+    warm->pool = pool;
+    warm->sock = sock;
+    warm->ev = event_new(pool->base, sock, EV_WRITE, OnWarmConnected, warm);
+    if (!warm->ev) {
+      quit("incredible: event_new error");
+    }
+    event_add(warm->ev, NULL);
+    pool->connecting.push_back(warm);
+  }
+}
+
+// The socket then waits for reads, which only come when the server closed
+// it.
+static void OnWarmConnected(evutil_socket_t sock, short what, void *ctx) {
+  WarmSocket *warm = (WarmSocket *)ctx;
+  WarmPool *pool = warm->pool;
+  warm_remove(pool->connecting, warm);
+
+  if (!socket_connect_done(sock)) {
+    warm_free(warm, true);
+    warm_failed += 1;
+    pool->failing = true;
+    return;
+  }
+
+  event_free(warm->ev);
+  warm->ev = event_new(pool->base, sock, EV_READ, OnWarmClosed, warm);
+  if (!warm->ev) {
+    quit("incredible: event_new error");
+  }
+  event_add(warm->ev, NULL);
+  warm->born = WarmClock::now();
+  pool->ready.push_back(warm);
+  warm_ready += 1;
+  warm_opened += 1;
+}
+
+static void OnWarmClosed(evutil_socket_t sock, short what, void *ctx) {
+  WarmSocket *warm = (WarmSocket *)ctx;
+  WarmPool *pool = warm->pool;
+  warm_remove(pool->ready, warm);
+  warm_free(warm, true);
+  warm_ready -= 1;
+  warm_dropped += 1;
+  warm_refill(pool);
+}
+
+// Smooths the take rate, replaces the sockets past their age and tops up.
+static void OnWarmTick(evutil_socket_t sock, short what, void *ctx) {
+  WarmPool *pool = (WarmPool *)ctx;
+  pool->rate = pool->rate * (1 - WARM_POOL_RATE_WEIGHT) +
+               pool->takes * WARM_POOL_RATE_WEIGHT * 1000 / WARM_POOL_TICK_MS;
+  pool->takes = 0;
+  pool->failing = false;
+
+  WarmClock::time_point expired = WarmClock::now() - pool->max_age;
+  size_t aged = 0;
+  while (aged < pool->ready.size() && pool->ready[aged]->born <= expired) {
+    warm_free(pool->ready[aged], true);
+    ++aged;
+  }
+  pool->ready.erase(pool->ready.begin(), pool->ready.begin() + aged);
+  warm_ready -= aged;
+  warm_aged += aged;
+
+  // Beyond what the rate asks for, the oldest go too.
+  size_t wanted = warm_wanted(pool);
+  while (pool->ready.size() > wanted) {
+    warm_free(pool->ready.front(), true);
+    pool->ready.erase(pool->ready.begin());
+    warm_ready -= 1;
+    warm_aged += 1;
+  }
+  warm_refill(pool);
+}
+
+void warm_pool_start(event_base *base, const sockaddr_storage *addr,
+                     unsigned int max, unsigned int max_age) {
+  WarmPool *pool = new WarmPool();
+  pool->base = base;
+  pool->addr = addr;
+  pool->max = max;
+  pool->max_age = std::chrono::seconds(max_age);
+  warm_pools.push_back(pool);
+
+  timeval tick = {0, WARM_POOL_TICK_MS * 1000};
+  event *timer = event_new(base, -1, EV_PERSIST, OnWarmTick, pool);
+  if (!timer) {
+    quit("incredible: event_new error");
+  }
+  event_add(timer, &tick);
+  warm_refill(pool);
+}
+
+evutil_socket_t warm_pool_take(const sockaddr_storage *addr) {
+  WarmPool *pool = nullptr;
+  for (WarmPool *candidate : warm_pools) {
+    if (candidate->addr == addr) {
+      pool = candidate;
+      break;
+    }
+  }
+  if (!pool) return -1;
+
+  pool->takes += 1;
+  evutil_socket_t sock = -1;
+  if (!pool->ready.empty()) {
+    WarmSocket *warm = pool->ready.front();
+    pool->ready.erase(pool->ready.begin());
+    sock = warm->sock;
+    warm_free(warm, false);
+    warm_ready -= 1;
+    warm_hits += 1;
+  } else {
+    warm_misses += 1;
+  }
+  warm_refill(pool);
+  return sock;
+}
+
+void warm_pool_dump(FILE *fp) {
+  size_t hits = warm_hits, misses = warm_misses;
+  if (!hits && !misses && !warm_opened) return;
+
+  fprintf(fp,
+          "warm pool: %zu ready, hits: %zu, misses: %zu, opened: %zu, aged "
+          "out: %zu, closed by peer: %zu, failed: %zu\n",
+          (size_t)warm_ready, hits, misses, (size_t)warm_opened,
+          (size_t)warm_aged, (size_t)warm_dropped, (size_t)warm_failed);
+}
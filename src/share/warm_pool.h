@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "network.h"
+
+// Connections to the remote opened ahead of the sessions that need them, one
+// pool per remote on each reactor. A session takes a connected socket and
+// sends its salt and header at once instead of waiting for the handshake of
+// a new one. The pool refills in the background and follows the rate
+// sessions took sockets at lately, up to its maximum. Sockets older than the
+// age limit are replaced before the server gives up on them, and ones the
+// server closed are dropped.
+
+// Starts the pool for `addr` on the thread running `base`, keeping up to
+// `max` sockets no older than `max_age` seconds.
+void warm_pool_start(event_base *base, const sockaddr_storage *addr,
+                     unsigned int max, unsigned int max_age);
+
+// On the reactor thread. A connected socket to `addr` that the caller now
+// owns, or -1 when none is ready.
+evutil_socket_t warm_pool_take(const sockaddr_storage *addr);
+
+void warm_pool_dump(FILE *fp);
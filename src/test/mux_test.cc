@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "../share/io_stream.h"
+#include "../share/mempool.h"
+#include "../share/mux.h"
+#include "../share/util.h"
+
+// A client and a server mux in one process, their tunnel relayed with the
+// small window a session would keep, carrying one stream to an echo target.
+// The application writes and reads at once, so both directions of the
+// stream run out of credit over and over; the transfer has to finish.
+
+#define TEST_TOTAL (20 * 1024 * 1024)
+#define TEST_WINDOW (16 * 1024)
+#define TEST_TIMEOUT 20
+// The application stops reading for a moment after each burst, so the
+// echo backs up and the credit runs out in both directions.
+#define TEST_BURST (256 * 1024)
+
+// The two tunnel ends. The client end starts with the tunnel request,
+// which a server session takes before handing the tunnel over.
+struct TestRelay {
+  bufferevent *client = nullptr;
+  bufferevent *server = nullptr;
+  size_t header = MUX_HEADER_SIZE;
+};
+
+struct MuxTest {
+  event_base *base;
+  SessionOptions options;
+  TestRelay relay;
+  bufferevent *app = nullptr;
+  size_t sent = 0;
+  size_t received = 0;
+  size_t burst = 0;
+  bool ok = false;
+};
+
+static unsigned char TestByte(size_t pos) {
+  return (unsigned char)(pos * 31 + (pos >> 13));
+}
+
+static void OnRelayRead(bufferevent *bev, void *ctx) {
+  TestRelay *relay = (TestRelay *)ctx;
+  evbuffer *input = bufferevent_get_input(bev);
+  bufferevent *to = bev == relay->client ? relay->server : relay->client;
+  if (bev == relay->client && relay->header) {
+    size_t len = std::min(relay->header, evbuffer_get_length(input));
+    evbuffer_drain(input, len);
+    relay->header -= len;
+  }
+  evbuffer_add_buffer(bufferevent_get_output(to), input);
+  if (evbuffer_get_length(bufferevent_get_output(to)) >= TEST_WINDOW) {
+    bufferevent_disable(bev, EV_READ);
+  }
+}
+
+static void OnRelayWrite(bufferevent *bev, void *ctx) {
+  TestRelay *relay = (TestRelay *)ctx;
+  bufferevent_enable(bev == relay->client ? relay->server : relay->client,
+                     EV_READ);
+}
+
+// Stands in for the client session and the server session at once.
+static void OnCarrier(void *ctx, bufferevent *end) {
+  MuxTest *test = (MuxTest *)ctx;
+  TestRelay *relay = &test->relay;
+  relay->client = end;
+  relay->server = mux_accept(test->base, nullptr, &test->options);
+  bufferevent *ends[2] = {relay->client, relay->server};
+  for (bufferevent *bev : ends) {
+    bufferevent_setcb(bev, OnRelayRead, OnRelayWrite, nullptr, relay);
+    bufferevent_setwatermark(bev, EV_WRITE, TEST_WINDOW / 2, 0);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+  }
+}
+
+static void OnEchoRead(bufferevent *bev, void *ctx) {
+  evbuffer *output = bufferevent_get_output(bev);
+  evbuffer_add_buffer(output, bufferevent_get_input(bev));
+  if (evbuffer_get_length(output) >= TEST_WINDOW) {
+    bufferevent_disable(bev, EV_READ);
+  }
+}
+
+static void OnEchoWrite(bufferevent *bev, void *ctx) {
+  bufferevent_enable(bev, EV_READ);
+}
+
+static void OnEchoEvent(bufferevent *bev, short what, void *ctx) {
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    bufferevent_free(bev);
+  }
+}
+
+static void OnEchoAccept(evconnlistener *listener, evutil_socket_t sock,
+                         sockaddr *addr, int addr_len, void *ctx) {
+  bufferevent *bev = bufferevent_socket_new(evconnlistener_get_base(listener),
+                                            sock, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(bev, OnEchoRead, OnEchoWrite, OnEchoEvent, nullptr);
+  bufferevent_setwatermark(bev, EV_WRITE, TEST_WINDOW / 2, 0);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void OnAppWrite(bufferevent *bev, void *ctx) {
+  MuxTest *test = (MuxTest *)ctx;
+  unsigned char data[4096];
+  evbuffer *output = bufferevent_get_output(bev);
+  while (test->sent < TEST_TOTAL &&
+         evbuffer_get_length(output) < TEST_WINDOW * 4) {
+    size_t len = std::min(sizeof(data), (size_t)TEST_TOTAL - test->sent);
+    for (size_t i = 0; i < len; ++i) {
+      data[i] = TestByte(test->sent + i);
+    }
+    evbuffer_add(output, data, len);
+    test->sent += len;
+  }
+}
+
+static void OnAppResume(evutil_socket_t fd, short what, void *ctx) {
+  MuxTest *test = (MuxTest *)ctx;
+  bufferevent_enable(test->app, EV_READ);
+}
+
+static void OnAppRead(bufferevent *bev, void *ctx) {
+  MuxTest *test = (MuxTest *)ctx;
+  unsigned char data[4096];
+  size_t len;
+  while ((len = evbuffer_remove(bufferevent_get_input(bev), data,
+                                sizeof(data))) > 0) {
+    for (size_t i = 0; i < len; ++i) {
+      if (data[i] != TestByte(test->received + i)) {
+        fprintf(stderr, "mux: corrupt at %zu\n", test->received + i);
+        event_base_loopbreak(test->base);
+        return;
+      }
+    }
+    test->received += len;
+    test->burst += len;
+  }
+  if (test->received == TEST_TOTAL) {
+    test->ok = true;
+    event_base_loopbreak(test->base);
+  } else if (test->burst >= TEST_BURST) {
+    static const timeval pause = {0, 2000};
+    test->burst = 0;
+    bufferevent_disable(bev, EV_READ);
+    event_base_once(test->base, -1, EV_TIMEOUT, OnAppResume, test, &pause);
+  }
+}
+
+static void OnAppEvent(bufferevent *bev, short what, void *ctx) {
+  MuxTest *test = (MuxTest *)ctx;
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    fprintf(stderr, "mux: stream closed at %zu\n", test->received);
+    event_base_loopbreak(test->base);
+  }
+}
+
+static void OnTimeout(evutil_socket_t fd, short what, void *ctx) {
+  MuxTest *test = (MuxTest *)ctx;
+  fprintf(stderr, "mux: stalled, %zu sent, %zu echoed\n", test->sent,
+          test->received);
+  event_base_loopbreak(test->base);
+}
+
+int main(int argc, char **argv) {
+  std::string error;
+  network_init();
+  mempool_init(0, false);
+  if (!io_stream_init(false, error)) {
+    quit(error.c_str());
+  }
+
+  MuxTest test;
+  test.base = event_base_new();
+  if (!test.base) {
+    quit("incredible: event_base_new error");
+  }
+  test.options.up_window = TEST_WINDOW;
+  test.options.down_window = TEST_WINDOW;
+  test.options.mux = 1;
+
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  evconnlistener *listener = evconnlistener_new_bind(
+      test.base, OnEchoAccept, nullptr,
+      LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (sockaddr *)&sin,
+      sizeof(sin));
+  if (!listener) {
+    quit("error: echo listener");
+  }
+  socklen_t sin_len = sizeof(sin);
+  getsockname(evconnlistener_get_fd(listener), (sockaddr *)&sin, &sin_len);
+
+  evutil_socket_t pair[2];
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    quit("error: socketpair");
+  }
+  evutil_make_socket_nonblocking(pair[0]);
+  evutil_make_socket_nonblocking(pair[1]);
+
+  mux_client_start(test.base, &test.options, OnCarrier, &test);
+  unsigned char request[1 + 4 + 2] = {1};
+  memcpy(request + 1, &sin.sin_addr, 4);
+  memcpy(request + 5, &sin.sin_port, 2);
+  evbuffer *buf = evbuffer_new();
+  evbuffer_add(buf, request, sizeof(request));
+  mux_open(io_stream_new(test.base, pair[0]), buf);
+
+  test.app = bufferevent_socket_new(test.base, pair[1], BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(test.app, OnAppRead, OnAppWrite, OnAppEvent, &test);
+  bufferevent_setwatermark(test.app, EV_WRITE, TEST_WINDOW, 0);
+  bufferevent_enable(test.app, EV_READ | EV_WRITE);
+  OnAppWrite(test.app, &test);
+
+  timeval timeout = {TEST_TIMEOUT, 0};
+  event_base_once(test.base, -1, EV_TIMEOUT, OnTimeout, &test, &timeout);
+  event_base_dispatch(test.base);
+
+  mux_dump(stderr);
+  if (!test.ok) return 1;
+  printf("mux: %d bytes echoed through %d byte windows\n", TEST_TOTAL,
+         TEST_WINDOW);
+  return 0;
+}